@@ -0,0 +1,474 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cl/cl.h>
+#include "ocl.hpp"
+#include "ocl_transfer.hpp"
+#include "logging.hpp"
+
+///headless wrapper overhead benchmarks
+///runs on whatever the selected platform gives us, including pocl on a cpu
+///usage: bench [--cpu|--gpu|--all] [--reps N] [--calibrate] [--out file.json] [--baseline file.json] [--threshold 0.1]
+///--calibrate routes transfers through the calibrated dispatcher, otherwise they're all direct
+
+static const char* bench_src = R"(
+__kernel
+void bench_empty(__global int* out, int val)
+{
+}
+
+__kernel
+void bench_four(__global int* a, __global int* b, int c, float d)
+{
+    int id = get_global_id(0);
+
+    if(id == 0)
+        a[0] = b[0] + c + (int)d;
+}
+)";
+
+struct bench_result
+{
+    std::string name;
+    double value = 0;
+    std::string unit;
+    bool higher_is_better = false;
+};
+
+static double now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+///median of reps runs of func, each run being inner iterations. Returns ns per iteration
+template<typename T>
+double median_ns(int reps, int inner, T&& func)
+{
+    std::vector<double> times;
+
+    for(int i=0; i < reps; i++)
+    {
+        double start = now_ns();
+
+        for(int j=0; j < inner; j++)
+        {
+            func();
+        }
+
+        times.push_back((now_ns() - start) / inner);
+    }
+
+    std::sort(times.begin(), times.end());
+
+    return times[times.size() / 2];
+}
+
+static double gbps(int64_t bytes, double ns)
+{
+    if(ns <= 0)
+        return 0;
+
+    return bytes / ns;
+}
+
+static std::string size_name(int64_t bytes)
+{
+    if(bytes >= 1024 * 1024)
+        return std::to_string(bytes / (1024 * 1024)) + "MB";
+
+    return std::to_string(bytes / 1024) + "KB";
+}
+
+static void write_json(std::ostream& out, const std::string& device, const std::vector<bench_result>& results)
+{
+    out << "{\n";
+    out << "  \"device\": \"" << device << "\",\n";
+    out << "  \"results\": [\n";
+
+    for(int i=0; i < (int)results.size(); i++)
+    {
+        const bench_result& r = results[i];
+
+        out << "    {\"name\": \"" << r.name << "\", \"value\": " << r.value << ", \"unit\": \"" << r.unit << "\", \"higher_is_better\": " << (r.higher_is_better ? "true" : "false") << "}";
+
+        if(i != (int)results.size() - 1)
+            out << ",";
+
+        out << "\n";
+    }
+
+    out << "  ]\n";
+    out << "}\n";
+}
+
+///only needs to read back what write_json produces, one result per line
+static std::map<std::string, double> read_baseline(const std::string& file)
+{
+    std::map<std::string, double> ret;
+
+    std::ifstream in(file);
+
+    if(!in.good())
+    {
+        lg::error("Could not open baseline ", file);
+        return ret;
+    }
+
+    std::string line;
+
+    while(std::getline(in, line))
+    {
+        size_t name_pos = line.find("\"name\": \"");
+        size_t value_pos = line.find("\"value\": ");
+
+        if(name_pos == std::string::npos || value_pos == std::string::npos)
+            continue;
+
+        name_pos += strlen("\"name\": \"");
+        value_pos += strlen("\"value\": ");
+
+        size_t name_end = line.find('"', name_pos);
+
+        if(name_end == std::string::npos)
+            continue;
+
+        ret[line.substr(name_pos, name_end - name_pos)] = atof(line.c_str() + value_pos);
+    }
+
+    return ret;
+}
+
+///returns the number of regressions
+static int compare_baseline(const std::vector<bench_result>& results, const std::map<std::string, double>& baseline, double threshold)
+{
+    int regressions = 0;
+
+    for(const bench_result& r : results)
+    {
+        auto it = baseline.find(r.name);
+
+        if(it == baseline.end() || it->second == 0)
+            continue;
+
+        double ratio = r.value / it->second;
+
+        ///normalise so > 1 is always worse
+        double worse = r.higher_is_better ? 1 / std::max(ratio, 1e-12) : ratio;
+
+        const char* tag = "ok  ";
+
+        if(worse > 1 + threshold)
+        {
+            tag = "SLOW";
+            regressions++;
+        }
+        else if(worse < 1 - threshold)
+        {
+            tag = "FAST";
+        }
+
+        std::cerr << tag << " " << r.name << " " << it->second << " -> " << r.value << " " << r.unit << std::endl;
+    }
+
+    return regressions;
+}
+
+int main(int argc, char* argv[])
+{
+    cl_device_type type = CL_DEVICE_TYPE_ALL;
+    int reps = 9;
+    std::string out_file;
+    std::string baseline_file;
+    double threshold = 0.1;
+    bool calibrate = false;
+
+    for(int i=1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if(arg == "--cpu")
+            type = CL_DEVICE_TYPE_CPU;
+        else if(arg == "--gpu")
+            type = CL_DEVICE_TYPE_GPU;
+        else if(arg == "--all")
+            type = CL_DEVICE_TYPE_ALL;
+        else if(arg == "--calibrate")
+            calibrate = true;
+        else if(arg == "--reps" && i + 1 < argc)
+            reps = std::max(atoi(argv[++i]), 1);
+        else if(arg == "--out" && i + 1 < argc)
+            out_file = argv[++i];
+        else if(arg == "--baseline" && i + 1 < argc)
+            baseline_file = argv[++i];
+        else if(arg == "--threshold" && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else
+        {
+            std::cerr << "Unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    ///keep stdout clean for the json
+    lg::set_logfile("./bench_log.txt");
+
+    cl::context ctx(type, false);
+
+    cl::command_queue cqueue(ctx);
+
+    if(calibrate)
+        cl::calibrate_transfers(cqueue);
+
+    std::vector<bench_result> results;
+
+    auto add = [&](const std::string& name, double value, const std::string& unit, bool higher_is_better = false)
+    {
+        bench_result r;
+        r.name = name;
+        r.value = value;
+        r.unit = unit;
+        r.higher_is_better = higher_is_better;
+
+        results.push_back(r);
+    };
+
+    ///register_program
+    {
+        double ns = median_ns(std::max(reps / 3, 1), 1, [&]()
+        {
+            cl::program p(ctx, bench_src, false);
+            p.build_with(ctx, "");
+
+            ctx.register_program(p);
+        });
+
+        add("register_program", ns / 1000. / 1000., "ms");
+    }
+
+    cl::buffer small(ctx);
+    small.alloc(cqueue, std::vector<int>{0, 0, 0, 0});
+
+    cl::buffer small2(ctx);
+    small2.alloc(cqueue, std::vector<int>{0, 0, 0, 0});
+
+    cl::kernel& empty = ctx.kernels["bench_empty"];
+
+    const int dispatches = 1000;
+
+    ///args setup
+    {
+        int c = 1;
+        float d = 2;
+
+        double ns = median_ns(reps, dispatches, [&]()
+        {
+            cl::args a;
+            a.push_back(small);
+            a.push_back(small2);
+            a.push_back(c);
+            a.push_back(d);
+        });
+
+        add("args_setup_4", ns, "ns");
+    }
+
+    ///exec dispatch latency, per dispatch with one queue drain at the end
+    {
+        int val = 0;
+
+        cl::args a;
+        a.push_back(small);
+        a.push_back(val);
+
+        double by_name = median_ns(reps, 1, [&]()
+        {
+            for(int i=0; i < dispatches; i++)
+                cqueue.exec("bench_empty", a, {1}, {1});
+
+            cqueue.block();
+        }) / dispatches;
+
+        double by_kernel = median_ns(reps, 1, [&]()
+        {
+            for(int i=0; i < dispatches; i++)
+                cqueue.exec(empty, a, {1}, {1});
+
+            cqueue.block();
+        }) / dispatches;
+
+        double raw = median_ns(reps, 1, [&]()
+        {
+            size_t g_ws[1] = {1};
+            size_t l_ws[1] = {1};
+
+            for(int i=0; i < dispatches; i++)
+            {
+                clSetKernelArg(empty.ckernel, 0, sizeof(cl_mem), &small.get());
+                clSetKernelArg(empty.ckernel, 1, sizeof(int), &val);
+
+                clEnqueueNDRangeKernel(cqueue, empty.ckernel, 1, nullptr, g_ws, l_ws, 0, nullptr, nullptr);
+            }
+
+            cqueue.block();
+        }) / dispatches;
+
+        add("exec_by_name", by_name, "ns");
+        add("exec_by_kernel", by_kernel, "ns");
+        add("exec_raw", raw, "ns");
+        add("exec_overhead", by_kernel - raw, "ns");
+
+        ///single dispatch round trip
+        double round_trip = median_ns(reps, 100, [&]()
+        {
+            cqueue.exec(empty, a, {1}, {1});
+            cqueue.block();
+        });
+
+        add("exec_round_trip", round_trip, "ns");
+
+        ///event overhead, exec with an output event then release it
+        double with_event = median_ns(reps, 1, [&]()
+        {
+            std::vector<cl::event> evts;
+            evts.resize(dispatches);
+
+            for(int i=0; i < dispatches; i++)
+                cqueue.exec(empty, a, {1}, {1}, &evts[i]);
+
+            cqueue.block();
+
+            for(cl::event& e : evts)
+                clReleaseEvent(e.cevent);
+        }) / dispatches;
+
+        add("exec_with_event", with_event, "ns");
+        add("event_overhead", with_event - by_kernel, "ns");
+
+        double chained = median_ns(reps, 1, [&]()
+        {
+            std::vector<cl::event> evts;
+            evts.resize(dispatches);
+
+            for(int i=0; i < dispatches; i++)
+            {
+                std::vector<cl::event*> deps;
+
+                if(i > 0)
+                    deps.push_back(&evts[i-1]);
+
+                cqueue.exec(empty, a, {1}, {1}, &evts[i], deps);
+            }
+
+            evts.back().block();
+
+            for(cl::event& e : evts)
+                clReleaseEvent(e.cevent);
+        }) / dispatches;
+
+        add("exec_chained_event", chained, "ns");
+    }
+
+    ///transfer bandwidth across sizes, in bytes per ns == GB/s
+    for(int64_t bytes = 4 * 1024; bytes <= 64 * 1024 * 1024; bytes *= 8)
+    {
+        int num = bytes / sizeof(float);
+
+        std::vector<float> host;
+        host.resize(num);
+
+        for(int i=0; i < num; i++)
+            host[i] = i;
+
+        cl::buffer buf(ctx);
+        buf.alloc(cqueue, host);
+
+        int inner = std::max((int)((16 * 1024 * 1024) / bytes), 1);
+
+        std::string sname = size_name(bytes);
+
+        double write_all = median_ns(reps, inner, [&]()
+        {
+            buf.write_all(cqueue, host);
+        });
+
+        double read_all = median_ns(reps, inner, [&]()
+        {
+            std::vector<float> ret = buf.read_all<float>(cqueue);
+        });
+
+        double async_write = median_ns(reps, inner, [&]()
+        {
+            cl::write_event<float> evt = buf.async_write(cqueue, host);
+            evt.block();
+            evt.del();
+        });
+
+        double async_read = median_ns(reps, inner, [&]()
+        {
+            cl::read_event<float> evt = buf.async_read<float>(cqueue, {0, 0}, {num, 1});
+            evt.block();
+            evt.del();
+        });
+
+        double map_write = median_ns(reps, inner, [&]()
+        {
+            void* ptr = cqueue.map(buf, CL_MAP_WRITE);
+
+            if(ptr)
+                memcpy(ptr, &host[0], bytes);
+
+            cqueue.unmap(buf, ptr);
+            cqueue.block();
+        });
+
+        double map_read = median_ns(reps, inner, [&]()
+        {
+            void* ptr = cqueue.map(buf, CL_MAP_READ);
+
+            if(ptr)
+                memcpy(&host[0], ptr, bytes);
+
+            cqueue.unmap(buf, ptr);
+            cqueue.block();
+        });
+
+        add("write_all_" + sname, gbps(bytes, write_all), "GB/s", true);
+        add("read_all_" + sname, gbps(bytes, read_all), "GB/s", true);
+        add("async_write_" + sname, gbps(bytes, async_write), "GB/s", true);
+        add("async_read_" + sname, gbps(bytes, async_read), "GB/s", true);
+        add("map_write_" + sname, gbps(bytes, map_write), "GB/s", true);
+        add("map_read_" + sname, gbps(bytes, map_read), "GB/s", true);
+
+        buf.release();
+    }
+
+    small.release();
+    small2.release();
+
+    if(out_file.size() > 0)
+    {
+        std::ofstream out(out_file);
+        write_json(out, ctx.device_name, results);
+    }
+    else
+    {
+        write_json(std::cout, ctx.device_name, results);
+    }
+
+    if(baseline_file.size() > 0)
+    {
+        int regressions = compare_baseline(results, read_baseline(baseline_file), threshold);
+
+        if(regressions > 0)
+        {
+            std::cerr << regressions << " regressions over " << threshold * 100 << "%" << std::endl;
+            return 2;
+        }
+    }
+
+    return 0;
+}
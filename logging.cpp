@@ -2,6 +2,7 @@
 
 std::string lg::logfile;
 std::ofstream* lg::output;
+std::atomic<int> lg::runtime_level{(int)lg::level::info};
 
 void lg::set_logfile(const std::string& file)
 {
@@ -24,6 +25,16 @@ void lg::redirect_to_stdout()
     r2->rdbuf(b1);
 }
 
+void lg::set_level(level l)
+{
+    runtime_level.store((int)l, std::memory_order_relaxed);
+}
+
+lg::level lg::get_level()
+{
+    return (level)runtime_level.load(std::memory_order_relaxed);
+}
+
 /*void lg::log(const std::string& str)
 {
     output << str << std::endl;
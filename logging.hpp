@@ -4,16 +4,44 @@
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+///compile time minimum severity, LG_TRACE/LG_DEBUG below this compile to nothing, arguments included
+///the plain functions skip the logging but their arguments are still evaluated at the call site
+///0 = trace, 1 = debug, 2 = info, 3 = warn, 4 = error, 5 = off
+#ifndef LG_MIN_LEVEL
+#define LG_MIN_LEVEL 0
+#endif
 
 namespace lg
 {
+    enum class level : int
+    {
+        trace = 0,
+        debug = 1,
+        info = 2,
+        warn = 3,
+        error = 4,
+        off = 5,
+    };
+
     extern std::ofstream* output;
 
     extern std::string logfile;
 
+    ///runtime minimum severity, defaults to info
+    extern std::atomic<int> runtime_level;
+
     void set_logfile(const std::string& file);
     void redirect_to_stdout();
 
+    void set_level(level l);
+    level get_level();
+
     //void log(const std::string& txt);
 
     /*template<typename T>
@@ -90,6 +118,121 @@ namespace lg
 
         *output << std::endl;
     }
+
+    inline
+    bool
+    enabled(level l)
+    {
+        return (int)l >= runtime_level.load(std::memory_order_relaxed);
+    }
+
+    ///the if constexpr discards the whole body for levels under LG_MIN_LEVEL
+    ///otherwise its a single relaxed load before we touch any of the arguments
+    template<level L, typename... T>
+    inline
+    void
+    log_at(T&&... param)
+    {
+        if constexpr((int)L >= LG_MIN_LEVEL && L != level::off)
+        {
+            if(!enabled(L))
+                return;
+
+            log(param...);
+        }
+    }
+
+    template<typename... T> inline void trace(T&&... param) {log_at<level::trace>(param...);}
+    template<typename... T> inline void debug(T&&... param) {log_at<level::debug>(param...);}
+    template<typename... T> inline void info(T&&... param)  {log_at<level::info>(param...);}
+    template<typename... T> inline void warn(T&&... param)  {log_at<level::warn>(param...);}
+    template<typename... T> inline void error(T&&... param) {log_at<level::error>(param...);}
+
+    ///one of these per log site, usually a function local static
+    ///lets through one message per interval and counts the rest
+    struct rate_limiter
+    {
+        int64_t interval_ms = 1000;
+
+        std::atomic<int64_t> next_allowed_ms{0};
+        std::atomic<int> suppressed{0};
+
+        rate_limiter(int64_t interval_ms = 1000) : interval_ms(interval_ms) {}
+
+        ///returns -1 if this message should be dropped
+        ///otherwise returns how many were dropped since the last one got through
+        int acquire()
+        {
+            int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+            int64_t next = next_allowed_ms.load(std::memory_order_relaxed);
+
+            if(now < next || !next_allowed_ms.compare_exchange_strong(next, now + interval_ms, std::memory_order_relaxed))
+            {
+                suppressed.fetch_add(1, std::memory_order_relaxed);
+                return -1;
+            }
+
+            return suppressed.exchange(0, std::memory_order_relaxed);
+        }
+    };
+
+    template<level L, typename... T>
+    inline
+    void
+    log_limited(rate_limiter& limit, T&&... param)
+    {
+        if constexpr((int)L >= LG_MIN_LEVEL && L != level::off)
+        {
+            if(!enabled(L))
+                return;
+
+            int dropped = limit.acquire();
+
+            if(dropped < 0)
+                return;
+
+            if(dropped > 0)
+                log(param..., " (", dropped, " similar suppressed)");
+            else
+                log(param...);
+        }
+    }
+
+    template<typename... T> inline void warn_limited(rate_limiter& limit, T&&... param)  {log_limited<level::warn>(limit, param...);}
+    template<typename... T> inline void error_limited(rate_limiter& limit, T&&... param) {log_limited<level::error>(limit, param...);}
+
+    ///for log sites that report on lots of different things, eg kernel names
+    ///each key gets its own rate_limiter, so one that fails every frame doesn't hide the rest
+    struct keyed_rate_limiter
+    {
+        int64_t interval_ms = 1000;
+
+        std::mutex mut;
+        std::map<std::string, rate_limiter> limits;
+
+        keyed_rate_limiter(int64_t interval_ms = 1000) : interval_ms(interval_ms) {}
+
+        rate_limiter& get(const std::string& key)
+        {
+            std::lock_guard guard(mut);
+
+            return limits.try_emplace(key, interval_ms).first->second;
+        }
+    };
 };
 
+///the arguments are only evaluated once the runtime level lets the message through
+#if LG_MIN_LEVEL <= 0
+#define LG_TRACE(...) do{if(lg::enabled(lg::level::trace)) lg::log(__VA_ARGS__);}while(0)
+#else
+#define LG_TRACE(...) do{}while(0)
+#endif
+
+#if LG_MIN_LEVEL <= 1
+#define LG_DEBUG(...) do{if(lg::enabled(lg::level::debug)) lg::log(__VA_ARGS__);}while(0)
+#else
+#define LG_DEBUG(...) do{}while(0)
+#endif
+
 #endif // LOGGING_HPP_INCLUDED
@@ -1,14 +1,25 @@
 #include "ocl.hpp"
+#include "ocl_transfer.hpp"
+#include "ocl_reclaim.hpp"
+#include "ocl_half.hpp"
+#include "ocl_stats.hpp"
 #include <sstream>
 #include "logging.hpp"
 #include <cstring>
+
+///OCL_HEADLESS builds without any windowing or opengl headers, for the benchmark and replay tools or a plain compute build
+///gl sharing and cl_gl_interop_texture are unavailable, and report an error if they're used
+#ifndef OCL_HEADLESS
 #include <cl/cl_gl.h>
 
 #include <windows.h>
 
 #include <gl/gl.h>
 #include <gl/glext.h>
+#endif // OCL_HEADLESS
+
 #include <assert.h>
+#include <thread>
 
 inline
 std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems) {
@@ -27,7 +38,7 @@ std::vector<std::string> split(const std::string &s, char delim) {
     return elems;
 }
 
-bool supports_extension(cl_device_id device, const std::string& ext_name)
+bool cl::supports_extension(cl_device_id device, const std::string& ext_name)
 {
     size_t rsize;
 
@@ -50,7 +61,18 @@ bool supports_extension(cl_device_id device, const std::string& ext_name)
     return false;
 }
 
-cl_int cl::get_platform_ids(cl_platform_id* clSelectedPlatformID)
+///some platforms only expose some device types, eg nvidia has no cpu device and pocl has no gpu
+static bool platform_has_device_type(cl_platform_id platform, cl_device_type type)
+{
+    cl_uint num = 0;
+
+    if(clGetDeviceIDs(platform, type, 0, nullptr, &num) != CL_SUCCESS)
+        return false;
+
+    return num > 0;
+}
+
+cl_int cl::get_platform_ids(cl_platform_id* clSelectedPlatformID, cl_device_type type)
 {
     char chBuffer[1024];
     cl_uint num_platforms;
@@ -63,7 +85,7 @@ cl_int cl::get_platform_ids(cl_platform_id* clSelectedPlatformID)
 
     if(ciErrNum != CL_SUCCESS)
     {
-        lg::log("Error ", ciErrNum, " in clGetPlatformIDs");
+        lg::error("Error ", ciErrNum, " in clGetPlatformIDs");
 
         return -1000;
     }
@@ -71,7 +93,7 @@ cl_int cl::get_platform_ids(cl_platform_id* clSelectedPlatformID)
     {
         if(num_platforms == 0)
         {
-            lg::log("Could not find valid opencl platform, num_platforms == 0");
+            lg::error("Could not find valid opencl platform, num_platforms == 0");
 
             return -2000;
         }
@@ -79,14 +101,20 @@ cl_int cl::get_platform_ids(cl_platform_id* clSelectedPlatformID)
         {
             if((clPlatformIDs = (cl_platform_id*)malloc(num_platforms * sizeof(cl_platform_id))) == NULL)
             {
-                lg::log("Malloc error for allocating platform ids");
+                lg::error("Malloc error for allocating platform ids");
 
                 return -3000;
             }
 
             ciErrNum = clGetPlatformIDs(num_platforms, clPlatformIDs, NULL);
-            lg::log("Available platforms:");
-            lg::log("Num platforms: ", num_platforms);
+            lg::info("Available platforms:");
+            lg::info("Num platforms: ", num_platforms);
+
+            ///the gpu vendors are only preferred when we're after a gpu, otherwise eg pocl could never be picked for a cpu
+            bool prefer_vendor = (type & CL_DEVICE_TYPE_GPU) != 0;
+
+            cl_platform_id first_with_type = NULL;
+            cl_uint first_with_type_idx = 0;
 
             for(i = 0; i < num_platforms; ++i)
             {
@@ -94,20 +122,35 @@ cl_int cl::get_platform_ids(cl_platform_id* clSelectedPlatformID)
 
                 if(ciErrNum == CL_SUCCESS)
                 {
-                    lg::log("platform ", i, " ", chBuffer);
+                    lg::info("platform ", i, " ", chBuffer);
 
-                    if(strstr(chBuffer, "NVIDIA") != NULL || strstr(chBuffer, "AMD") != NULL)// || strstr(chBuffer, "Intel") != NULL)
+                    if(!platform_has_device_type(clPlatformIDs[i], type))
+                        continue;
+
+                    if(first_with_type == NULL)
                     {
-                        lg::log("selected platform ", i);
+                        first_with_type = clPlatformIDs[i];
+                        first_with_type_idx = i;
+                    }
+
+                    if(prefer_vendor && (strstr(chBuffer, "NVIDIA") != NULL || strstr(chBuffer, "AMD") != NULL))// || strstr(chBuffer, "Intel") != NULL)
+                    {
+                        lg::info("selected platform ", i);
                         *clSelectedPlatformID = clPlatformIDs[i];
                         //break;
                     }
                 }
             }
 
+            if(*clSelectedPlatformID == NULL && first_with_type != NULL)
+            {
+                lg::info("selected platform ", first_with_type_idx);
+                *clSelectedPlatformID = first_with_type;
+            }
+
             if(*clSelectedPlatformID == NULL)
             {
-                lg::log("selected platform ", num_platforms-1);
+                lg::info("selected platform ", num_platforms-1);
                 *clSelectedPlatformID = clPlatformIDs[num_platforms-1];
             }
 
@@ -133,40 +176,52 @@ std::string read_file(const std::string& file)
     return buffer;
 }
 
-cl::context::context()
+cl::context::context() : context(CL_DEVICE_TYPE_GPU, true)
+{
+
+}
+
+cl::context::context(cl_device_type type, bool gl_sharing, bool use_all_devices) : device_type(type), share_gl(gl_sharing), all_devices(use_all_devices)
 {
     kernels.clear();
 
+    ///up front, the accounting hooks are called from stream, host task and pool threads so none of these can be created on first use
+    stats = std::make_shared<context_stats>();
+    transfers = std::make_shared<transfer_state>();
+    reclaim = std::make_shared<reclaim_state>();
+
     cl_int error = 0;   // Used to handle error codes
 
-    error = get_platform_ids(&platform);
+    error = get_platform_ids(&platform, device_type);
 
     if(error != CL_SUCCESS)
     {
-        lg::log("Error getting platform id: ", error);
+        lg::error("Error getting platform id: ", error);
 
         exit(error);
     }
     else
     {
-        lg::log("Got platform IDs");
+        lg::info("Got platform IDs");
     }
 
     cl_uint num;
 
-    error = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, devices, &num);
+    error = clGetDeviceIDs(platform, device_type, all_devices ? 100 : 1, devices, &num);
+
+    lg::info("Found ", num, " devices");
 
-    lg::log("Found ", num, " devices");
+    num_devices = all_devices ? std::min(num, (cl_uint)100) : 1;
 
     if(error != CL_SUCCESS)
     {
-        lg::log("Error getting device ids: ", error);
+        lg::error("Error getting device ids: ", error);
 
         exit(error);
     }
     else
     {
-        lg::log("Got device ids");
+        lg::info("Got device ids");
     }
 
     selected_device = devices[0];
@@ -177,6 +232,33 @@ cl::context::context()
 
     device_name = dname;
 
+    for(cl_uint i=1; i < num_devices; i++)
+    {
+        char extra_name[1000] = {0};
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_NAME, 999, &extra_name[0], nullptr);
+
+        lg::info("Using device ", i, " ", extra_name);
+    }
+
+    host_unified_memory = true;
+
+    for(cl_uint i=0; i < num_devices; i++)
+    {
+        cl_bool unified = CL_FALSE;
+        cl_uint align_bits = 1024;
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unified, nullptr);
+        clGetDeviceInfo(devices[i], CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align_bits, nullptr);
+
+        host_unified_memory = host_unified_memory && unified == CL_TRUE;
+        mem_base_align = std::max(mem_base_align, (int64_t)align_bits / 8);
+    }
+
+    if(host_unified_memory)
+        lg::info("Host unified memory, buffers default to zero copy");
+
+    #ifndef OCL_HEADLESS
     ///this is essentially black magic
     cl_context_properties props[] =
     {
@@ -185,21 +267,41 @@ cl::context::context()
         CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
         0
     };
+    #else
+    if(share_gl)
+    {
+        lg::error("Built with OCL_HEADLESS, gl sharing is unavailable");
+
+        share_gl = false;
+    }
+
+    cl_context_properties* props = nullptr;
+    #endif // OCL_HEADLESS
+
+    ///headless, eg benchmarks or a cpu device
+    cl_context_properties props_nogl[] =
+    {
+        CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+        0
+    };
 
-    ccontext = clCreateContext(props, 1, &selected_device, NULL, NULL, &error);
+    ccontext = clCreateContext(share_gl ? props : props_nogl, num_devices, devices, NULL, NULL, &error);
 
     if(error != CL_SUCCESS)
     {
-        lg::log("Error creating context: ", error);
+        lg::error("Error creating context: ", error);
 
-        lg::log("Do you have a valid OpenGL context?");
+        if(share_gl)
+            lg::error("Do you have a valid OpenGL context?");
 
         exit(error);
     }
     else
     {
-        lg::log("Created context");
+        lg::info("Created context");
     }
+
+    reclaim->ctx = ccontext;
 }
 
 void cl::context::register_program(program& p)
@@ -211,7 +313,7 @@ void cl::context::register_program(program& p)
 
     if(err != CL_SUCCESS)
     {
-        lg::log("Error creating program ", err);
+        lg::error("Error creating program ", err);
         return;
     }
 
@@ -228,7 +330,7 @@ void cl::context::register_program(program& p)
 
         k1.name.resize(strlen(k1.name.c_str()));
 
-        lg::log("Registered ", k1.name);
+        LG_DEBUG("Registered ", k1.name);
 
         kernels[k1.name] = k1;
     }
@@ -236,7 +338,7 @@ void cl::context::register_program(program& p)
 
 void cl::context::rebuild()
 {
-    *this = cl::context();
+    *this = cl::context(device_type, share_gl, all_devices);
 }
 
 bool file_exists(const std::string& file_name)
@@ -245,11 +347,22 @@ bool file_exists(const std::string& file_name)
     return file.good();
 }
 
-cl::program::program(context& ctx, const std::string& fname, bool is_file) : saved_context(ctx), saved_fname(fname)
+///every program gets the half helpers in front of it, see ocl_half.hpp
+static cl_program create_program_from_source(cl_context cctx, const std::string& src, cl_int* err)
+{
+    const std::string& helpers = cl::half_kernel_helpers();
+
+    const char* strings[2] = {helpers.c_str(), src.c_str()};
+    size_t lengths[2] = {helpers.length(), src.length()};
+
+    return clCreateProgramWithSource(cctx, 2, strings, lengths, err);
+}
+
+cl::program::program(context& ctx, const std::string& fname, bool is_file) : saved_context(ctx), saved_fname(fname), saved_is_file(is_file)
 {
     if(is_file && !file_exists(fname))
     {
-        lg::log("File", fname, "does not exist");
+        lg::error("File", fname, "does not exist");
         exit(5);
     }
 
@@ -260,47 +373,308 @@ cl::program::program(context& ctx, const std::string& fname, bool is_file) : sav
     else
         src = fname;
 
-    size_t len = src.length();
-    const char* ptr = src.c_str();
+    saved_source = src;
 
-    cprogram = clCreateProgramWithSource(ctx.get(), 1, &ptr, &len, nullptr);
+    cprogram = create_program_from_source(ctx.get(), src, nullptr);
+}
+
+static std::vector<char> read_binary_file(const std::string& file)
+{
+    std::vector<char> ret;
+
+    FILE* f = fopen(file.c_str(), "rb");
+
+    if(f == nullptr)
+        return ret;
+
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if(fsize > 0)
+    {
+        ret.resize(fsize);
+
+        if(fread(&ret[0], fsize, 1, f) != 1)
+            ret.clear();
+    }
+
+    fclose(f);
+
+    return ret;
+}
+
+static bool supports_il(cl_device_id device)
+{
+    size_t rsize = 0;
+
+    if(clGetDeviceInfo(device, CL_DEVICE_IL_VERSION, 0, nullptr, &rsize) != CL_SUCCESS || rsize <= 1)
+        return false;
+
+    std::string version;
+    version.resize(rsize);
+
+    clGetDeviceInfo(device, CL_DEVICE_IL_VERSION, rsize, &version[0], nullptr);
+
+    return version.find("SPIR-V") != std::string::npos;
+}
+
+static bool supports_il(cl::context& ctx)
+{
+    for(cl_uint i=0; i < ctx.num_devices; i++)
+    {
+        if(!supports_il(ctx.devices[i]))
+            return false;
+    }
+
+    return true;
+}
+
+cl::program::program(context& ctx, const il_file& il, const std::string& fallback, bool fallback_is_file) : saved_context(ctx), saved_fname(fallback), saved_is_file(fallback_is_file), saved_il_fname(il.fname)
+{
+    ///variants need -D which il ignores, so they always build from the fallback source
+    if(fallback.size() > 0)
+    {
+        if(!fallback_is_file)
+            saved_source = fallback;
+        else if(file_exists(fallback))
+            saved_source = read_file(fallback);
+    }
+
+    #ifdef CL_VERSION_2_1
+    if(supports_il(ctx))
+    {
+        std::vector<char> data = read_binary_file(il.fname);
+
+        if(data.size() > 0)
+        {
+            cl_int err = CL_SUCCESS;
+
+            cprogram = clCreateProgramWithIL(ctx.get(), &data[0], data.size(), &err);
+
+            if(err == CL_SUCCESS)
+            {
+                is_il = true;
+
+                LG_DEBUG("Loaded il ", il.fname);
+
+                return;
+            }
+
+            lg::warn("clCreateProgramWithIL failed for ", il.fname, " err ", err);
+        }
+        else
+        {
+            lg::warn("Could not read il ", il.fname);
+        }
+    }
+    #endif // CL_VERSION_2_1
+
+    if(saved_source.size() == 0)
+    {
+        lg::error("No il support or il for ", il.fname, " and no fallback source");
+        exit(5);
+    }
+
+    lg::info("Falling back to source for ", il.fname);
+
+    cprogram = create_program_from_source(ctx.get(), saved_source, nullptr);
 }
 
 void cl::program::rebuild()
 {
-    *this = program(saved_context, saved_fname);
+    if(saved_il_fname.size() > 0)
+        *this = program(saved_context, il_file{saved_il_fname}, saved_fname, saved_is_file);
+    else
+        *this = program(saved_context, saved_fname, saved_is_file);
+}
+
+static std::string get_build_options(const std::string& options)
+{
+    return "-cl-fast-relaxed-math -cl-no-signed-zeros -cl-single-precision-constant -cl-denorms-are-zero " + options;
+}
+
+static std::string get_build_log(cl_program prog, cl_device_id device)
+{
+    std::string log;
+    size_t log_size = 0;
+
+    clGetProgramBuildInfo(prog, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
+
+    log.resize(log_size + 1);
+
+    clGetProgramBuildInfo(prog, device, CL_PROGRAM_BUILD_LOG, log.size(), &log[0], nullptr);
+
+    return log;
 }
 
 void cl::program::build_with(context& ctx, const std::string& options)
 {
-    std::string build_options = "-cl-fast-relaxed-math -cl-no-signed-zeros -cl-single-precision-constant -cl-denorms-are-zero " + options;
+    saved_options = options;
+
+    std::string build_options = get_build_options(options);
 
-    cl_int build_status = clBuildProgram(cprogram, 1, &ctx.selected_device, build_options.c_str(), nullptr, nullptr);
+    cl_int build_status = clBuildProgram(cprogram, ctx.num_devices, ctx.devices, build_options.c_str(), nullptr, nullptr);
 
     if(build_status != CL_SUCCESS)
     {
-        lg::log("Build Error");
+        lg::error("Build Error");
 
         cl_build_status bstatus;
         clGetProgramBuildInfo(cprogram, ctx.selected_device, CL_PROGRAM_BUILD_STATUS, sizeof(cl_build_status), &bstatus, nullptr);
 
-        lg::log("Err: ", bstatus);
+        lg::error("Err: ", bstatus);
 
         assert(bstatus == CL_BUILD_ERROR);
 
-        std::string log;
-        size_t log_size;
+        lg::error(get_build_log(cprogram, ctx.selected_device));
 
-        clGetProgramBuildInfo(cprogram, ctx.selected_device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
+        exit(4);
+    }
+}
 
-        log.resize(log_size + 1);
+cl::program_variant& cl::program::get_variant(const std::map<std::string, int64_t>& defines, bool block)
+{
+    ///std::map is ordered so this is canonical for a given define set
+    std::string key;
 
-        clGetProgramBuildInfo(cprogram, ctx.selected_device, CL_PROGRAM_BUILD_LOG, log.size(), &log[0], nullptr);
+    for(auto& i : defines)
+    {
+        key += " -D " + i.first + "=" + std::to_string(i.second);
+    }
 
-        lg::log(log);
+    auto it = variants.find(key);
 
-        exit(4);
+    if(it != variants.end())
+    {
+        if(block)
+            it->second->block();
+
+        return *it->second;
+    }
+
+    std::shared_ptr<program_variant> var = std::make_shared<program_variant>();
+    var->defines = key;
+    var->ctx = &saved_context;
+
+    variants[key] = var;
+
+    std::shared_ptr<std::promise<void>> finished = std::make_shared<std::promise<void>>();
+    var->done = finished->get_future().share();
+
+    if(saved_source.size() == 0)
+    {
+        lg::error("No source to build variant", key, " from, il programs need a fallback source");
+
+        var->failed = true;
+        finished->set_value();
+
+        return *var;
+    }
+
+    cl_context cctx = saved_context.ccontext;
+    cl_device_id device = saved_context.selected_device;
+    std::vector<cl_device_id> build_devices(saved_context.devices, saved_context.devices + saved_context.num_devices);
+    std::string src = saved_source;
+    std::string options = get_build_options(saved_options + key);
+
+    ///the thread owns a reference so the variant outliving its program is fine
+    std::thread([=]()
+    {
+        cl_int err = CL_SUCCESS;
+
+        cl_program prog = create_program_from_source(cctx, src, &err);
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Could not create variant program for", key, " err ", err);
+
+            var->failed = true;
+            finished->set_value();
+            return;
+        }
+
+        err = clBuildProgram(prog, build_devices.size(), &build_devices[0], options.c_str(), nullptr, nullptr);
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Variant build error for", key);
+            lg::error(get_build_log(prog, device));
+
+            clReleaseProgram(prog);
+
+            var->failed = true;
+            finished->set_value();
+            return;
+        }
+
+        cl_uint num = 0;
+        clCreateKernelsInProgram(prog, 0, nullptr, &num);
+
+        std::vector<cl_kernel> cl_kernels;
+        cl_kernels.resize(num + 1);
+
+        clCreateKernelsInProgram(prog, num, &cl_kernels[0], nullptr);
+
+        cl_kernels.resize(num);
+
+        for(cl_kernel& k : cl_kernels)
+        {
+            cl::kernel k1(k);
+
+            k1.name.resize(strlen(k1.name.c_str()));
+
+            var->kernels[k1.name] = k1;
+        }
+
+        var->cprogram = prog;
+        var->is_ready.store(true, std::memory_order_release);
+
+        LG_DEBUG("Built variant", key);
+
+        finished->set_value();
+    }).detach();
+
+    if(block)
+        var->block();
+
+    return *var;
+}
+
+cl::program_variant::~program_variant()
+{
+    for(auto& i : kernels)
+    {
+        if(i.second.ckernel)
+            clReleaseKernel(i.second.ckernel);
     }
+
+    if(cprogram)
+        clReleaseProgram(cprogram);
+}
+
+cl::kernel& cl::program_variant::get(const std::string& kname)
+{
+    if(ready())
+    {
+        auto it = kernels.find(kname);
+
+        if(it != kernels.end())
+            return it->second;
+    }
+
+    auto it = ctx->kernels.find(kname);
+
+    if(it != ctx->kernels.end())
+        return it->second;
+
+    static lg::keyed_rate_limiter limit;
+
+    lg::error_limited(limit.get(kname), "Kernel with name ", kname, " not found in variant or context");
+
+    static kernel invalid;
+
+    return invalid;
 }
 
 cl::kernel::kernel(program& p, const std::string& kname)
@@ -311,7 +685,7 @@ cl::kernel::kernel(program& p, const std::string& kname)
 
     if(err != CL_SUCCESS)
     {
-        lg::log("Invalid Kernel Name ", kname, " err ", err);
+        lg::error("Invalid Kernel Name ", kname, " err ", err);
     }
 
     name = kname;
@@ -329,7 +703,7 @@ cl::kernel::kernel(cl_kernel& k)
 
     if(err != CL_SUCCESS)
     {
-        lg::log("Invalid kernel create from cl kernel, err ", err);
+        lg::error("Invalid kernel create from cl kernel, err ", err);
     }
 
     name.resize(ret + 1);
@@ -344,19 +718,24 @@ cl::command_queue::command_queue(cl::context& ctx) : command_queue(ctx, 0)
 
 }
 
-cl::command_queue::command_queue(cl::context& ctx, cl_command_queue_properties props) : ctx(ctx)
+cl::command_queue::command_queue(cl::context& ctx, cl_command_queue_properties props) : command_queue(ctx, ctx.selected_device, props)
+{
+
+}
+
+cl::command_queue::command_queue(cl::context& ctx, cl_device_id device, cl_command_queue_properties props) : ctx(ctx), device(device)
 {
     cl_int err;
 
     #ifndef GPU_PROFILE
-    cqueue = clCreateCommandQueue(ctx.get(), ctx.selected_device, props, &err);
+    cqueue = clCreateCommandQueue(ctx.get(), device, props, &err);
     #else
-    cqueue = clCreateCommandQueue(ctx.get(), ctx.selected_device, CL_QUEUE_PROFILING_ENABLE | props, &err);
+    cqueue = clCreateCommandQueue(ctx.get(), device, CL_QUEUE_PROFILING_ENABLE | props, &err);
     #endif
 
     if(err != CL_SUCCESS)
     {
-        lg::log("Error creating command queue");
+        lg::error("Error creating command queue");
     }
 }
 
@@ -365,13 +744,45 @@ void* cl::command_queue::map(buffer& v, cl_map_flags flag, int64_t size)
     if(size == -1)
         size = v.alloc_size;
 
+    cl_map_flags write_flags = CL_MAP_WRITE;
+
+    #ifdef CL_VERSION_1_2
+    write_flags |= CL_MAP_WRITE_INVALIDATE_REGION;
+    #endif // CL_VERSION_1_2
+
+    if(flag & write_flags)
+        v.invalidate_reads();
+
+    stats_map(ctx, true);
+
+    if(v.format == buffer::SVM)
+    {
+        #ifdef CL_VERSION_2_0
+        cl_int err = clEnqueueSVMMap(cqueue, CL_TRUE, flag, v.svm_ptr, size, 0, nullptr, nullptr);
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("error in cl::map svm ", err);
+            return nullptr;
+        }
+
+        capture_map(*this, v, flag, size, v.svm_ptr);
+
+        return v.svm_ptr;
+        #else
+        return nullptr;
+        #endif // CL_VERSION_2_0
+    }
+
     void* ptr = clEnqueueMapBuffer(cqueue, v, CL_TRUE, flag, 0, size, 0, NULL, NULL, NULL);
 
     if(ptr == nullptr)
     {
-        lg::log("error in cl::map");
+        lg::error("error in cl::map");
     }
 
+    capture_map(*this, v, flag, size, ptr);
+
     return ptr;
 }
 
@@ -380,12 +791,486 @@ void cl::command_queue::unmap(buffer& v, void* ptr)
     if(ptr == nullptr)
         return;
 
+    stats_map(ctx, false);
+
+    ///picks up whatever the host wrote through the mapping
+    capture_unmap(*this, v, ptr);
+
+    if(v.format == buffer::SVM)
+    {
+        #ifdef CL_VERSION_2_0
+        clEnqueueSVMUnmap(cqueue, ptr, 0, nullptr, nullptr);
+        #endif // CL_VERSION_2_0
+
+        return;
+    }
+
     clEnqueueUnmapMemObject(cqueue, v, ptr, 0, NULL, NULL);
 }
 
+void cl::command_queue::svm_prefetch(buffer& v, bool to_host, int64_t offset, int64_t size)
+{
+    if(v.format != buffer::SVM || v.svm_ptr == nullptr)
+        return;
+
+    if(size == -1)
+        size = v.alloc_size - offset;
+
+    #ifdef CL_VERSION_2_1
+    const void* ptr = (char*)v.svm_ptr + offset;
+    size_t ssize = size;
+
+    cl_int err = clEnqueueSVMMigrateMem(cqueue, 1, &ptr, &ssize, to_host ? CL_MIGRATE_MEM_OBJECT_HOST : 0, 0, nullptr, nullptr);
+
+    ///its only a hint, so not being able to do it is fine
+    if(err != CL_SUCCESS)
+        LG_DEBUG("clEnqueueSVMMigrateMem failed ", err);
+    #endif // CL_VERSION_2_1
+}
+
+cl_mem_flags cl::mem_policy::get_access_flags() const
+{
+    cl_mem_flags flags = CL_MEM_READ_WRITE;
+
+    if(device == READ_ONLY)
+        flags = CL_MEM_READ_ONLY;
+
+    if(device == WRITE_ONLY)
+        flags = CL_MEM_WRITE_ONLY;
+
+    #ifdef CL_VERSION_1_2
+    if(host == HOST_WRITE_ONLY)
+        flags |= CL_MEM_HOST_WRITE_ONLY;
+
+    if(host == HOST_READ_ONLY)
+        flags |= CL_MEM_HOST_READ_ONLY;
+
+    if(host == HOST_NO_ACCESS)
+        flags |= CL_MEM_HOST_NO_ACCESS;
+    #endif // CL_VERSION_1_2
+
+    return flags;
+}
+
+void cl::buffer::alloc_bytes(int64_t bytes)
+{
+    alloc_size = bytes;
+    host_ptr = nullptr;
+
+    invalidate_reads();
+
+    cl_mem_flags flags = policy.get_access_flags();
+
+    mem_policy::placement place = policy.place;
+
+    if(place == mem_policy::AUTO || place == mem_policy::USE_HOST_PTR)
+        place = ctx.host_unified_memory ? mem_policy::ALLOC_HOST_PTR : mem_policy::DEVICE;
+
+    ///if the host never looks at it theres nothing to gain
+    if(policy.host == mem_policy::HOST_NO_ACCESS)
+        place = mem_policy::DEVICE;
+
+    zero_copy = place == mem_policy::ALLOC_HOST_PTR;
+
+    if(zero_copy)
+        flags |= CL_MEM_ALLOC_HOST_PTR;
+
+    ///something of the same shape that was retired earlier, if its fence has been reached
+    ctx.reclaim->collect_signalled();
+
+    cmem = ctx.reclaim->acquire(alloc_size, flags);
+
+    if(cmem != nullptr)
+    {
+        account_alloc(alloc_size);
+        return;
+    }
+
+    cl_int err;
+    cmem = clCreateBuffer(ctx, flags, alloc_size, nullptr, &err);
+
+    if(err != CL_SUCCESS)
+    {
+        lg::error("Error allocating buffer ", err);
+        return;
+    }
+
+    account_alloc(alloc_size);
+}
+
+bool cl::buffer::adopt_host_ptr(void* ptr, int64_t bytes)
+{
+    ///whatever this held before, the driver keeps it alive until anything enqueued on it is done
+    if(cmem != nullptr || svm_ptr != nullptr)
+    {
+        release();
+
+        cmem = nullptr;
+    }
+
+    format = BUFFER;
+    alloc_size = bytes;
+
+    invalidate_reads();
+
+    cl_mem_flags flags = policy.get_access_flags();
+
+    bool aligned = ((uintptr_t)ptr % ctx.mem_base_align) == 0;
+
+    if(!aligned)
+    {
+        lg::warn("Host pointer not aligned to ", ctx.mem_base_align, " bytes, copying instead of adopting");
+
+        flags |= CL_MEM_COPY_HOST_PTR;
+
+        host_ptr = nullptr;
+        zero_copy = false;
+    }
+    else
+    {
+        flags |= CL_MEM_USE_HOST_PTR;
+
+        host_ptr = ptr;
+        ///a discrete device keeps its own copy of the memory and syncs it, so transfers still have to go through the driver
+        zero_copy = ctx.host_unified_memory;
+    }
+
+    cl_int err;
+    cmem = clCreateBuffer(ctx, flags, alloc_size, ptr, &err);
+
+    if(err != CL_SUCCESS)
+    {
+        lg::error("Error adopting host pointer ", err);
+
+        host_ptr = nullptr;
+        zero_copy = false;
+
+        return false;
+    }
+
+    account_alloc(alloc_size);
+
+    ///copying counts as an upload
+    if(!aligned)
+        stats_transfer(ctx, true, alloc_size);
+
+    return aligned;
+}
+
+void cl::set_svm_indirect(kernel& kern, const std::vector<void*>& ptrs)
+{
+    #ifdef CL_VERSION_2_0
+    ///the common case, nothing to set and nothing to clear
+    if(ptrs.size() == 0 && !kern.has_svm_indirect)
+        return;
+
+    cl_int err = CL_SUCCESS;
+
+    if(ptrs.size() > 0)
+    {
+        err = clSetKernelExecInfo(kern.ckernel, CL_KERNEL_EXEC_INFO_SVM_PTRS, ptrs.size() * sizeof(void*), &ptrs[0]);
+
+        kern.has_svm_indirect = err == CL_SUCCESS;
+    }
+    else
+    {
+        ///the list sticks to the cl_kernel, so a zero sized one is the only way to drop a previous dispatch's pointers
+        void* none = nullptr;
+
+        err = clSetKernelExecInfo(kern.ckernel, CL_KERNEL_EXEC_INFO_SVM_PTRS, 0, &none);
+
+        kern.has_svm_indirect = err != CL_SUCCESS;
+    }
+
+    if(err != CL_SUCCESS)
+    {
+        static lg::keyed_rate_limiter limit;
+
+        lg::error_limited(limit.get(kern.name), "clSetKernelExecInfo svm pointers Error with ", kern.name, " err ", err);
+    }
+    #endif // CL_VERSION_2_0
+}
+
+bool cl::ensure_program(context& ctx, const std::string& kname, const std::string& src, const std::string& options)
+{
+    if(ctx.kernels.find(kname) != ctx.kernels.end())
+        return true;
+
+    program p(ctx, src, false);
+    p.build_with(ctx, options);
+
+    ctx.register_program(p);
+
+    if(ctx.kernels.find(kname) == ctx.kernels.end())
+    {
+        lg::error("Could not build the program for ", kname);
+        return false;
+    }
+
+    return true;
+}
+
+int cl::image_read_channels(cl_channel_order order)
+{
+    if(order == CL_R)
+        return 1;
+
+    if(order == CL_RG)
+        return 2;
+
+    if(order == CL_RGBA || order == CL_BGRA || order == CL_ARGB)
+        return 4;
+
+    return 0;
+}
+
+cl_bitfield cl::svm_capabilities(context& ctx)
+{
+    #ifdef CL_VERSION_2_0
+    cl_bitfield ret = ~(cl_bitfield)0;
+
+    for(cl_uint i=0; i < ctx.num_devices; i++)
+    {
+        cl_device_svm_capabilities caps = 0;
+
+        if(clGetDeviceInfo(ctx.devices[i], CL_DEVICE_SVM_CAPABILITIES, sizeof(caps), &caps, nullptr) != CL_SUCCESS)
+            return 0;
+
+        ret &= caps;
+    }
+
+    return ret;
+    #else
+    return 0;
+    #endif // CL_VERSION_2_0
+}
+
+bool cl::buffer::alloc_svm(int64_t bytes, bool want_fine_grain)
+{
+    #ifdef CL_VERSION_2_0
+    cl_bitfield caps = svm_capabilities(ctx);
+
+    if((caps & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER) == 0)
+    {
+        lg::error("SVM not supported on this context");
+        return false;
+    }
+
+    cl_svm_mem_flags flags = CL_MEM_READ_WRITE;
+
+    svm_fine_grain = want_fine_grain && (caps & CL_DEVICE_SVM_FINE_GRAIN_BUFFER);
+
+    if(want_fine_grain && !svm_fine_grain)
+        LG_DEBUG("Fine grained svm unavailable, falling back to coarse");
+
+    if(svm_fine_grain)
+        flags |= CL_MEM_SVM_FINE_GRAIN_BUFFER;
+
+    format = SVM;
+    alloc_size = bytes;
+
+    invalidate_reads();
+
+    svm_ptr = clSVMAlloc(ctx, flags, bytes, 0);
+
+    if(svm_ptr == nullptr)
+    {
+        lg::error("Error allocating svm ", bytes);
+        alloc_size = 0;
+        return false;
+    }
+
+    account_alloc(bytes);
+
+    return true;
+    #else
+    lg::error("Built without OpenCL 2.0 headers, no svm");
+    return false;
+    #endif // CL_VERSION_2_0
+}
+
+cl_int cl::buffer::svm_memcpy(command_queue& cqueue, bool blocking, void* dst, const void* src, int64_t bytes, cl_uint num_events, const cl_event* events, cl_event* out)
+{
+    #ifdef CL_VERSION_2_0
+    bool to_device = dst >= svm_ptr && (char*)dst < (char*)svm_ptr + alloc_size;
+
+    bool from_device = src >= svm_ptr && (const char*)src < (char*)svm_ptr + alloc_size;
+
+    stats_transfer(ctx, to_device, bytes);
+
+    cl_int err = clEnqueueSVMMemcpy(cqueue, blocking ? CL_TRUE : CL_FALSE, dst, src, bytes, num_events, events, out);
+
+    if(err == CL_SUCCESS && to_device)
+        capture_transfer(cqueue, *this, true, (char*)dst - (char*)svm_ptr, bytes, src, num_events, events, out);
+    else if(err == CL_SUCCESS && from_device)
+        capture_transfer(cqueue, *this, false, (const char*)src - (char*)svm_ptr, bytes, dst, num_events, events, out);
+
+    return err;
+    #else
+    return CL_INVALID_OPERATION;
+    #endif // CL_VERSION_2_0
+}
+
+void cl::buffer::resize_svm(command_queue& cqueue, int64_t next)
+{
+    #ifdef CL_VERSION_2_0
+    void* old_ptr = svm_ptr;
+    int64_t old_size = alloc_size;
+    int64_t transfer_size = std::min(next, alloc_size);
+
+    if(!alloc_svm(next, svm_fine_grain))
+    {
+        svm_ptr = old_ptr;
+        alloc_size = old_size;
+        return;
+    }
+
+    clEnqueueSVMMemcpy(cqueue, CL_FALSE, svm_ptr, old_ptr, transfer_size, 0, nullptr, nullptr);
+
+    capture_copy(cqueue, *this, old_ptr, transfer_size);
+    capture_free(ctx, old_ptr);
+
+    ///freed in queue order, so after the copy
+    void* to_free[1] = {old_ptr};
+
+    clEnqueueSVMFree(cqueue, 1, to_free, nullptr, nullptr, 0, nullptr, nullptr);
+
+    account_free(old_size);
+    #endif // CL_VERSION_2_0
+}
+
+cl::readback_cache::~readback_cache()
+{
+    wait_prefetch();
+}
+
+void cl::readback_cache::wait_prefetch()
+{
+    if(prefetch == nullptr)
+        return;
+
+    clWaitForEvents(1, &prefetch);
+    clReleaseEvent(prefetch);
+
+    prefetch = nullptr;
+
+    data_version = prefetch_version;
+}
+
+cl_int cl::buffer::read_whole(command_queue& read_on, void* dst, bool blocking, cl_event* out)
+{
+    if(format == BUFFER)
+        return dispatch_read(read_on, *this, 0, alloc_size, dst, blocking, 0, nullptr, out);
+
+    if(format == SVM)
+        return svm_memcpy(read_on, blocking, dst, svm_ptr, alloc_size, 0, nullptr, out);
+
+    size_t origin[3] = {0};
+
+    stats_transfer(ctx, false, alloc_size);
+
+    cl_int err = clEnqueueReadImage(read_on, cmem, blocking ? CL_TRUE : CL_FALSE, origin, image_dims, 0, 0, dst, 0, nullptr, out);
+
+    if(err == CL_SUCCESS)
+        capture_image(read_on, *this, false, origin, image_dims, 0, nullptr, out);
+
+    return err;
+}
+
+bool cl::buffer::read_cached(void* dst)
+{
+    readback_cache& cache = *readback;
+
+    cache.wait_prefetch();
+
+    if(cache.data_version != cache.version || (int64_t)cache.data.size() != alloc_size)
+        return false;
+
+    ///the host can write fine grained svm behind our back
+    if(format == SVM && svm_fine_grain)
+        return false;
+
+    memcpy(dst, &cache.data[0], alloc_size);
+
+    return true;
+}
+
+void cl::buffer::store_cached(const void* src)
+{
+    if(format == SVM && svm_fine_grain)
+        return;
+
+    readback_cache& cache = *readback;
+
+    cache.wait_prefetch();
+
+    cache.data.resize(alloc_size);
+
+    memcpy(&cache.data[0], src, alloc_size);
+
+    cache.data_version = cache.version;
+}
+
+void cl::buffer::prefetch(command_queue& read_on)
+{
+    if(alloc_size == 0 || (format == SVM && svm_fine_grain))
+        return;
+
+    readback_cache& cache = *readback;
+
+    cache.wait_prefetch();
+
+    if(cache.data_version == cache.version && (int64_t)cache.data.size() == alloc_size)
+        return;
+
+    cache.data.resize(alloc_size);
+
+    cl_int err = read_whole(read_on, &cache.data[0], false, &cache.prefetch);
+
+    if(err != CL_SUCCESS)
+    {
+        lg::error("Error in buffer prefetch ", err);
+
+        cache.prefetch = nullptr;
+        cache.data_version = ~(uint64_t)0;
+        return;
+    }
+
+    ///marked stale until it lands
+    cache.data_version = ~(uint64_t)0;
+    cache.prefetch_version = cache.version;
+}
+
+void cl::buffer::release_svm()
+{
+    account_free(accounted_bytes);
+    capture_free(ctx, svm_ptr);
+
+    #ifdef CL_VERSION_2_0
+    if(svm_ptr)
+        clSVMFree(ctx, svm_ptr);
+    #endif // CL_VERSION_2_0
+
+    svm_ptr = nullptr;
+}
+
 cl::cl_gl_interop_texture::cl_gl_interop_texture(context& ctx) : buffer(ctx)
 {
     format = IMAGE;
+    tag = "gl_interop";
+}
+
+#ifndef OCL_HEADLESS
+///the memory belongs to gl, but it's still taking up space on the device
+static int64_t interop_image_bytes(cl_mem mem)
+{
+    size_t element = 0, iw = 0, ih = 0;
+
+    clGetImageInfo(mem, CL_IMAGE_ELEMENT_SIZE, sizeof(size_t), &element, nullptr);
+    clGetImageInfo(mem, CL_IMAGE_WIDTH, sizeof(size_t), &iw, nullptr);
+    clGetImageInfo(mem, CL_IMAGE_HEIGHT, sizeof(size_t), &ih, nullptr);
+
+    return (int64_t)element * iw * ih;
 }
 
 void cl::cl_gl_interop_texture::create_renderbuffer(int pw, int ph)
@@ -423,7 +1308,11 @@ void cl::cl_gl_interop_texture::create_renderbuffer(int pw, int ph)
 
     if(err != CL_SUCCESS)
     {
-        lg::log("Failure in cl_gl_interop_texture ", err);
+        lg::error("Failure in cl_gl_interop_texture ", err);
+    }
+    else
+    {
+        account_alloc(interop_image_bytes(cmem));
     }
 
     renderbuffer_id = framebuf;
@@ -462,7 +1351,11 @@ void cl::cl_gl_interop_texture::create_rendertexture(int pw, int ph)
 
     if(err != CL_SUCCESS)
     {
-        lg::log("Failure in create rendertexture ", err);
+        lg::error("Failure in create rendertexture ", err);
+    }
+    else
+    {
+        account_alloc(interop_image_bytes(cmem));
     }
 
     image_dims[0] = w;
@@ -477,7 +1370,11 @@ void cl::cl_gl_interop_texture::create_from_renderbuffer(gl_texid renderbuf)
 
     if(err != CL_SUCCESS)
     {
-        lg::log("Failure in cl_gl_interop_texture rbuf ", err);
+        lg::error("Failure in cl_gl_interop_texture rbuf ", err);
+    }
+    else
+    {
+        account_alloc(interop_image_bytes(cmem));
     }
 
     size_t fw, fh;
@@ -504,7 +1401,11 @@ void cl::cl_gl_interop_texture::create_from_texture(gl_texid tex, const cl::cl_g
 
     if(err != CL_SUCCESS)
     {
-        lg::log("Failure in cl_gl_interop_texture cft ", err);
+        lg::error("Failure in cl_gl_interop_texture cft ", err);
+    }
+    else
+    {
+        account_alloc(interop_image_bytes(cmem));
     }
 
     size_t fw, fh;
@@ -562,6 +1463,9 @@ void cl::cl_gl_interop_texture::acquire(command_queue& cqueue)
 
     acquired = true;
 
+    ///gl could have drawn anything into it
+    invalidate_reads();
+
     clEnqueueAcquireGLObjects(cqueue, 1, &cmem, 0, nullptr, nullptr);
 }
 
@@ -574,6 +1478,47 @@ void cl::cl_gl_interop_texture::unacquire(command_queue& cqueue)
 
     clEnqueueReleaseGLObjects(cqueue, 1, &cmem, 0, nullptr, nullptr);
 }
+#else
+void cl::cl_gl_interop_texture::create_renderbuffer(int pw, int ph)
+{
+    lg::error("Built with OCL_HEADLESS, cl_gl_interop_texture is unavailable");
+}
+
+void cl::cl_gl_interop_texture::create_rendertexture(int pw, int ph)
+{
+    lg::error("Built with OCL_HEADLESS, cl_gl_interop_texture is unavailable");
+}
+
+void cl::cl_gl_interop_texture::create_from_renderbuffer(gl_texid renderbuf)
+{
+    lg::error("Built with OCL_HEADLESS, cl_gl_interop_texture is unavailable");
+}
+
+void cl::cl_gl_interop_texture::create_from_texture(gl_texid tex, const cl::cl_gl_storage_base& storage_)
+{
+    lg::error("Built with OCL_HEADLESS, cl_gl_interop_texture is unavailable");
+}
+
+void cl::cl_gl_interop_texture::gl_blit_raw(gl_texid target, gl_texid source)
+{
+
+}
+
+void cl::cl_gl_interop_texture::gl_blit_me(gl_texid target, command_queue& cqueue)
+{
+
+}
+
+void cl::cl_gl_interop_texture::acquire(command_queue& cqueue)
+{
+
+}
+
+void cl::cl_gl_interop_texture::unacquire(command_queue& cqueue)
+{
+
+}
+#endif // OCL_HEADLESS
 
 /*cl::kernel cl::load_kernel(context& ctx, program& p, const std::string& name)
 {
@@ -11,6 +11,8 @@
 #include <assert.h>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <future>
 
 using gl_texid = unsigned int;
 
@@ -20,7 +22,12 @@ namespace cl
 
     bool supports_extension(cl_device_id device, const std::string& ext_name);
 
-    cl_int get_platform_ids(cl_platform_id* clSelectedPlatformID);
+    ///the svm pointers a kernel reaches through other svm memory. An empty list clears whatever the last dispatch left on the kernel
+    ///kernels that have never had a list cost nothing here
+    void set_svm_indirect(kernel& kern, const std::vector<void*>& ptrs);
+
+    ///picks a platform with a device of type, preferring nvidia or amd when type includes gpus
+    cl_int get_platform_ids(cl_platform_id* clSelectedPlatformID, cl_device_type type = CL_DEVICE_TYPE_GPU);
 
     struct event
     {
@@ -163,7 +170,7 @@ namespace cl
 
         if(ret != CL_SUCCESS)
         {
-            std::cout << "Wait for events err " << ret << std::endl;
+            lg::error("Wait for events err ", ret);
         }
     }
 
@@ -190,26 +197,53 @@ namespace cl
 
         if(ret != CL_SUCCESS)
         {
-            std::cout << "Wait for events err " << ret << std::endl;
+            lg::error("Wait for events err ", ret);
         }
     }
 
     struct program;
     struct kernel;
+    struct transfer_state;
+    struct reclaim_state;
+    struct context_stats;
+    struct capture_state;
 
     struct context
     {
         cl_platform_id platform;
         cl_device_id devices[100] = {0};
+        ///number of valid entries in devices, all of which are in the context
+        cl_uint num_devices = 1;
         cl_device_id selected_device;
         cl_context ccontext;
 
         std::string device_name;
 
+        cl_device_type device_type = CL_DEVICE_TYPE_GPU;
+        bool share_gl = true;
+        bool all_devices = false;
+
+        ///every device reports CL_DEVICE_HOST_UNIFIED_MEMORY, eg integrated gpus and cpu devices
+        bool host_unified_memory = false;
+        ///largest CL_DEVICE_MEM_BASE_ADDR_ALIGN in bytes, host pointers adopted with USE_HOST_PTR need this alignment
+        int64_t mem_base_align = 128;
+
         std::vector<program> programs;
         std::map<std::string, kernel> kernels;
 
+        ///staging memory and per device transfer calibration, see ocl_transfer.hpp
+        std::shared_ptr<transfer_state> transfers;
+        ///deferred deletion and the buffer pool, see ocl_reclaim.hpp
+        std::shared_ptr<reclaim_state> reclaim;
+        ///memory and transfer accounting, see ocl_stats.hpp
+        std::shared_ptr<context_stats> stats;
+        ///set while capturing a trace, see ocl_capture.hpp. Only touched through std::atomic_load/atomic_store, the hooks run on any thread
+        std::shared_ptr<capture_state> capture;
+
+        ///gl sharing on the first gpu
         context();
+        ///all_devices spans every device of that type on the selected platform, rather than just the first
+        context(cl_device_type type, bool gl_sharing, bool all_devices = false);
 
         void rebuild();
 
@@ -220,15 +254,72 @@ namespace cl
         void register_program(program& p);
     };
 
+    ///a build of a program with extra -D constants baked in so the compiler can fold them
+    ///builds in the background, and hands out the generic kernels until its done
+    struct program_variant
+    {
+        std::string defines;
+        cl_program cprogram = nullptr;
+        std::map<std::string, kernel> kernels;
+
+        context* ctx = nullptr;
+
+        std::atomic_bool is_ready{false};
+        std::atomic_bool failed{false};
+        std::shared_future<void> done;
+
+        bool ready() const
+        {
+            return is_ready.load(std::memory_order_acquire);
+        }
+
+        ///waits for the build to finish either way
+        void block()
+        {
+            if(done.valid())
+                done.wait();
+        }
+
+        ///the specialised kernel if its ready, otherwise the generic one registered with the context
+        kernel& get(const std::string& kname);
+
+        kernel& operator[](const std::string& kname) {return get(kname);}
+
+        ///only runs once the build thread is done with it, the thread holds a reference
+        ~program_variant();
+    };
+
+    ///path to a spir-v module, see program's il constructor
+    struct il_file
+    {
+        std::string fname;
+    };
+
     struct program
     {
         context& saved_context;
         std::string saved_fname;
+        bool saved_is_file = true;
+
+        ///set if this was loaded from spir-v rather than source
+        std::string saved_il_fname;
+        bool is_il = false;
+
+        ///source and options of the generic build, kept for building variants
+        std::string saved_source;
+        std::string saved_options;
+
+        ///keyed by the canonical define string
+        std::map<std::string, std::shared_ptr<program_variant>> variants;
 
         cl_program cprogram;
         bool built = false;
         program(context& ctx, const std::string& fname, bool is_file = true);
 
+        ///loads spir-v via clCreateProgramWithIL if the device takes it, otherwise falls back to the source
+        ///fallback may be empty if there's no source to fall back to
+        program(context& ctx, const il_file& il, const std::string& fallback, bool fallback_is_file = true);
+
         void rebuild();
 
         cl_program& get()
@@ -246,6 +337,12 @@ namespace cl
             cprogram = other.cprogram;
             built = other.built;
             saved_fname = other.saved_fname;
+            saved_is_file = other.saved_is_file;
+            saved_il_fname = other.saved_il_fname;
+            is_il = other.is_il;
+            saved_source = other.saved_source;
+            saved_options = other.saved_options;
+            variants = other.variants;
         }
 
         operator cl_program() {return cprogram;}
@@ -253,13 +350,19 @@ namespace cl
         void ensure_build();
 
         void build_with(context& ctx, const std::string& options);
+
+        ///eg get_variant({{"TILE", 16}, {"W", 1920}})
+        ///first use kicks off a background build, later uses return the same variant
+        program_variant& get_variant(const std::map<std::string, int64_t>& defines, bool block = false);
     };
 
     struct kernel
     {
-        cl_kernel ckernel;
+        cl_kernel ckernel = nullptr;
         std::string name;
         bool loaded = false;
+        ///an svm indirect pointer list is set on ckernel, and needs clearing before a dispatch without one
+        bool has_svm_indirect = false;
         //cl_uint work_size;
 
         kernel(program& p, const std::string& kname);
@@ -273,12 +376,109 @@ namespace cl
     {
         void* ptr = nullptr;
         int64_t size = 0;
+        ///ptr is an svm pointer to be bound with clSetKernelArgSVMPointer
+        bool svm = false;
+    };
+
+    struct buffer;
+    struct command_queue;
+
+    ///every buffer transfer goes through these, they pick the fastest method for the device and size. See ocl_transfer.hpp
+    cl_int dispatch_write(command_queue& cqueue, buffer& buf, int64_t offset, int64_t bytes, const void* src, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out);
+    cl_int dispatch_read(command_queue& cqueue, buffer& buf, int64_t offset, int64_t bytes, void* dst, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out);
+
+    ///accounting hooks, see ocl_stats.hpp
+    void stats_alloc(context& ctx, const std::string& tag, int64_t bytes);
+    void stats_free(context& ctx, const std::string& tag, int64_t bytes);
+    void stats_transfer(context& ctx, bool to_device, int64_t bytes);
+    void stats_map(context& ctx, bool mapping);
+
+    struct args;
+
+    ///trace capture hooks, these return straight away unless the context is capturing. See ocl_capture.hpp
+    void capture_alloc(buffer& buf);
+    ///handle is the cl_mem or svm pointer being freed
+    void capture_free(context& ctx, const void* handle);
+    void capture_transfer(command_queue& cqueue, buffer& buf, bool write, int64_t offset, int64_t bytes, const void* host, cl_uint num_events, const cl_event* events, cl_event* out);
+    void capture_image(command_queue& cqueue, buffer& buf, bool write, const size_t* origin, const size_t* region, size_t row_pitch, const void* host, cl_event* out);
+    void capture_fill(command_queue& cqueue, buffer& buf);
+    void capture_copy(command_queue& cqueue, buffer& dst, const void* src_handle, int64_t bytes);
+    void capture_exec(command_queue& cqueue, kernel& kern, args& pack, int dim, const size_t* offset, const size_t* global, const size_t* local, cl_uint num_events, const cl_event* events, cl_event* out);
+    void capture_map(command_queue& cqueue, buffer& buf, cl_map_flags flags, int64_t bytes, void* ptr);
+    void capture_unmap(command_queue& cqueue, buffer& buf, void* ptr);
+    void capture_finish(command_queue& cqueue);
+
+    ///how a buffer is going to be used, picks its cl_mem_flags
+    struct mem_policy
+    {
+        ///from the kernel's point of view
+        enum device_access
+        {
+            READ_WRITE,
+            READ_ONLY,
+            WRITE_ONLY,
+        };
+
+        enum host_access
+        {
+            HOST_READ_WRITE,
+            HOST_WRITE_ONLY,
+            HOST_READ_ONLY,
+            HOST_NO_ACCESS,
+        };
+
+        ///AUTO picks ALLOC_HOST_PTR on unified memory devices and DEVICE otherwise
+        ///USE_HOST_PTR only applies to buffer::adopt_host_ptr, anywhere else it acts as AUTO
+        enum placement
+        {
+            AUTO,
+            DEVICE,
+            ALLOC_HOST_PTR,
+            USE_HOST_PTR,
+        };
+
+        device_access device = READ_WRITE;
+        host_access host = HOST_READ_WRITE;
+        placement place = AUTO;
+
+        cl_mem_flags get_access_flags() const;
+    };
+
+    ///host side copy of a buffer's contents, shared between copies of the buffer
+    ///version is bumped whenever the wrapper enqueues something that could change the device side
+    struct readback_cache
+    {
+        uint64_t version = 0;
+
+        std::vector<char> data;
+        ///version data was read at, ~0 if it's never been filled
+        uint64_t data_version = ~(uint64_t)0;
+
+        ///in flight prefetch into data
+        cl_event prefetch = nullptr;
+        uint64_t prefetch_version = 0;
+
+        ~readback_cache();
+
+        ///data can't be touched while a prefetch is still writing into it
+        void wait_prefetch();
     };
 
     struct args
     {
         std::vector<arg_info> arg_list;
 
+        ///buffers passed as args, a kernel could write to any of them
+        std::vector<buffer*> buffers;
+
+        void mark_written();
+
+        ///svm allocations the kernel reaches through pointers stored in other svm memory
+        std::vector<void*> svm_indirect;
+
+        ///every svm buffer the kernel reaches indirectly has to be listed, coarse or fine grained
+        void add_svm_indirect(buffer& buf);
+
         template<typename T>
         inline
         void push_back(T& val)
@@ -309,14 +509,21 @@ namespace cl
     {
         cl_command_queue cqueue;
         context& ctx;
+        cl_device_id device = nullptr;
 
         command_queue(context& ctx);
         command_queue(context& ctx, cl_command_queue_properties);
+        ///for multi device contexts, one queue per device
+        command_queue(context& ctx, cl_device_id device, cl_command_queue_properties);
 
         ///size defaults to -1 which means map the whole buffer
         void* map(buffer& v, cl_map_flags flag, int64_t size = -1);
         void unmap(buffer& v, void* ptr);
 
+        ///clEnqueueSVMMigrateMem hint for an svm buffer, to the device this queue is on or back to the host
+        ///size defaults to -1 which means the whole allocation
+        void svm_prefetch(buffer& v, bool to_host = false, int64_t offset = 0, int64_t size = -1);
+
         template<typename T>
         map_info<T> map_type(buffer& v, cl_map_flags flag, int64_t size = -1)
         {
@@ -339,9 +546,19 @@ namespace cl
         {
             for(int i=0; i < (int)pack.arg_list.size(); i++)
             {
+                #ifdef CL_VERSION_2_0
+                if(pack.arg_list[i].svm)
+                {
+                    clSetKernelArgSVMPointer(kname.ckernel, i, pack.arg_list[i].ptr);
+                    continue;
+                }
+                #endif // CL_VERSION_2_0
+
                 clSetKernelArg(kname.ckernel, i, pack.arg_list[i].size, pack.arg_list[i].ptr);
             }
 
+            set_svm_indirect(kname, pack.svm_indirect);
+
             size_t g_ws[dim] = {0};
             size_t l_ws[dim] = {0};
 
@@ -416,13 +633,19 @@ namespace cl
 
             if(err != CL_SUCCESS)
             {
-                lg::log("clEnqueueNDRangeKernel Error with", kname.name);
-                lg::log(err);
+                ///this fires every frame when it goes wrong
+                static lg::keyed_rate_limiter limit;
+
+                lg::error_limited(limit.get(kname.name), "clEnqueueNDRangeKernel Error with ", kname.name, " err ", err);
             }
             else
             {
                 if(evt != nullptr)
                     evt->invalid = false;
+
+                pack.mark_written();
+
+                capture_exec(*this, kname, pack, dim, nullptr, g_ws, l_ws, events.size(), first, out);
             }
         }
 
@@ -434,7 +657,9 @@ namespace cl
 
             if(it == ctx.kernels.end())
             {
-                lg::log("Kernel with name ", kname, " not found");
+                static lg::keyed_rate_limiter limit;
+
+                lg::error_limited(limit.get(kname), "Kernel with name ", kname, " not found");
                 return;
             }
 
@@ -458,6 +683,8 @@ namespace cl
 
         void block()
         {
+            capture_finish(*this);
+
             clFinish(cqueue);
         }
 
@@ -483,17 +710,54 @@ namespace cl
         size_t image_dims[3] = {1,1,1};
         int64_t image_dimensionality = 1;
         int byte_per_pixel = 1;
+        cl_channel_order image_order = CL_RGBA;
+        cl_channel_type image_type = CL_FLOAT;
 
         enum internal_format
         {
             BUFFER,
             IMAGE,
+            SVM,
         };
 
         internal_format format = BUFFER;
 
+        ///only valid for SVM. Coarse grained svm must be mapped before the host touches it, fine grained needn't be
+        void* svm_ptr = nullptr;
+        bool svm_fine_grain = false;
+
+        ///set before allocating
+        mem_policy policy;
+        ///memory lives on the host side, so transfers map and memcpy rather than going through a copy
+        bool zero_copy = false;
+        ///caller owned memory from adopt_host_ptr, must outlive the buffer
+        void* host_ptr = nullptr;
+
+        ///keep a host copy after every read_all, so repeat reads of an unchanged buffer don't touch the device
+        ///only safe if everything that writes to the buffer goes through the wrapper. Fine grained svm is never cached
+        bool cache_reads = false;
+        std::shared_ptr<readback_cache> readback = std::make_shared<readback_cache>();
+
+        ///groups this buffer's memory in the accounting, set before allocating
+        std::string tag;
+        ///what this buffer currently has counted as live
+        int64_t accounted_bytes = 0;
+
         buffer(context& ctx) : ctx(ctx) {}
 
+        void account_alloc(int64_t bytes);
+        void account_free(int64_t bytes);
+
+        ///called for every write the wrapper knows about
+        void invalidate_reads()
+        {
+            readback->version++;
+        }
+
+        ///starts reading the whole buffer into the readback cache, the next read_all picks it up
+        ///whether later read_alls keep caching is still up to cache_reads
+        void prefetch(command_queue& read_on);
+
         cl_mem& get()
         {
             return cmem;
@@ -507,7 +771,7 @@ namespace cl
             ///TODO: WORK FOR BOTH
             //assert(format == IMAGE);
 
-            if(format == BUFFER)
+            if(format == BUFFER || format == SVM)
             {
                 if(location.x() < 0 || location.x() >= alloc_size)
                     return data;
@@ -529,11 +793,18 @@ namespace cl
                 if(cl_events.size() > 0)
                     first = &cl_events[0];
 
-                cl_int ret = clEnqueueReadBuffer(read_on, cmem, CL_FALSE, location.x(), dim.x() * sizeof(T), &(*data.data)[0], cl_events.size(), first, &data.cevent);
+                cl_int ret = CL_SUCCESS;
+
+                if(format == SVM)
+                    ret = svm_memcpy(read_on, false, &(*data.data)[0], (char*)svm_ptr + location.x(), dim.x() * sizeof(T), cl_events.size(), first, &data.cevent);
+                else
+                    ret = dispatch_read(read_on, *this, location.x(), dim.x() * sizeof(T), &(*data.data)[0], false, cl_events.size(), first, &data.cevent);
 
                 if(ret != CL_SUCCESS)
                 {
-                    std::cout << "Error in async buffer read " << ret << std::endl;
+                    static lg::rate_limiter limit;
+
+                    lg::error_limited(limit, "Error in async buffer read ", ret);
 
                     data.invalid = true;
                 }
@@ -565,17 +836,23 @@ namespace cl
                 size_t origin[3] = {location.x(), location.y(), 0};
                 size_t region[3] = {dim.x(), dim.y(), 1};
 
+                stats_transfer(ctx, false, dim.x() * dim.y() * sizeof(T));
+
                 cl_int ret = clEnqueueReadImage(read_on, cmem, CL_FALSE, origin, region, 0, 0, &(*data.data)[0], 0, nullptr, &data.cevent);
 
                 if(ret != CL_SUCCESS)
                 {
-                    std::cout << "Error in async read " << ret << std::endl;
+                    static lg::rate_limiter limit;
+
+                    lg::error_limited(limit, "Error in async read ", ret);
 
                     data.invalid = true;
                 }
                 else
                 {
                     data.invalid = false;
+
+                    capture_image(read_on, *this, false, origin, region, 0, nullptr, &data.cevent);
                 }
 
                 return data;
@@ -593,22 +870,31 @@ namespace cl
             if(in_dat.size() == 0)
                 return data;
 
-            assert(format == BUFFER);
+            assert(format == BUFFER || format == SVM);
 
             if(location.x() < 0 || location.y() < 0)
                 return data;
 
             data.allocate_with(in_dat);
 
-            if(format == BUFFER)
+            invalidate_reads();
+
+            if(format == BUFFER || format == SVM)
             {
                 assert(location.x() * sizeof(T) + in_dat.size() * sizeof(T) <= alloc_size);
 
-                cl_int ret = clEnqueueWriteBuffer(write_on, cmem, CL_FALSE, location.x() * sizeof(T), in_dat.size() * sizeof(T), data.front_ptr(), 0, nullptr, &data.cevent);
+                cl_int ret = CL_SUCCESS;
+
+                if(format == SVM)
+                    ret = svm_memcpy(write_on, false, (char*)svm_ptr + location.x() * sizeof(T), data.front_ptr(), in_dat.size() * sizeof(T), 0, nullptr, &data.cevent);
+                else
+                    ret = dispatch_write(write_on, *this, location.x() * sizeof(T), in_dat.size() * sizeof(T), data.front_ptr(), false, 0, nullptr, &data.cevent);
 
                 if(ret != CL_SUCCESS)
                 {
-                    std::cout << "Error in async write " << ret << std::endl;
+                    static lg::rate_limiter limit;
+
+                    lg::error_limited(limit, "Error in async write ", ret);
 
                     data.invalid = true;
                 }
@@ -638,22 +924,30 @@ namespace cl
 
             assert(location.x() + region.x() <= image_dims[0] && location.y() + region.y() <= image_dims[1]);
 
+            invalidate_reads();
+
             //cl_int ret = clEnqueueWriteBuffer(write_on, cmem, CL_FALSE, location.x() * sizeof(T), in_dat.size() * sizeof(T), data.front_ptr(), 0, nullptr, &data.cevent);
 
             size_t iorigin[3] = {location.x(), location.y(), 0};
             size_t iregion[3] = {region.x(), region.y(), 1};
 
+            stats_transfer(ctx, true, in_dat.size() * sizeof(T));
+
             cl_int ret = clEnqueueWriteImage(write_on.cqueue, cmem, CL_FALSE, iorigin, iregion, 0, 0, data.front_ptr(), 0, nullptr, &data.cevent);
 
             if(ret != CL_SUCCESS)
             {
-                std::cout << "Error in async write " << ret << std::endl;
+                static lg::rate_limiter limit;
+
+                lg::error_limited(limit, "Error in async write ", ret);
 
                 data.invalid = true;
             }
             else
             {
                 data.invalid = false;
+
+                capture_image(write_on, *this, true, iorigin, iregion, 0, data.front_ptr(), &data.cevent);
             }
 
             return data;
@@ -663,10 +957,20 @@ namespace cl
         {
             cl_uint zeros[4] = {0};
 
+            invalidate_reads();
+
+            capture_fill(write_on, *this);
+
             if(format == BUFFER)
             {
                 clEnqueueFillBuffer(write_on, cmem, &zeros[0], sizeof(cl_uchar), 0, alloc_size, 0, nullptr, nullptr);
             }
+            else if(format == SVM)
+            {
+                #ifdef CL_VERSION_2_0
+                clEnqueueSVMMemFill(write_on, svm_ptr, &zeros[0], sizeof(cl_uchar), alloc_size, 0, nullptr, nullptr);
+                #endif // CL_VERSION_2_0
+            }
             else
             {
                 size_t origin[3] = {0};
@@ -680,20 +984,31 @@ namespace cl
         {
             cl_int val = CL_SUCCESS;
 
+            invalidate_reads();
+
             if(format == BUFFER)
             {
-                val = clEnqueueWriteBuffer(write_on, cmem, CL_TRUE, 0, alloc_size, ptr, 0, nullptr, nullptr);
+                val = dispatch_write(write_on, *this, 0, alloc_size, ptr, true, 0, nullptr, nullptr);
+            }
+            else if(format == SVM)
+            {
+                val = svm_memcpy(write_on, true, svm_ptr, ptr, alloc_size, 0, nullptr, nullptr);
             }
             else
             {
                 size_t origin[3] = {0};
 
+                stats_transfer(ctx, true, alloc_size);
+
                 val = clEnqueueWriteImage(write_on, cmem, CL_TRUE, origin, image_dims, 0, 0, ptr, 0, nullptr, nullptr);
+
+                if(val == CL_SUCCESS)
+                    capture_image(write_on, *this, true, origin, image_dims, 0, ptr, nullptr);
             }
 
             if(val != CL_SUCCESS)
             {
-                lg::log("Error writing to image", val);
+                lg::error("Error writing to image", val);
             }
         }
 
@@ -729,41 +1044,55 @@ namespace cl
 
             ret.resize(alloc_size / sizeof(T));
 
-            cl_int val = CL_SUCCESS;
-
-            if(format == BUFFER)
-            {
-                val = clEnqueueReadBuffer(read_on, cmem, CL_TRUE, 0, alloc_size, &ret[0], 0, nullptr, nullptr);
-            }
-            else
-            {
-                size_t origin[3] = {0};
+            if(read_cached(&ret[0]))
+                return ret;
 
-                val = clEnqueueReadImage(read_on, cmem, CL_TRUE, origin, image_dims, 0, 0, &ret[0], 0, nullptr, nullptr);
-            }
+            cl_int val = read_whole(read_on, &ret[0], true, nullptr);
 
             if(val != CL_SUCCESS)
             {
-                lg::log("Error writing to image", val);
+                lg::error("Error writing to image", val);
+            }
+            else if(cache_reads)
+            {
+                store_cached(&ret[0]);
             }
 
             return ret;
         }
 
-        void alloc_bytes(int bytes)
-        {
-            alloc_size = bytes;
+        ///the whole buffer, in whichever way its format needs
+        cl_int read_whole(command_queue& read_on, void* dst, bool blocking, cl_event* out);
 
-            cl_int err;
-            cmem = clCreateBuffer(ctx, CL_MEM_READ_WRITE, alloc_size, nullptr, &err);
+        ///copies out of the readback cache if it's current, waiting on a prefetch if need be
+        bool read_cached(void* dst);
+        void store_cached(const void* src);
 
-            if(err != CL_SUCCESS)
-            {
-                lg::log("Error allocating buffer");
-                return;
-            }
+        ///flags come from policy
+        void alloc_bytes(int64_t bytes);
+
+        ///wraps caller memory with CL_MEM_USE_HOST_PTR, which is zero copy on unified memory devices
+        ///ptr must be aligned to ctx.mem_base_align, otherwise this falls back to a normal allocation initialised from ptr
+        ///returns true if the memory was adopted
+        bool adopt_host_ptr(void* ptr, int64_t bytes);
+
+        ///maps the file and adopts the mapping on unified memory devices, otherwise streams it up through pinned staging
+        ///either way the file is never read into a heap copy. See ocl_file.hpp
+        bool alloc_from_file(command_queue& cqueue, const std::string& fname);
+
+        ///clSVMAlloc backed, see svm_capabilities. Asking for fine grain falls back to coarse if the devices can't do it
+        ///returns false if svm isn't supported at all
+        bool alloc_svm(int64_t bytes, bool want_fine_grain = false);
+
+        ///host pointer into svm memory. Coarse grained needs a map around host access
+        template<typename T>
+        T* svm_data()
+        {
+            return (T*)svm_ptr;
         }
 
+        cl_int svm_memcpy(command_queue& cqueue, bool blocking, void* dst, const void* src, int64_t bytes, cl_uint num_events, const cl_event* events, cl_event* out);
+
         template<typename T>
         void alloc_n(command_queue& write_on, const T* data, int num)
         {
@@ -810,6 +1139,9 @@ namespace cl
                 image_dims[i] = dims.v[i];
             }
 
+            image_order = channel_order;
+            image_type = channel_type;
+
             cl_image_format format;
             format.image_channel_order = channel_order;
             format.image_channel_data_type = channel_type;
@@ -822,10 +1154,12 @@ namespace cl
 
             if(err != CL_SUCCESS)
             {
-                lg::log("Error creating image2d");
+                lg::error("Error creating image2d");
                 return;
             }
 
+            account_alloc(alloc_size);
+
             write_all(write_on, data);
         }
 
@@ -847,14 +1181,23 @@ namespace cl
 
         void resize(command_queue& cqueue, int64_t next)
         {
+            if(format == SVM)
+            {
+                resize_svm(cqueue, next);
+                return;
+            }
+
             cl_mem old_mem = cmem;
+            int64_t old_size = alloc_size;
             int transfer_size = std::min(next, alloc_size);
 
             alloc_bytes(next);
 
             clEnqueueCopyBuffer(cqueue.cqueue, old_mem, cmem, 0, 0, transfer_size, 0, nullptr, nullptr);
 
-            clReleaseMemObject(old_mem);
+            capture_copy(cqueue, *this, old_mem, transfer_size);
+
+            retire_mem(cqueue, old_mem, old_size);
         }
 
         int64_t size()
@@ -862,11 +1205,33 @@ namespace cl
             return alloc_size;
         }
 
+        void resize_svm(command_queue& cqueue, int64_t next);
+
         void release()
         {
+            invalidate_reads();
+
+            if(format == SVM)
+            {
+                release_svm();
+                return;
+            }
+
+            account_free(accounted_bytes);
+            capture_free(ctx, cmem);
+
             clReleaseMemObject(cmem);
         }
 
+        void release_svm();
+
+        ///like release, but the memory is only freed (or pooled) once everything enqueued on cqueue so far has finished
+        void retire(command_queue& cqueue);
+        void retire_mem(command_queue& cqueue, cl_mem mem, int64_t bytes);
+        ///on a fence the caller already has, eg to retire several things on one marker. Takes over the caller's reference
+        void retire(cl_event fence);
+        void retire_mem(cl_event fence, cl_mem mem, int64_t bytes);
+
         operator cl_mem() {return cmem;}
     };
 
@@ -969,6 +1334,16 @@ namespace cl
         void unacquire(command_queue& cqueue);
     };
 
+    ///intersection over every device in the context, 0 if svm isnt supported
+    cl_bitfield svm_capabilities(context& ctx);
+
+    ///for kernels that ship with the library as source. Builds and registers src the first time kname isn't in the context
+    ///false if kname still isn't there afterwards
+    bool ensure_program(context& ctx, const std::string& kname, const std::string& src, const std::string& options = "");
+
+    ///how many components read_image{f,i,ui} fills from an image of this order, 0 for orders that don't start at .x, eg CL_A
+    int image_read_channels(cl_channel_order order);
+
     //kernel load_kernel(context& ctx, program& p, const std::string& name);
 }
 
@@ -980,29 +1355,44 @@ void cl::args::push_back<cl::buffer>(cl::buffer& val)
     inf.ptr = &val.get();
     inf.size = sizeof(val.get());
 
+    if(val.format == cl::buffer::SVM)
+    {
+        inf.ptr = val.svm_ptr;
+        inf.size = sizeof(void*);
+        inf.svm = true;
+    }
+
     arg_list.push_back(inf);
+    buffers.push_back(&val);
 }
 
 template<>
 inline
 void cl::args::push_back<cl::buffer*>(cl::buffer*& val)
 {
-    cl::arg_info inf;
-    inf.ptr = &val->get();
-    inf.size = sizeof(val->get());
+    push_back(*val);
+}
 
-    arg_list.push_back(inf);
+inline
+void cl::args::mark_written()
+{
+    for(cl::buffer* buf : buffers)
+        buf->invalidate_reads();
+}
+
+inline
+void cl::args::add_svm_indirect(cl::buffer& buf)
+{
+    if(buf.format == cl::buffer::SVM)
+        svm_indirect.push_back(buf.svm_ptr);
 }
 
 template<>
 inline
 void cl::args::push_back<cl::cl_gl_interop_texture*>(cl::cl_gl_interop_texture*& val)
 {
-    cl::arg_info inf;
-    inf.ptr = &val->get();
-    inf.size = sizeof(val->get());
-
-    arg_list.push_back(inf);
+    ///as a plain buffer, so a kernel writing to it invalidates cached reads
+    push_back<cl::buffer>(*val);
 }
 
 #endif // OCL_HPP_INCLUDED
@@ -0,0 +1,1393 @@
+#include "ocl_capture.hpp"
+#include "ocl_file.hpp"
+#include <cstring>
+
+static const char trace_magic[8] = {'C', 'L', 'T', 'R', 'A', 'C', 'E', '1'};
+
+std::string cl::trace_op_name(trace_op op)
+{
+    switch(op)
+    {
+        case trace_op::QUEUE: return "QUEUE";
+        case trace_op::PROGRAM: return "PROGRAM";
+        case trace_op::KERNEL: return "KERNEL";
+        case trace_op::ALLOC: return "ALLOC";
+        case trace_op::FREE: return "FREE";
+        case trace_op::WRITE: return "WRITE";
+        case trace_op::READ: return "READ";
+        case trace_op::WRITE_IMAGE: return "WRITE_IMAGE";
+        case trace_op::READ_IMAGE: return "READ_IMAGE";
+        case trace_op::FILL: return "FILL";
+        case trace_op::COPY: return "COPY";
+        case trace_op::EXEC: return "EXEC";
+        case trace_op::MAP: return "MAP";
+        case trace_op::UNMAP: return "UNMAP";
+        case trace_op::FINISH: return "FINISH";
+    }
+
+    return "UNKNOWN";
+}
+
+void cl::capture_state::begin(trace_op op)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    uint8_t val = (uint8_t)op;
+
+    out.write((const char*)&val, 1);
+
+    put(std::chrono::duration_cast<std::chrono::microseconds>(now - last_record).count());
+
+    last_record = now;
+    records++;
+}
+
+void cl::capture_state::put(uint64_t val)
+{
+    uint8_t data[10];
+    int len = 0;
+
+    do
+    {
+        uint8_t next = val & 0x7f;
+        val >>= 7;
+
+        if(val != 0)
+            next |= 0x80;
+
+        data[len++] = next;
+    } while(val != 0);
+
+    out.write((const char*)data, len);
+}
+
+void cl::capture_state::put_bytes(const void* data, int64_t bytes)
+{
+    if(bytes > 0)
+        out.write((const char*)data, bytes);
+}
+
+void cl::capture_state::put_string(const std::string& str)
+{
+    put(str.size());
+    put_bytes(str.data(), str.size());
+}
+
+void cl::capture_state::put_payload(const void* data, int64_t bytes)
+{
+    bool keep = options.payloads && data != nullptr && (options.max_payload_bytes < 0 || bytes <= options.max_payload_bytes);
+
+    put(bytes);
+    put(keep);
+
+    if(keep)
+        put_bytes(data, bytes);
+}
+
+void cl::capture_state::put_events(cl_uint num, const cl_event* evts)
+{
+    std::vector<uint64_t> ids;
+
+    for(cl_uint i=0; i < num && evts != nullptr; i++)
+    {
+        auto it = events.find(evts[i]);
+
+        ///anything the wrapper didn't hand out, eg user events, gets dropped
+        if(it != events.end())
+            ids.push_back(it->second);
+    }
+
+    put(ids.size());
+
+    for(uint64_t id : ids)
+        put(id);
+}
+
+cl::capture_state::~capture_state()
+{
+    for(auto& i : events)
+        clReleaseEvent(i.first);
+}
+
+void cl::capture_state::put_out_event(cl_event* evt)
+{
+    if(evt == nullptr || *evt == nullptr)
+    {
+        put(0);
+        return;
+    }
+
+    uint64_t id = next_id++;
+
+    ///held until the capture ends, so the driver can't hand the same handle out again and alias two ids
+    auto it = events.find(*evt);
+
+    if(it == events.end())
+    {
+        clRetainEvent(*evt);
+        events[*evt] = id;
+    }
+    else
+    {
+        it->second = id;
+    }
+
+    put(id);
+}
+
+uint64_t cl::capture_state::queue_id(command_queue& cqueue)
+{
+    auto it = queues.find(&cqueue);
+
+    if(it != queues.end())
+        return it->second;
+
+    uint64_t id = next_id++;
+    queues[&cqueue] = id;
+
+    uint64_t device_index = 0;
+
+    for(cl_uint i=0; i < cqueue.ctx.num_devices; i++)
+    {
+        if(cqueue.ctx.devices[i] == cqueue.device)
+            device_index = i;
+    }
+
+    begin(trace_op::QUEUE);
+    put(id);
+    put(device_index);
+
+    return id;
+}
+
+static std::string get_program_string(cl_program prog, cl_program_info info)
+{
+    size_t len = 0;
+
+    if(clGetProgramInfo(prog, info, 0, nullptr, &len) != CL_SUCCESS || len == 0)
+        return "";
+
+    std::string ret;
+    ret.resize(len);
+
+    clGetProgramInfo(prog, info, len, &ret[0], nullptr);
+
+    ///sources come back nul terminated, il doesn't
+    if(info == CL_PROGRAM_SOURCE && ret.size() > 0 && ret.back() == '\0')
+        ret.pop_back();
+
+    return ret;
+}
+
+uint64_t cl::capture_state::kernel_id(context& ctx, kernel& kern)
+{
+    auto it = kernels.find(kern.ckernel);
+
+    if(it != kernels.end())
+        return it->second;
+
+    cl_program prog = nullptr;
+
+    clGetKernelInfo(kern.ckernel, CL_KERNEL_PROGRAM, sizeof(prog), &prog, nullptr);
+
+    uint64_t program_id = 0;
+
+    auto pit = programs.find(prog);
+
+    if(pit != programs.end())
+    {
+        program_id = pit->second;
+    }
+    else
+    {
+        program_id = next_id++;
+        programs[prog] = program_id;
+
+        bool is_il = false;
+        std::string data = get_program_string(prog, CL_PROGRAM_SOURCE);
+
+        #ifdef CL_VERSION_2_1
+        if(data.size() == 0)
+        {
+            data = get_program_string(prog, CL_PROGRAM_IL);
+            is_il = data.size() > 0;
+        }
+        #endif // CL_VERSION_2_1
+
+        std::string options;
+        size_t len = 0;
+
+        if(clGetProgramBuildInfo(prog, ctx.selected_device, CL_PROGRAM_BUILD_OPTIONS, 0, nullptr, &len) == CL_SUCCESS && len > 0)
+        {
+            options.resize(len);
+
+            clGetProgramBuildInfo(prog, ctx.selected_device, CL_PROGRAM_BUILD_OPTIONS, len, &options[0], nullptr);
+
+            options.resize(strlen(options.c_str()));
+        }
+
+        begin(trace_op::PROGRAM);
+        put(program_id);
+        put(is_il);
+        put_string(data);
+        put_string(options);
+    }
+
+    uint64_t id = next_id++;
+    kernels[kern.ckernel] = id;
+
+    ///names from clGetKernelInfo carry their nul
+    std::string name = kern.name.c_str();
+
+    begin(trace_op::KERNEL);
+    put(id);
+    put(program_id);
+    put_string(name);
+
+    return id;
+}
+
+static const void* mem_handle(cl::buffer& buf)
+{
+    if(buf.format == cl::buffer::SVM)
+        return buf.svm_ptr;
+
+    return buf.cmem;
+}
+
+uint64_t cl::capture_state::find_mem(const void* handle)
+{
+    auto it = mems.find(handle);
+
+    if(it == mems.end())
+        return 0;
+
+    return it->second;
+}
+
+void cl::capture_state::record_alloc(buffer& buf)
+{
+    const void* handle = mem_handle(buf);
+
+    if(handle == nullptr)
+        return;
+
+    uint64_t id = next_id++;
+    mems[handle] = id;
+
+    cl_mem_flags flags = 0;
+
+    if(buf.format == buffer::SVM)
+    {
+        #ifdef CL_VERSION_2_0
+        flags = CL_MEM_READ_WRITE;
+
+        if(buf.svm_fine_grain)
+            flags |= CL_MEM_SVM_FINE_GRAIN_BUFFER;
+        #endif // CL_VERSION_2_0
+    }
+    else
+    {
+        clGetMemObjectInfo(buf.cmem, CL_MEM_FLAGS, sizeof(flags), &flags, nullptr);
+    }
+
+    begin(trace_op::ALLOC);
+    put(id);
+    put(buf.format);
+    put(buf.alloc_size);
+    put(flags);
+
+    if(buf.format == buffer::IMAGE)
+    {
+        ///gl interop images only know their format and size from the driver
+        cl_image_format fmt;
+        fmt.image_channel_order = buf.image_order;
+        fmt.image_channel_data_type = buf.image_type;
+
+        size_t w = buf.image_dims[0];
+        size_t h = buf.image_dims[1];
+
+        clGetImageInfo(buf.cmem, CL_IMAGE_FORMAT, sizeof(fmt), &fmt, nullptr);
+        clGetImageInfo(buf.cmem, CL_IMAGE_WIDTH, sizeof(size_t), &w, nullptr);
+        clGetImageInfo(buf.cmem, CL_IMAGE_HEIGHT, sizeof(size_t), &h, nullptr);
+
+        put(fmt.image_channel_order);
+        put(fmt.image_channel_data_type);
+        put(w);
+        put(h);
+    }
+}
+
+uint64_t cl::capture_state::mem_id(buffer& buf)
+{
+    uint64_t id = find_mem(mem_handle(buf));
+
+    if(id != 0)
+        return id;
+
+    record_alloc(buf);
+
+    return find_mem(mem_handle(buf));
+}
+
+bool cl::start_capture(context& ctx, const std::string& fname, const capture_options& opts)
+{
+    std::shared_ptr<capture_state> state = std::make_shared<capture_state>();
+
+    state->out.open(fname, std::ios::binary);
+
+    if(!state->out.good())
+    {
+        lg::error("Could not open capture file ", fname);
+        return false;
+    }
+
+    state->options = opts;
+    state->last_record = std::chrono::steady_clock::now();
+
+    state->out.write(trace_magic, sizeof(trace_magic));
+
+    std::atomic_store(&ctx.capture, state);
+
+    lg::info("Capturing to ", fname);
+
+    return true;
+}
+
+void cl::stop_capture(context& ctx)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&ctx.capture);
+
+    if(!state)
+        return;
+
+    std::atomic_store(&ctx.capture, std::shared_ptr<capture_state>());
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    state->out.close();
+
+    lg::info("Captured ", state->records, " records");
+}
+
+void cl::capture_alloc(buffer& buf)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&buf.ctx.capture);
+
+    if(!state)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    state->record_alloc(buf);
+}
+
+void cl::capture_free(context& ctx, const void* handle)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&ctx.capture);
+
+    if(!state || handle == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    uint64_t id = state->find_mem(handle);
+
+    if(id == 0)
+        return;
+
+    state->mems.erase(handle);
+
+    state->begin(trace_op::FREE);
+    state->put(id);
+}
+
+void cl::capture_transfer(command_queue& cqueue, buffer& buf, bool write, int64_t offset, int64_t bytes, const void* host, cl_uint num_events, const cl_event* events, cl_event* out)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&cqueue.ctx.capture);
+
+    if(!state)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    uint64_t queue = state->queue_id(cqueue);
+    uint64_t id = state->mem_id(buf);
+
+    state->begin(write ? trace_op::WRITE : trace_op::READ);
+    state->put(queue);
+    state->put(id);
+    state->put(offset);
+    state->put(bytes);
+    state->put_events(num_events, events);
+    state->put_out_event(out);
+
+    if(write)
+        state->put_payload(host, bytes);
+}
+
+void cl::capture_image(command_queue& cqueue, buffer& buf, bool write, const size_t* origin, const size_t* region, size_t row_pitch, const void* host, cl_event* out)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&cqueue.ctx.capture);
+
+    if(!state)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    uint64_t queue = state->queue_id(cqueue);
+    uint64_t id = state->mem_id(buf);
+
+    state->begin(write ? trace_op::WRITE_IMAGE : trace_op::READ_IMAGE);
+    state->put(queue);
+    state->put(id);
+
+    for(int i=0; i < 3; i++)
+        state->put(origin[i]);
+
+    for(int i=0; i < 3; i++)
+        state->put(region[i]);
+
+    state->put_out_event(out);
+
+    if(!write)
+        return;
+
+    size_t element = 0;
+
+    clGetImageInfo(buf.cmem, CL_IMAGE_ELEMENT_SIZE, sizeof(element), &element, nullptr);
+
+    size_t row_bytes = region[0] * element;
+    int64_t bytes = (int64_t)row_bytes * region[1] * region[2];
+
+    if(row_pitch == 0 || row_pitch == row_bytes || !state->options.payloads)
+    {
+        state->put_payload(host, bytes);
+        return;
+    }
+
+    ///trace payloads are always tightly packed
+    std::vector<char> packed(bytes);
+
+    for(size_t y=0; y < region[1] * region[2]; y++)
+        memcpy(&packed[y * row_bytes], (const char*)host + y * row_pitch, row_bytes);
+
+    state->put_payload(&packed[0], bytes);
+}
+
+void cl::capture_fill(command_queue& cqueue, buffer& buf)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&cqueue.ctx.capture);
+
+    if(!state)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    uint64_t queue = state->queue_id(cqueue);
+    uint64_t id = state->mem_id(buf);
+
+    state->begin(trace_op::FILL);
+    state->put(queue);
+    state->put(id);
+}
+
+void cl::capture_copy(command_queue& cqueue, buffer& dst, const void* src_handle, int64_t bytes)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&cqueue.ctx.capture);
+
+    if(!state)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    uint64_t src = state->find_mem(src_handle);
+
+    ///the source predates the capture, so there's nothing to copy from
+    if(src == 0)
+        return;
+
+    uint64_t queue = state->queue_id(cqueue);
+    uint64_t id = state->mem_id(dst);
+
+    state->begin(trace_op::COPY);
+    state->put(queue);
+    state->put(src);
+    state->put(id);
+    state->put(bytes);
+}
+
+void cl::capture_exec(command_queue& cqueue, kernel& kern, args& pack, int dim, const size_t* offset, const size_t* global, const size_t* local, cl_uint num_events, const cl_event* events, cl_event* out)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&cqueue.ctx.capture);
+
+    if(!state)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    uint64_t queue = state->queue_id(cqueue);
+    uint64_t kid = state->kernel_id(cqueue.ctx, kern);
+
+    for(buffer* buf : pack.buffers)
+        state->mem_id(*buf);
+
+    state->begin(trace_op::EXEC);
+    state->put(queue);
+    state->put(kid);
+    state->put(dim);
+
+    state->put(offset != nullptr);
+
+    for(int i=0; i < dim && offset; i++)
+        state->put(offset[i]);
+
+    for(int i=0; i < dim; i++)
+        state->put(global[i]);
+
+    state->put(local != nullptr);
+
+    for(int i=0; i < dim && local; i++)
+        state->put(local[i]);
+
+    state->put(pack.arg_list.size());
+
+    for(const arg_info& arg : pack.arg_list)
+    {
+        if(arg.svm)
+        {
+            state->put((uint64_t)trace_arg::SVM);
+            state->put(state->find_mem(arg.ptr));
+            continue;
+        }
+
+        if(arg.ptr == nullptr)
+        {
+            state->put((uint64_t)trace_arg::LOCAL);
+            state->put(arg.size);
+            continue;
+        }
+
+        uint64_t mem = 0;
+
+        if(arg.size == sizeof(cl_mem))
+            mem = state->find_mem(*(const cl_mem*)arg.ptr);
+
+        if(mem != 0)
+        {
+            state->put((uint64_t)trace_arg::MEM);
+            state->put(mem);
+            continue;
+        }
+
+        state->put((uint64_t)trace_arg::VALUE);
+        state->put(arg.size);
+        state->put_bytes(arg.ptr, arg.size);
+    }
+
+    state->put(pack.svm_indirect.size());
+
+    for(void* ptr : pack.svm_indirect)
+        state->put(state->find_mem(ptr));
+
+    state->put_events(num_events, events);
+    state->put_out_event(out);
+}
+
+void cl::capture_map(command_queue& cqueue, buffer& buf, cl_map_flags flags, int64_t bytes, void* ptr)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&cqueue.ctx.capture);
+
+    if(!state || ptr == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    capture_state::map_info info;
+    info.queue = state->queue_id(cqueue);
+    info.id = state->mem_id(buf);
+    info.flags = flags;
+    info.bytes = bytes;
+
+    state->maps[ptr] = info;
+
+    state->begin(trace_op::MAP);
+    state->put(info.queue);
+    state->put(info.id);
+    state->put(flags);
+    state->put(bytes);
+}
+
+void cl::capture_unmap(command_queue& cqueue, buffer& buf, void* ptr)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&cqueue.ctx.capture);
+
+    if(!state)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    auto it = state->maps.find(ptr);
+
+    ///mapped before the capture started
+    if(it == state->maps.end())
+        return;
+
+    capture_state::map_info info = it->second;
+
+    state->maps.erase(it);
+
+    state->begin(trace_op::UNMAP);
+    state->put(info.queue);
+    state->put(info.id);
+
+    ///whatever the host wrote through the map, so the replay writes the same
+    if((info.flags & CL_MAP_READ) == info.flags)
+        state->put_payload(nullptr, 0);
+    else
+        state->put_payload(ptr, info.bytes);
+}
+
+void cl::capture_finish(command_queue& cqueue)
+{
+    std::shared_ptr<capture_state> state = std::atomic_load(&cqueue.ctx.capture);
+
+    if(!state)
+        return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+
+    uint64_t queue = state->queue_id(cqueue);
+
+    state->begin(trace_op::FINISH);
+    state->put(queue);
+}
+
+namespace
+{
+    struct trace_reader
+    {
+        const uint8_t* ptr = nullptr;
+        const uint8_t* end = nullptr;
+        bool bad = false;
+
+        bool done()
+        {
+            return bad || ptr >= end;
+        }
+
+        uint8_t get_u8()
+        {
+            if(ptr >= end)
+            {
+                bad = true;
+                return 0;
+            }
+
+            return *ptr++;
+        }
+
+        uint64_t get()
+        {
+            uint64_t ret = 0;
+            int shift = 0;
+
+            while(shift < 64)
+            {
+                uint8_t next = get_u8();
+
+                if(bad)
+                    return 0;
+
+                ret |= (uint64_t)(next & 0x7f) << shift;
+
+                if((next & 0x80) == 0)
+                    return ret;
+
+                shift += 7;
+            }
+
+            bad = true;
+            return 0;
+        }
+
+        const void* get_bytes(uint64_t len)
+        {
+            if(len > (uint64_t)(end - ptr))
+            {
+                bad = true;
+                return nullptr;
+            }
+
+            const void* ret = ptr;
+            ptr += len;
+
+            return ret;
+        }
+
+        std::string get_string()
+        {
+            uint64_t len = get();
+            const void* data = get_bytes(len);
+
+            if(data == nullptr)
+                return "";
+
+            return std::string((const char*)data, len);
+        }
+
+        ///nullptr if it was captured without its payload
+        const void* get_payload(int64_t& bytes)
+        {
+            bytes = get();
+
+            if(get() == 0)
+                return nullptr;
+
+            return get_bytes(bytes);
+        }
+
+        std::vector<uint64_t> get_list()
+        {
+            std::vector<uint64_t> ret;
+
+            uint64_t num = get();
+
+            for(uint64_t i=0; i < num && !bad; i++)
+                ret.push_back(get());
+
+            return ret;
+        }
+    };
+
+    double ms_since(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+cl::replayer::replayer(context& in) : ctx(in)
+{
+
+}
+
+cl::replayer::~replayer()
+{
+    release_all();
+}
+
+void* cl::replayer::get_scratch(std::vector<char>& scratch, int64_t bytes)
+{
+    if((int64_t)scratch.size() < bytes)
+    {
+        ///unserialised transfers can still be using the old one
+        for(auto& i : queues)
+            clFinish(i.second->cqueue);
+
+        scratch.resize(bytes);
+    }
+
+    if(scratch.size() == 0)
+        scratch.resize(1);
+
+    return &scratch[0];
+}
+
+void cl::replayer::set_event(uint64_t id, cl_event evt)
+{
+    if(evt == nullptr)
+        return;
+
+    if(id == 0)
+    {
+        clReleaseEvent(evt);
+        return;
+    }
+
+    auto it = events.find(id);
+
+    if(it != events.end())
+        clReleaseEvent(it->second);
+
+    events[id] = evt;
+}
+
+void cl::replayer::release_all()
+{
+    for(auto& i : queues)
+        clFinish(i.second->cqueue);
+
+    for(auto& i : events)
+        clReleaseEvent(i.second);
+
+    for(auto& i : mems)
+    {
+        if(i.second.mem)
+            clReleaseMemObject(i.second.mem);
+
+        #ifdef CL_VERSION_2_0
+        if(i.second.svm)
+            clSVMFree(ctx, i.second.svm);
+        #endif // CL_VERSION_2_0
+    }
+
+    for(auto& i : kernels)
+        clReleaseKernel(i.second.ckernel);
+
+    for(auto& i : programs)
+        clReleaseProgram(i.second);
+
+    events.clear();
+    mems.clear();
+    kernels.clear();
+    programs.clear();
+    maps.clear();
+    queues.clear();
+}
+
+bool cl::replayer::run(const std::string& fname)
+{
+    release_all();
+    timings.clear();
+    total_ms = 0;
+
+    mapped_file file;
+
+    if(!file.open(fname))
+    {
+        lg::error("Could not open trace ", fname);
+        return false;
+    }
+
+    if(file.size < (int64_t)sizeof(trace_magic) || memcmp(file.data, trace_magic, sizeof(trace_magic)) != 0)
+    {
+        lg::error(fname, " is not a trace");
+        return false;
+    }
+
+    trace_reader in;
+    in.ptr = (const uint8_t*)file.data + sizeof(trace_magic);
+    in.end = (const uint8_t*)file.data + file.size;
+
+    auto start = std::chrono::steady_clock::now();
+
+    bool ok = true;
+
+    while(!in.done())
+    {
+        trace_op op = (trace_op)in.get_u8();
+        in.get();
+
+        replay_timing timing;
+        timing.op = op;
+
+        auto op_start = std::chrono::steady_clock::now();
+
+        cl_event evt = nullptr;
+        uint64_t out_id = 0;
+        cl_int err = CL_SUCCESS;
+
+        auto get_queue = [&](uint64_t id) -> command_queue*
+        {
+            auto it = queues.find(id);
+
+            if(it == queues.end())
+            {
+                in.bad = true;
+                return nullptr;
+            }
+
+            return it->second.get();
+        };
+
+        auto get_deps = [&](const std::vector<uint64_t>& ids)
+        {
+            std::vector<cl_event> ret;
+
+            for(uint64_t id : ids)
+            {
+                auto it = events.find(id);
+
+                if(it != events.end())
+                    ret.push_back(it->second);
+            }
+
+            return ret;
+        };
+
+        if(op == trace_op::QUEUE)
+        {
+            uint64_t id = in.get();
+            uint64_t device = in.get();
+
+            queues[id] = std::make_shared<command_queue>(ctx, ctx.devices[device % ctx.num_devices], CL_QUEUE_PROFILING_ENABLE);
+        }
+        else if(op == trace_op::PROGRAM)
+        {
+            uint64_t id = in.get();
+            bool is_il = in.get();
+            std::string data = in.get_string();
+            std::string options = in.get_string();
+
+            cl_program prog = nullptr;
+
+            if(is_il)
+            {
+                #ifdef CL_VERSION_2_1
+                prog = clCreateProgramWithIL(ctx, data.data(), data.size(), &err);
+                #else
+                err = CL_INVALID_OPERATION;
+                #endif // CL_VERSION_2_1
+            }
+            else
+            {
+                const char* ptr = data.c_str();
+                size_t len = data.size();
+
+                prog = clCreateProgramWithSource(ctx, 1, &ptr, &len, &err);
+            }
+
+            if(err == CL_SUCCESS)
+                err = clBuildProgram(prog, ctx.num_devices, ctx.devices, options.c_str(), nullptr, nullptr);
+
+            if(err != CL_SUCCESS)
+                lg::error("Replay program ", id, " failed to build ", err);
+
+            programs[id] = prog;
+        }
+        else if(op == trace_op::KERNEL)
+        {
+            uint64_t id = in.get();
+            uint64_t program_id = in.get();
+            std::string name = in.get_string();
+
+            cl_kernel kern = clCreateKernel(programs[program_id], name.c_str(), &err);
+
+            if(err != CL_SUCCESS)
+                lg::error("Replay kernel ", name, " err ", err);
+
+            kernels[id] = kernel(kern);
+            kernels[id].name = name;
+        }
+        else if(op == trace_op::ALLOC)
+        {
+            uint64_t id = in.get();
+            uint64_t format = in.get();
+            int64_t bytes = in.get();
+            cl_mem_flags flags = in.get();
+
+            replay_mem mem;
+            mem.bytes = bytes;
+
+            ///the captured host memory isn't around any more
+            flags &= ~(cl_mem_flags)(CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR);
+
+            if(format == buffer::IMAGE)
+            {
+                cl_image_format fmt;
+                fmt.image_channel_order = in.get();
+                fmt.image_channel_data_type = in.get();
+                size_t w = in.get();
+                size_t h = in.get();
+
+                mem.mem = clCreateImage2D(ctx, flags, &fmt, w, h, 0, nullptr, &err);
+            }
+            else if(format == buffer::SVM)
+            {
+                #ifdef CL_VERSION_2_0
+                mem.svm = clSVMAlloc(ctx, flags, bytes, 0);
+
+                if(mem.svm == nullptr)
+                    err = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+                #else
+                err = CL_INVALID_OPERATION;
+                #endif // CL_VERSION_2_0
+            }
+            else
+            {
+                mem.mem = clCreateBuffer(ctx, flags, bytes, nullptr, &err);
+            }
+
+            timing.bytes = bytes;
+
+            mems[id] = mem;
+        }
+        else if(op == trace_op::FREE)
+        {
+            uint64_t id = in.get();
+
+            auto it = mems.find(id);
+
+            if(it != mems.end())
+            {
+                ///frees were deferred until the queue caught up when captured
+                for(auto& q : queues)
+                    clFinish(q.second->cqueue);
+
+                if(it->second.mem)
+                    clReleaseMemObject(it->second.mem);
+
+                #ifdef CL_VERSION_2_0
+                if(it->second.svm)
+                    clSVMFree(ctx, it->second.svm);
+                #endif // CL_VERSION_2_0
+
+                mems.erase(it);
+            }
+        }
+        else if(op == trace_op::WRITE || op == trace_op::READ)
+        {
+            command_queue* cqueue = get_queue(in.get());
+            replay_mem& mem = mems[in.get()];
+            int64_t offset = in.get();
+            int64_t bytes = in.get();
+            std::vector<cl_event> deps = get_deps(in.get_list());
+            out_id = in.get();
+
+            const void* src = nullptr;
+
+            if(op == trace_op::WRITE)
+            {
+                int64_t payload_bytes = 0;
+                src = in.get_payload(payload_bytes);
+            }
+
+            if(cqueue == nullptr)
+                break;
+
+            void* host = (void*)src;
+
+            if(host == nullptr)
+                host = get_scratch(op == trace_op::WRITE ? zeros : sink, bytes);
+
+            const cl_event* first = deps.size() > 0 ? &deps[0] : nullptr;
+
+            if(op == trace_op::WRITE)
+            {
+                #ifdef CL_VERSION_2_0
+                if(mem.svm)
+                    err = clEnqueueSVMMemcpy(*cqueue, CL_FALSE, (char*)mem.svm + offset, host, bytes, deps.size(), first, &evt);
+                else
+                #endif // CL_VERSION_2_0
+                    err = clEnqueueWriteBuffer(*cqueue, mem.mem, CL_FALSE, offset, bytes, host, deps.size(), first, &evt);
+            }
+            else
+            {
+                #ifdef CL_VERSION_2_0
+                if(mem.svm)
+                    err = clEnqueueSVMMemcpy(*cqueue, CL_FALSE, host, (char*)mem.svm + offset, bytes, deps.size(), first, &evt);
+                else
+                #endif // CL_VERSION_2_0
+                    err = clEnqueueReadBuffer(*cqueue, mem.mem, CL_FALSE, offset, bytes, host, deps.size(), first, &evt);
+            }
+
+            timing.bytes = bytes;
+        }
+        else if(op == trace_op::WRITE_IMAGE || op == trace_op::READ_IMAGE)
+        {
+            command_queue* cqueue = get_queue(in.get());
+            replay_mem& mem = mems[in.get()];
+
+            size_t origin[3];
+            size_t region[3];
+
+            for(int i=0; i < 3; i++)
+                origin[i] = in.get();
+
+            for(int i=0; i < 3; i++)
+                region[i] = in.get();
+
+            out_id = in.get();
+
+            const void* src = nullptr;
+            int64_t bytes = 0;
+
+            if(op == trace_op::WRITE_IMAGE)
+                src = in.get_payload(bytes);
+
+            if(cqueue == nullptr)
+                break;
+
+            size_t element = 0;
+            clGetImageInfo(mem.mem, CL_IMAGE_ELEMENT_SIZE, sizeof(element), &element, nullptr);
+
+            bytes = (int64_t)element * region[0] * region[1] * region[2];
+
+            void* host = (void*)src;
+
+            if(host == nullptr)
+                host = get_scratch(op == trace_op::WRITE_IMAGE ? zeros : sink, bytes);
+
+            if(op == trace_op::WRITE_IMAGE)
+                err = clEnqueueWriteImage(*cqueue, mem.mem, CL_FALSE, origin, region, 0, 0, host, 0, nullptr, &evt);
+            else
+                err = clEnqueueReadImage(*cqueue, mem.mem, CL_FALSE, origin, region, 0, 0, host, 0, nullptr, &evt);
+
+            timing.bytes = bytes;
+        }
+        else if(op == trace_op::FILL)
+        {
+            command_queue* cqueue = get_queue(in.get());
+            replay_mem& mem = mems[in.get()];
+
+            if(cqueue == nullptr)
+                break;
+
+            cl_uint zeros[4] = {0};
+
+            if(mem.svm)
+            {
+                #ifdef CL_VERSION_2_0
+                err = clEnqueueSVMMemFill(*cqueue, mem.svm, &zeros[0], sizeof(cl_uchar), mem.bytes, 0, nullptr, &evt);
+                #endif // CL_VERSION_2_0
+            }
+            else
+            {
+                cl_mem_object_type type = CL_MEM_OBJECT_BUFFER;
+                clGetMemObjectInfo(mem.mem, CL_MEM_TYPE, sizeof(type), &type, nullptr);
+
+                if(type == CL_MEM_OBJECT_BUFFER)
+                {
+                    err = clEnqueueFillBuffer(*cqueue, mem.mem, &zeros[0], sizeof(cl_uchar), 0, mem.bytes, 0, nullptr, &evt);
+                }
+                else
+                {
+                    size_t origin[3] = {0};
+                    size_t region[3] = {1, 1, 1};
+
+                    clGetImageInfo(mem.mem, CL_IMAGE_WIDTH, sizeof(size_t), &region[0], nullptr);
+                    clGetImageInfo(mem.mem, CL_IMAGE_HEIGHT, sizeof(size_t), &region[1], nullptr);
+
+                    err = clEnqueueFillImage(*cqueue, mem.mem, &zeros[0], origin, region, 0, nullptr, &evt);
+                }
+            }
+
+            timing.bytes = mem.bytes;
+        }
+        else if(op == trace_op::COPY)
+        {
+            command_queue* cqueue = get_queue(in.get());
+            replay_mem& src = mems[in.get()];
+            replay_mem& dst = mems[in.get()];
+            int64_t bytes = in.get();
+
+            if(cqueue == nullptr)
+                break;
+
+            #ifdef CL_VERSION_2_0
+            if(src.svm && dst.svm)
+                err = clEnqueueSVMMemcpy(*cqueue, CL_FALSE, dst.svm, src.svm, bytes, 0, nullptr, &evt);
+            else
+            #endif // CL_VERSION_2_0
+                err = clEnqueueCopyBuffer(*cqueue, src.mem, dst.mem, 0, 0, bytes, 0, nullptr, &evt);
+
+            timing.bytes = bytes;
+        }
+        else if(op == trace_op::EXEC)
+        {
+            command_queue* cqueue = get_queue(in.get());
+            kernel& kern = kernels[in.get()];
+            int dim = in.get();
+
+            if(dim < 1 || dim > 3)
+            {
+                in.bad = true;
+                break;
+            }
+
+            size_t offset[3] = {0};
+            size_t global[3] = {0};
+            size_t local[3] = {0};
+
+            bool has_offset = in.get();
+
+            for(int i=0; i < dim && has_offset; i++)
+                offset[i] = in.get();
+
+            for(int i=0; i < dim; i++)
+                global[i] = in.get();
+
+            bool has_local = in.get();
+
+            for(int i=0; i < dim && has_local; i++)
+                local[i] = in.get();
+
+            uint64_t num_args = in.get();
+
+            for(uint64_t i=0; i < num_args && !in.bad; i++)
+            {
+                trace_arg kind = (trace_arg)in.get();
+
+                cl_int arg_err = CL_SUCCESS;
+
+                if(kind == trace_arg::VALUE)
+                {
+                    uint64_t size = in.get();
+                    const void* data = in.get_bytes(size);
+
+                    arg_err = clSetKernelArg(kern.ckernel, i, size, data);
+                }
+                else if(kind == trace_arg::LOCAL)
+                {
+                    arg_err = clSetKernelArg(kern.ckernel, i, in.get(), nullptr);
+                }
+                else if(kind == trace_arg::MEM)
+                {
+                    replay_mem& mem = mems[in.get()];
+
+                    arg_err = clSetKernelArg(kern.ckernel, i, sizeof(cl_mem), &mem.mem);
+                }
+                else
+                {
+                    replay_mem& mem = mems[in.get()];
+
+                    #ifdef CL_VERSION_2_0
+                    arg_err = clSetKernelArgSVMPointer(kern.ckernel, i, mem.svm);
+                    #endif // CL_VERSION_2_0
+                }
+
+                if(arg_err != CL_SUCCESS)
+                {
+                    static lg::rate_limiter limit;
+
+                    lg::error_limited(limit, "Replay arg ", i, " for ", kern.name, " err ", arg_err);
+                }
+            }
+
+            std::vector<void*> indirect;
+
+            for(uint64_t id : in.get_list())
+                indirect.push_back(mems[id].svm);
+
+            set_svm_indirect(kern, indirect);
+
+            std::vector<cl_event> deps = get_deps(in.get_list());
+            out_id = in.get();
+
+            if(cqueue == nullptr || in.bad)
+                break;
+
+            err = clEnqueueNDRangeKernel(*cqueue, kern.ckernel, dim, has_offset ? offset : nullptr, global, has_local ? local : nullptr, deps.size(), deps.size() > 0 ? &deps[0] : nullptr, &evt);
+
+            timing.name = kern.name;
+        }
+        else if(op == trace_op::MAP)
+        {
+            command_queue* cqueue = get_queue(in.get());
+            uint64_t id = in.get();
+            cl_map_flags flags = in.get();
+            int64_t bytes = in.get();
+
+            if(cqueue == nullptr)
+                break;
+
+            replay_mem& mem = mems[id];
+
+            void* ptr = nullptr;
+
+            if(mem.svm)
+            {
+                #ifdef CL_VERSION_2_0
+                err = clEnqueueSVMMap(*cqueue, CL_TRUE, flags, mem.svm, bytes, 0, nullptr, nullptr);
+                ptr = mem.svm;
+                #endif // CL_VERSION_2_0
+            }
+            else
+            {
+                ptr = clEnqueueMapBuffer(*cqueue, mem.mem, CL_TRUE, flags, 0, bytes, 0, nullptr, nullptr, &err);
+            }
+
+            maps[id] = ptr;
+
+            timing.bytes = bytes;
+        }
+        else if(op == trace_op::UNMAP)
+        {
+            command_queue* cqueue = get_queue(in.get());
+            uint64_t id = in.get();
+
+            int64_t bytes = 0;
+            const void* src = in.get_payload(bytes);
+
+            if(cqueue == nullptr)
+                break;
+
+            replay_mem& mem = mems[id];
+            void* ptr = maps[id];
+
+            maps.erase(id);
+
+            if(ptr != nullptr)
+            {
+                if(src)
+                    memcpy(ptr, src, bytes);
+
+                #ifdef CL_VERSION_2_0
+                if(mem.svm)
+                    err = clEnqueueSVMUnmap(*cqueue, ptr, 0, nullptr, &evt);
+                else
+                #endif // CL_VERSION_2_0
+                    err = clEnqueueUnmapMemObject(*cqueue, mem.mem, ptr, 0, nullptr, &evt);
+            }
+
+            timing.bytes = bytes;
+        }
+        else if(op == trace_op::FINISH)
+        {
+            command_queue* cqueue = get_queue(in.get());
+
+            if(cqueue == nullptr)
+                break;
+
+            err = clFinish(*cqueue);
+        }
+        else
+        {
+            lg::error("Unknown trace op ", (int)op);
+            in.bad = true;
+            break;
+        }
+
+        if(err != CL_SUCCESS)
+        {
+            static lg::rate_limiter limit;
+
+            lg::error_limited(limit, "Replay of ", trace_op_name(op), " ", timing.name, " failed ", err);
+
+            ok = false;
+        }
+
+        if(evt != nullptr && serialise)
+        {
+            clWaitForEvents(1, &evt);
+
+            cl_ulong dstart = 0;
+            cl_ulong dend = 0;
+
+            if(clGetEventProfilingInfo(evt, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &dstart, nullptr) == CL_SUCCESS &&
+               clGetEventProfilingInfo(evt, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &dend, nullptr) == CL_SUCCESS && dend >= dstart)
+            {
+                timing.device_ms = (dend - dstart) / 1000. / 1000.;
+            }
+        }
+
+        timing.host_ms = ms_since(op_start);
+
+        set_event(out_id, evt);
+
+        timings.push_back(timing);
+    }
+
+    for(auto& i : queues)
+        clFinish(i.second->cqueue);
+
+    total_ms = ms_since(start);
+
+    if(in.bad)
+    {
+        lg::error("Trace ", fname, " is truncated or corrupt after ", timings.size(), " ops");
+        return false;
+    }
+
+    return ok;
+}
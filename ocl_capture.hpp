@@ -0,0 +1,165 @@
+#ifndef OCL_CAPTURE_HPP_INCLUDED
+#define OCL_CAPTURE_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include <fstream>
+#include <chrono>
+
+///records everything the wrapper enqueues to a binary trace, which replayer can re-run on any device
+///programs are captured from the cl_program the first time one of their kernels runs, so variants and il builds are picked up too
+///buffers allocated before capture started are recreated at their current size on first use, but their contents aren't captured
+///split_executor binds per device sub-buffers itself and isn't captured
+///
+///a trace is the magic "CLTRACE1", then records of [u8 op][varint us since the last record][fields]
+///every integer is an unsigned LEB128 varint, strings and payloads are a varint length then the bytes
+
+namespace cl
+{
+    enum class trace_op : uint8_t
+    {
+        QUEUE = 1, ///id, device index
+        PROGRAM, ///id, is il, source or il, options
+        KERNEL, ///id, program id, name
+        ALLOC, ///id, format, bytes, flags, then order, type, width, height for images
+        FREE, ///id
+        WRITE, ///queue, id, offset, bytes, deps, out, payload
+        READ, ///queue, id, offset, bytes, deps, out
+        WRITE_IMAGE, ///queue, id, origin[3], region[3], out, payload
+        READ_IMAGE, ///queue, id, origin[3], region[3], out
+        FILL, ///queue, id
+        COPY, ///queue, src id, dst id, bytes
+        EXEC, ///queue, kernel, dim, has offset, offset[dim], global[dim], has local, local[dim], args, svm indirect, deps, out
+        MAP, ///queue, id, flags, bytes
+        UNMAP, ///queue, id, payload
+        FINISH, ///queue
+    };
+
+    enum class trace_arg : uint8_t
+    {
+        VALUE,
+        MEM,
+        SVM,
+        LOCAL,
+    };
+
+    std::string trace_op_name(trace_op op);
+
+    struct capture_options
+    {
+        ///the host side of every write, without these the replay uploads zeros
+        bool payloads = true;
+        ///writes bigger than this are recorded without their payload, -1 for no limit
+        int64_t max_payload_bytes = -1;
+    };
+
+    struct capture_state
+    {
+        std::mutex lock;
+        std::ofstream out;
+        capture_options options;
+
+        std::chrono::steady_clock::time_point last_record;
+
+        std::map<const void*, uint64_t> queues;
+        std::map<cl_program, uint64_t> programs;
+        std::map<cl_kernel, uint64_t> kernels;
+        ///cl_mem or svm pointer
+        std::map<const void*, uint64_t> mems;
+        ///every event in here is retained until the capture is destroyed
+        std::map<cl_event, uint64_t> events;
+
+        struct map_info
+        {
+            uint64_t queue = 0;
+            uint64_t id = 0;
+            cl_map_flags flags = 0;
+            int64_t bytes = 0;
+        };
+
+        ///host pointer from a map, until it's unmapped
+        std::map<void*, map_info> maps;
+
+        uint64_t next_id = 1;
+        int64_t records = 0;
+
+        ~capture_state();
+
+        ///all of these need lock held
+        void begin(trace_op op);
+        void put(uint64_t val);
+        void put_bytes(const void* data, int64_t bytes);
+        void put_string(const std::string& str);
+        ///or the payload's length, and no bytes if it's over the limit
+        void put_payload(const void* data, int64_t bytes);
+        void put_events(cl_uint num, const cl_event* evts);
+        void put_out_event(cl_event* evt);
+
+        uint64_t queue_id(command_queue& cqueue);
+        uint64_t kernel_id(context& ctx, kernel& kern);
+        ///registers buffers that were allocated before capture started
+        uint64_t mem_id(buffer& buf);
+        ///0 if unknown
+        uint64_t find_mem(const void* handle);
+        void record_alloc(buffer& buf);
+    };
+
+    ///returns false if the file can't be opened. Capturing again replaces the last capture
+    bool start_capture(context& ctx, const std::string& fname, const capture_options& opts = capture_options());
+    void stop_capture(context& ctx);
+
+    struct replay_timing
+    {
+        trace_op op;
+        ///kernel name for exec, empty otherwise
+        std::string name;
+        int64_t bytes = 0;
+        ///enqueue, plus waiting for completion when serialised
+        double host_ms = 0;
+        ///from event profiling, 0 if not serialised or the op has no event
+        double device_ms = 0;
+    };
+
+    struct replay_mem
+    {
+        cl_mem mem = nullptr;
+        void* svm = nullptr;
+        int64_t bytes = 0;
+    };
+
+    struct replayer
+    {
+        context& ctx;
+
+        ///waits on each op before starting the next, so every op gets its own device time
+        ///otherwise ops overlap the way they did when captured, and only the enqueue is timed
+        bool serialise = true;
+
+        std::vector<replay_timing> timings;
+
+        replayer(context& ctx);
+        ~replayer();
+
+        bool run(const std::string& fname);
+
+        ///end to end, from the first op to everything finishing
+        double total_ms = 0;
+
+    private:
+        std::map<uint64_t, std::shared_ptr<command_queue>> queues;
+        std::map<uint64_t, cl_program> programs;
+        std::map<uint64_t, kernel> kernels;
+        std::map<uint64_t, replay_mem> mems;
+        std::map<uint64_t, cl_event> events;
+        std::map<uint64_t, void*> maps;
+
+        ///zeros for writes captured without payloads, and somewhere for reads to land
+        std::vector<char> zeros;
+        std::vector<char> sink;
+
+        void* get_scratch(std::vector<char>& scratch, int64_t bytes);
+        void set_event(uint64_t id, cl_event evt);
+        void release_all();
+    };
+}
+
+#endif // OCL_CAPTURE_HPP_INCLUDED
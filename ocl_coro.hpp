@@ -0,0 +1,474 @@
+#ifndef OCL_CORO_HPP_INCLUDED
+#define OCL_CORO_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include "ocl_host_task.hpp"
+
+///co_await for events and transfers, C++20 only. Under older standards this header is empty, and says so
+///awaiting registers a clSetEventCallback and suspends, the callback hands the coroutine to an executor to resume,
+///so nothing polls or blocks while waiting on the device
+///    std::vector<float> data = co_await cl::resume_on(sched, buf.async_read<float>(cqueue, pos, dim));
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#include <optional>
+#include <atomic>
+
+namespace cl
+{
+    ///where resumed coroutines run
+    struct executor
+    {
+        virtual void post(std::coroutine_handle<> h) = 0;
+        virtual ~executor(){}
+    };
+
+    ///resumes on a thread pool
+    struct pool_executor : executor
+    {
+        thread_pool& pool;
+
+        pool_executor(thread_pool& in) : pool(in) {}
+
+        void post(std::coroutine_handle<> h) override
+        {
+            pool.add([h](){h.resume();});
+        }
+    };
+
+    template<typename T>
+    struct task;
+
+    namespace coro_detail
+    {
+        struct promise_base
+        {
+            std::coroutine_handle<> continuation;
+
+            struct final_awaiter
+            {
+                bool await_ready() noexcept {return false;}
+
+                template<typename P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+                {
+                    if(h.promise().continuation)
+                        return h.promise().continuation;
+
+                    return std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            std::suspend_always initial_suspend() noexcept {return {};}
+            final_awaiter final_suspend() noexcept {return {};}
+
+            void unhandled_exception() {std::terminate();}
+        };
+
+        template<typename T>
+        struct promise : promise_base
+        {
+            std::optional<T> value;
+
+            task<T> get_return_object();
+
+            void return_value(T val)
+            {
+                value = std::move(val);
+            }
+
+            T result()
+            {
+                return std::move(*value);
+            }
+        };
+
+        template<>
+        struct promise<void> : promise_base
+        {
+            task<void> get_return_object();
+
+            void return_void() {}
+            void result() {}
+        };
+
+        ///fire and forget, destroys itself when done
+        struct detached
+        {
+            struct promise_type
+            {
+                detached get_return_object() {return {};}
+                std::suspend_never initial_suspend() noexcept {return {};}
+                std::suspend_never final_suspend() noexcept {return {};}
+                void return_void() {}
+                void unhandled_exception() {std::terminate();}
+            };
+        };
+    }
+
+    ///lazy, starts when it's awaited or spawned on a scheduler
+    template<typename T>
+    struct task
+    {
+        using promise_type = coro_detail::promise<T>;
+
+        std::coroutine_handle<promise_type> handle;
+
+        task(std::coroutine_handle<promise_type> h) : handle(h) {}
+        task(task&& other) : handle(other.handle) {other.handle = nullptr;}
+        task(const task&) = delete;
+
+        ~task()
+        {
+            if(handle)
+                handle.destroy();
+        }
+
+        bool await_ready() {return false;}
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont)
+        {
+            handle.promise().continuation = cont;
+
+            return handle;
+        }
+
+        T await_resume()
+        {
+            return handle.promise().result();
+        }
+    };
+
+    template<typename T>
+    inline
+    task<T> coro_detail::promise<T>::get_return_object()
+    {
+        return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+    }
+
+    inline
+    task<void> coro_detail::promise<void>::get_return_object()
+    {
+        return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+    }
+
+    ///single threaded run loop. Device callbacks post to it from driver threads, run() resumes everything on the calling thread
+    struct scheduler : executor
+    {
+        void post(std::coroutine_handle<> h) override
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                ready.push_back(h);
+            }
+
+            wake.notify_one();
+        }
+
+        ///starts t on the next run()
+        void spawn(task<void>&& t)
+        {
+            outstanding++;
+
+            start(std::move(t));
+        }
+
+        ///returns once every spawned task has finished
+        void run()
+        {
+            while(1)
+            {
+                std::coroutine_handle<> next;
+
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+
+                    wake.wait(guard, [this]{return ready.size() > 0 || outstanding == 0;});
+
+                    if(ready.size() == 0)
+                        return;
+
+                    next = ready.front();
+                    ready.pop_front();
+                }
+
+                next.resume();
+            }
+        }
+
+    private:
+        std::deque<std::coroutine_handle<>> ready;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::atomic<int> outstanding{0};
+
+        struct schedule_awaiter
+        {
+            scheduler& sched;
+
+            bool await_ready() {return false;}
+            void await_suspend(std::coroutine_handle<> h) {sched.post(h);}
+            void await_resume() {}
+        };
+
+        coro_detail::detached start(task<void> t)
+        {
+            co_await schedule_awaiter{*this};
+
+            co_await t;
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                outstanding--;
+            }
+
+            wake.notify_all();
+        }
+    };
+
+    ///co_await gives the event's final status, CL_COMPLETE or a negative error
+    struct event_awaitable
+    {
+        executor& exec;
+        cl::event evt;
+        cl_int status = CL_COMPLETE;
+        std::coroutine_handle<> waiting;
+
+        event_awaitable(executor& in, const cl::event& e) : exec(in), evt(e) {}
+
+        bool await_ready()
+        {
+            if(evt.bad())
+            {
+                status = CL_INVALID_EVENT;
+                return true;
+            }
+
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            waiting = h;
+
+            cl_int err = clSetEventCallback(evt.cevent, CL_COMPLETE, done, this);
+
+            ///the callback can already have resumed us here, so this can't touch any members on success
+            if(err != CL_SUCCESS)
+            {
+                status = err;
+                return false;
+            }
+
+            return true;
+        }
+
+        cl_int await_resume()
+        {
+            return status;
+        }
+
+    private:
+        static void CL_CALLBACK done(cl_event e, cl_int st, void* user)
+        {
+            event_awaitable* me = (event_awaitable*)user;
+
+            me->status = st;
+            me->exec.post(me->waiting);
+        }
+    };
+
+    ///co_await gives the data that was read, and frees the read_event
+    template<typename T>
+    struct read_awaitable
+    {
+        event_awaitable inner;
+        read_event<T> data;
+
+        read_awaitable(executor& exec, const read_event<T>& in) : inner(exec, in), data(in) {}
+
+        bool await_ready() {return inner.await_ready();}
+        bool await_suspend(std::coroutine_handle<> h) {return inner.await_suspend(h);}
+
+        std::vector<T> await_resume()
+        {
+            std::vector<T> ret;
+
+            cl_int status = inner.await_resume();
+
+            if(status != CL_COMPLETE)
+            {
+                lg::error("Awaited read failed ", status);
+            }
+            else if(data.data)
+            {
+                ret = std::move(*data.data);
+            }
+
+            if(!data.bad())
+                data.del();
+            else if(data.data)
+                delete data.data;
+
+            return ret;
+        }
+    };
+
+    inline
+    event_awaitable resume_on(executor& exec, const cl::event& evt)
+    {
+        return event_awaitable(exec, evt);
+    }
+
+    template<typename T>
+    inline
+    read_awaitable<T> resume_on(executor& exec, const read_event<T>& evt)
+    {
+        return read_awaitable<T>(exec, evt);
+    }
+
+    namespace coro_detail
+    {
+        struct multi_state
+        {
+            executor* exec = nullptr;
+            std::coroutine_handle<> waiting;
+
+            ///events still to go, plus one held while the callbacks are set up
+            std::atomic<int> remaining{1};
+            std::atomic<cl_int> status{CL_COMPLETE};
+            std::atomic<int> winner{-1};
+
+            bool any = false;
+        };
+
+        struct multi_callback
+        {
+            std::shared_ptr<multi_state> state;
+            int idx = 0;
+        };
+
+        inline
+        void CL_CALLBACK multi_done(cl_event e, cl_int st, void* user)
+        {
+            multi_callback* cb = (multi_callback*)user;
+            multi_state& state = *cb->state;
+
+            if(st < 0)
+            {
+                cl_int expected = CL_COMPLETE;
+                state.status.compare_exchange_strong(expected, st);
+            }
+
+            if(state.any)
+            {
+                int expected = -1;
+
+                if(state.winner.compare_exchange_strong(expected, cb->idx))
+                    state.exec->post(state.waiting);
+            }
+            else if(--state.remaining == 0)
+            {
+                state.exec->post(state.waiting);
+            }
+
+            delete cb;
+        }
+
+        struct multi_awaitable
+        {
+            std::shared_ptr<multi_state> state = std::make_shared<multi_state>();
+            std::vector<cl::event> events;
+
+            bool await_ready()
+            {
+                return events.size() == 0;
+            }
+
+            bool await_suspend(std::coroutine_handle<> h)
+            {
+                ///once a callback posts us we can be resumed and destroyed before this returns, so only locals from here on
+                std::shared_ptr<multi_state> st = state;
+                std::vector<cl::event> evts = events;
+
+                st->waiting = h;
+
+                for(int i=0; i < (int)evts.size(); i++)
+                {
+                    if(evts[i].bad())
+                    {
+                        st->status = CL_INVALID_EVENT;
+                        continue;
+                    }
+
+                    multi_callback* cb = new multi_callback;
+                    cb->state = st;
+                    cb->idx = i;
+
+                    st->remaining++;
+
+                    if(clSetEventCallback(evts[i].cevent, CL_COMPLETE, multi_done, cb) != CL_SUCCESS)
+                    {
+                        delete cb;
+
+                        st->remaining--;
+                        st->status = CL_INVALID_EVENT;
+                    }
+                }
+
+                ///when_any with nothing registered would never be woken
+                if(st->any)
+                    return st->remaining > 1;
+
+                return --st->remaining != 0;
+            }
+        };
+    }
+
+    ///co_await gives CL_COMPLETE once every event has, or the first error
+    struct when_all_awaitable : coro_detail::multi_awaitable
+    {
+        cl_int await_resume()
+        {
+            return state->status;
+        }
+    };
+
+    ///co_await gives the index of the first event to complete, or -1 if none could be waited on
+    struct when_any_awaitable : coro_detail::multi_awaitable
+    {
+        int await_resume()
+        {
+            return state->winner;
+        }
+    };
+
+    inline
+    when_all_awaitable when_all(executor& exec, const std::vector<cl::event>& events)
+    {
+        when_all_awaitable ret;
+        ret.state->exec = &exec;
+        ret.events = events;
+
+        return ret;
+    }
+
+    inline
+    when_any_awaitable when_any(executor& exec, const std::vector<cl::event>& events)
+    {
+        when_any_awaitable ret;
+        ret.state->exec = &exec;
+        ret.state->any = true;
+        ret.events = events;
+
+        return ret;
+    }
+}
+
+#else
+#warning "ocl_coro.hpp needs C++20 and <coroutine>, build with -std=c++20 to get co_await support"
+#endif // __cplusplus
+
+#endif // OCL_CORO_HPP_INCLUDED
@@ -0,0 +1,457 @@
+#ifndef OCL_EXPR_HPP_INCLUDED
+#define OCL_EXPR_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include <type_traits>
+#include <functional>
+#include <cstdio>
+
+///elementwise expression templates on typed buffers
+///c = a * b + sin(d) builds the tree at compile time, generates one fused kernel per unique tree shape,
+///builds + registers it with the context the first time its seen and dispatches through exec
+///so a chain of n operations is one memory pass instead of n
+
+namespace cl
+{
+    template<typename T>
+    struct cl_type_name;
+
+    template<> struct cl_type_name<float>    {static constexpr const char* value = "float";};
+    template<> struct cl_type_name<double>   {static constexpr const char* value = "double";};
+    template<> struct cl_type_name<int>      {static constexpr const char* value = "int";};
+    template<> struct cl_type_name<unsigned int> {static constexpr const char* value = "uint";};
+    template<> struct cl_type_name<int64_t>  {static constexpr const char* value = "long";};
+    template<> struct cl_type_name<uint64_t> {static constexpr const char* value = "ulong";};
+    template<> struct cl_type_name<int16_t>  {static constexpr const char* value = "short";};
+    template<> struct cl_type_name<uint16_t> {static constexpr const char* value = "ushort";};
+    template<> struct cl_type_name<int8_t>   {static constexpr const char* value = "char";};
+    template<> struct cl_type_name<uint8_t>  {static constexpr const char* value = "uchar";};
+
+    struct expr_base {};
+
+    template<typename T>
+    struct typed_buffer;
+
+    template<typename T>
+    struct is_typed_buffer : std::false_type {};
+
+    template<typename T>
+    struct is_typed_buffer<typed_buffer<T>> : std::true_type {};
+
+    template<typename T>
+    constexpr bool is_expr_v = std::is_base_of_v<expr_base, T>;
+
+    template<typename T>
+    constexpr bool is_operand_v = is_expr_v<T> || is_typed_buffer<T>::value;
+
+    ///every node provides, in the same left to right order
+    ///params: the kernel parameter list for its leaves
+    ///body: the expression text
+    ///push: the matching kernel arguments
+    template<typename T>
+    struct expr_buffer : expr_base
+    {
+        using value_type = T;
+
+        buffer* buf = nullptr;
+
+        expr_buffer(buffer* buf) : buf(buf) {}
+
+        static void params(std::string& out, int& idx)
+        {
+            out += std::string(", __global const ") + cl_type_name<T>::value + "* a" + std::to_string(idx);
+            idx++;
+        }
+
+        static std::string body(int& idx)
+        {
+            return "a" + std::to_string(idx++) + "[id]";
+        }
+
+        void push(args& pack, int64_t& min_elements)
+        {
+            min_elements = std::min(min_elements, buf->alloc_size / (int64_t)sizeof(T));
+
+            pack.push_back(*buf);
+        }
+    };
+
+    template<typename T>
+    struct expr_scalar : expr_base
+    {
+        using value_type = T;
+
+        T val;
+
+        expr_scalar(T val) : val(val) {}
+
+        static void params(std::string& out, int& idx)
+        {
+            out += std::string(", ") + cl_type_name<T>::value + " a" + std::to_string(idx);
+            idx++;
+        }
+
+        static std::string body(int& idx)
+        {
+            return "a" + std::to_string(idx++);
+        }
+
+        void push(args& pack, int64_t& min_elements)
+        {
+            pack.push_back(val);
+        }
+    };
+
+    template<typename Op, typename L, typename R>
+    struct expr_binary : expr_base
+    {
+        using value_type = typename L::value_type;
+
+        static_assert(std::is_same_v<typename L::value_type, typename R::value_type>, "Mixed element types in expression, cast one side");
+
+        L l;
+        R r;
+
+        expr_binary(const L& l, const R& r) : l(l), r(r) {}
+
+        static void params(std::string& out, int& idx)
+        {
+            L::params(out, idx);
+            R::params(out, idx);
+        }
+
+        static std::string body(int& idx)
+        {
+            std::string a = L::body(idx);
+            std::string b = R::body(idx);
+
+            return Op::emit(a, b);
+        }
+
+        void push(args& pack, int64_t& min_elements)
+        {
+            l.push(pack, min_elements);
+            r.push(pack, min_elements);
+        }
+    };
+
+    template<typename Op, typename E>
+    struct expr_unary : expr_base
+    {
+        using value_type = typename E::value_type;
+
+        E e;
+
+        expr_unary(const E& e) : e(e) {}
+
+        static void params(std::string& out, int& idx)
+        {
+            E::params(out, idx);
+        }
+
+        static std::string body(int& idx)
+        {
+            return Op::emit(E::body(idx));
+        }
+
+        void push(args& pack, int64_t& min_elements)
+        {
+            e.push(pack, min_elements);
+        }
+    };
+
+    #define CL_EXPR_INFIX(name, sym) \
+    struct name \
+    { \
+        static std::string emit(const std::string& a, const std::string& b) {return "(" + a + " " sym " " + b + ")";} \
+    };
+
+    #define CL_EXPR_FUNC2(name, fname) \
+    struct name \
+    { \
+        static std::string emit(const std::string& a, const std::string& b) {return fname "(" + a + ", " + b + ")";} \
+    };
+
+    #define CL_EXPR_FUNC1(name, fname) \
+    struct name \
+    { \
+        static std::string emit(const std::string& a) {return fname "(" + a + ")";} \
+    };
+
+    namespace expr_op
+    {
+        CL_EXPR_INFIX(add, "+");
+        CL_EXPR_INFIX(sub, "-");
+        CL_EXPR_INFIX(mul, "*");
+        CL_EXPR_INFIX(div, "/");
+
+        CL_EXPR_FUNC2(min, "min");
+        CL_EXPR_FUNC2(max, "max");
+        CL_EXPR_FUNC2(pow, "pow");
+
+        CL_EXPR_FUNC1(neg, "-");
+        CL_EXPR_FUNC1(sin, "sin");
+        CL_EXPR_FUNC1(cos, "cos");
+        CL_EXPR_FUNC1(tan, "tan");
+        CL_EXPR_FUNC1(exp, "exp");
+        CL_EXPR_FUNC1(log, "log");
+        CL_EXPR_FUNC1(sqrt, "sqrt");
+        CL_EXPR_FUNC1(rsqrt, "rsqrt");
+        CL_EXPR_FUNC1(fabs, "fabs");
+        CL_EXPR_FUNC1(floor, "floor");
+        CL_EXPR_FUNC1(ceil, "ceil");
+    }
+
+    template<typename T>
+    inline
+    expr_buffer<T> to_expr(const typed_buffer<T>& buf)
+    {
+        return expr_buffer<T>((buffer*)&buf);
+    }
+
+    template<typename E, typename = std::enable_if_t<is_expr_v<E>>>
+    inline
+    const E& to_expr(const E& e)
+    {
+        return e;
+    }
+
+    template<typename T>
+    using expr_of = std::decay_t<decltype(to_expr(std::declval<const T&>()))>;
+
+    ///scalars take on the element type of the other side
+    template<typename Op, typename L, typename R>
+    inline
+    auto make_expr_binary(const L& l, const R& r)
+    {
+        if constexpr(is_operand_v<L> && is_operand_v<R>)
+        {
+            return expr_binary<Op, expr_of<L>, expr_of<R>>(to_expr(l), to_expr(r));
+        }
+        else if constexpr(is_operand_v<L>)
+        {
+            using V = typename expr_of<L>::value_type;
+
+            return expr_binary<Op, expr_of<L>, expr_scalar<V>>(to_expr(l), expr_scalar<V>((V)r));
+        }
+        else
+        {
+            using V = typename expr_of<R>::value_type;
+
+            return expr_binary<Op, expr_scalar<V>, expr_of<R>>(expr_scalar<V>((V)l), to_expr(r));
+        }
+    }
+
+    template<typename L, typename R>
+    constexpr bool is_binary_operands_v = (is_operand_v<L> && is_operand_v<R>) ||
+                                          (is_operand_v<L> && std::is_arithmetic_v<R>) ||
+                                          (std::is_arithmetic_v<L> && is_operand_v<R>);
+
+    #define CL_EXPR_BINARY_OPERATOR(sym, op) \
+    template<typename L, typename R, typename = std::enable_if_t<is_binary_operands_v<L, R>>> \
+    inline auto operator sym(const L& l, const R& r) {return make_expr_binary<op>(l, r);}
+
+    #define CL_EXPR_BINARY_FUNCTION(fname, op) \
+    template<typename L, typename R, typename = std::enable_if_t<is_binary_operands_v<L, R>>> \
+    inline auto fname(const L& l, const R& r) {return make_expr_binary<op>(l, r);}
+
+    #define CL_EXPR_UNARY_FUNCTION(fname, op) \
+    template<typename E, typename = std::enable_if_t<is_operand_v<E>>> \
+    inline auto fname(const E& e) {return expr_unary<op, expr_of<E>>(to_expr(e));}
+
+    ///the opencl builtins behind these only take floating point, an integer buffer would only fail once the kernel is built
+    #define CL_EXPR_FLOAT_BINARY_FUNCTION(fname, op) \
+    template<typename L, typename R, typename = std::enable_if_t<is_binary_operands_v<L, R>>> \
+    inline auto fname(const L& l, const R& r) \
+    { \
+        auto ret = make_expr_binary<op>(l, r); \
+        static_assert(std::is_floating_point_v<typename decltype(ret)::value_type>, #fname " only works on float or double elements"); \
+        return ret; \
+    }
+
+    #define CL_EXPR_FLOAT_UNARY_FUNCTION(fname, op) \
+    template<typename E, typename = std::enable_if_t<is_operand_v<E>>> \
+    inline auto fname(const E& e) \
+    { \
+        static_assert(std::is_floating_point_v<typename expr_of<E>::value_type>, #fname " only works on float or double elements"); \
+        return expr_unary<op, expr_of<E>>(to_expr(e)); \
+    }
+
+    CL_EXPR_BINARY_OPERATOR(+, expr_op::add);
+    CL_EXPR_BINARY_OPERATOR(-, expr_op::sub);
+    CL_EXPR_BINARY_OPERATOR(*, expr_op::mul);
+    CL_EXPR_BINARY_OPERATOR(/, expr_op::div);
+
+    CL_EXPR_BINARY_FUNCTION(min, expr_op::min);
+    CL_EXPR_BINARY_FUNCTION(max, expr_op::max);
+    CL_EXPR_FLOAT_BINARY_FUNCTION(pow, expr_op::pow);
+
+    CL_EXPR_UNARY_FUNCTION(operator-, expr_op::neg);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(sin, expr_op::sin);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(cos, expr_op::cos);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(tan, expr_op::tan);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(exp, expr_op::exp);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(log, expr_op::log);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(sqrt, expr_op::sqrt);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(rsqrt, expr_op::rsqrt);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(fabs, expr_op::fabs);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(floor, expr_op::floor);
+    CL_EXPR_FLOAT_UNARY_FUNCTION(ceil, expr_op::ceil);
+
+    #undef CL_EXPR_BINARY_OPERATOR
+    #undef CL_EXPR_BINARY_FUNCTION
+    #undef CL_EXPR_UNARY_FUNCTION
+    #undef CL_EXPR_FLOAT_BINARY_FUNCTION
+    #undef CL_EXPR_FLOAT_UNARY_FUNCTION
+    #undef CL_EXPR_INFIX
+    #undef CL_EXPR_FUNC2
+    #undef CL_EXPR_FUNC1
+
+    ///source depends only on the shape of the tree, so its generated once per expression type
+    template<typename T, typename E>
+    struct expr_kernel
+    {
+        static const std::string& name()
+        {
+            static std::string n = make_name();
+            return n;
+        }
+
+        static const std::string& source()
+        {
+            static std::string src = make_source(name());
+            return src;
+        }
+
+    private:
+        static std::string make_body()
+        {
+            std::string params = std::string("__global ") + cl_type_name<T>::value + "* out, int n";
+
+            int pidx = 0;
+            E::params(params, pidx);
+
+            int bidx = 0;
+            std::string body = E::body(bidx);
+
+            return "(" + params + ")\n{\n    int id = get_global_id(0);\n\n    if(id >= n)\n        return;\n\n    out[id] = " + body + ";\n}\n";
+        }
+
+        static std::string make_name()
+        {
+            char buf[64] = {0};
+
+            snprintf(buf, sizeof(buf), "cl_expr_%zx", std::hash<std::string>()(make_body()));
+
+            return buf;
+        }
+
+        static std::string make_source(const std::string& kname)
+        {
+            std::string body = make_body();
+
+            std::string src;
+
+            if(body.find("double") != std::string::npos)
+                src += "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n\n";
+
+            src += "__kernel\nvoid " + kname + body;
+
+            return src;
+        }
+    };
+
+    template<typename T>
+    struct typed_buffer : buffer
+    {
+        ///the queue this was allocated on, used by operator=
+        command_queue* queue = nullptr;
+
+        typed_buffer(context& ctx) : buffer(ctx) {}
+
+        void alloc(command_queue& cqueue, const std::vector<T>& data)
+        {
+            queue = &cqueue;
+
+            buffer::alloc(cqueue, data);
+        }
+
+        void alloc_num(command_queue& cqueue, int64_t num)
+        {
+            queue = &cqueue;
+
+            format = BUFFER;
+
+            alloc_bytes(num * sizeof(T));
+            clear_to_zero(cqueue);
+        }
+
+        int64_t num() const
+        {
+            return alloc_size / sizeof(T);
+        }
+
+        std::vector<T> read(command_queue& cqueue)
+        {
+            return read_all<T>(cqueue);
+        }
+
+        template<typename E>
+        void assign(command_queue& cqueue, const E& e, cl::event* evt = nullptr, std::vector<cl::event*> evts = std::vector<cl::event*>())
+        {
+            static_assert(is_operand_v<E>, "Not an expression");
+
+            using ex_t = expr_of<E>;
+
+            static_assert(std::is_same_v<typename ex_t::value_type, T>, "Expression element type does not match destination");
+
+            using kern = expr_kernel<T, ex_t>;
+
+            ensure_program(ctx, kern::name(), kern::source());
+
+            ///keep the leaves alive until the args are set
+            ex_t ex = to_expr(e);
+
+            int n = num();
+            int64_t min_elements = n;
+
+            args pack;
+            pack.push_back(*(buffer*)this);
+            pack.push_back(n);
+
+            ex.push(pack, min_elements);
+
+            if(min_elements < n)
+            {
+                lg::error("Expression input smaller than destination ", min_elements, " < ", n);
+                return;
+            }
+
+            int global_ws[1] = {n};
+            int local_ws[1] = {128};
+
+            cqueue.exec(kern::name(), pack, global_ws, local_ws, evt, evts);
+        }
+
+        typed_buffer& operator=(const typed_buffer& other)
+        {
+            return operator=<typed_buffer>(other);
+        }
+
+        template<typename E, typename = std::enable_if_t<is_operand_v<E>>>
+        typed_buffer& operator=(const E& e)
+        {
+            if(queue == nullptr)
+            {
+                lg::error("typed_buffer assigned to before alloc, use assign");
+                return *this;
+            }
+
+            assign(*queue, e);
+
+            return *this;
+        }
+    };
+}
+
+#endif // OCL_EXPR_HPP_INCLUDED
@@ -0,0 +1,296 @@
+#include "ocl_file.hpp"
+#include "ocl.hpp"
+#include "ocl_transfer.hpp"
+#include <algorithm>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif // _WIN32
+
+cl::mapped_file::~mapped_file()
+{
+    close();
+}
+
+bool cl::mapped_file::open(const std::string& fname)
+{
+    close();
+
+    #ifdef _WIN32
+    HANDLE file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+    if(file == INVALID_HANDLE_VALUE)
+    {
+        lg::error("Could not open ", fname, " for mapping");
+        return false;
+    }
+
+    LARGE_INTEGER fsize;
+
+    if(!GetFileSizeEx(file, &fsize) || fsize.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+
+    if(mapping == nullptr)
+    {
+        lg::error("Could not create file mapping for ", fname);
+        CloseHandle(file);
+        return false;
+    }
+
+    data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+
+    if(data == nullptr)
+    {
+        lg::error("Could not map ", fname);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    file_handle = file;
+    map_handle = mapping;
+    size = fsize.QuadPart;
+    #else
+    fd = ::open(fname.c_str(), O_RDONLY);
+
+    if(fd < 0)
+    {
+        lg::error("Could not open ", fname, " for mapping");
+        return false;
+    }
+
+    struct stat st;
+
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    void* ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    if(ptr == MAP_FAILED)
+    {
+        lg::error("Could not map ", fname);
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    ///it's going to be read front to back
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+
+    data = ptr;
+    size = st.st_size;
+    #endif // _WIN32
+
+    return true;
+}
+
+void cl::mapped_file::close()
+{
+    #ifdef _WIN32
+    if(data)
+        UnmapViewOfFile(data);
+
+    if(map_handle)
+        CloseHandle((HANDLE)map_handle);
+
+    if(file_handle)
+        CloseHandle((HANDLE)file_handle);
+
+    file_handle = nullptr;
+    map_handle = nullptr;
+    #else
+    if(data)
+        munmap(data, size);
+
+    if(fd >= 0)
+        ::close(fd);
+
+    fd = -1;
+    #endif // _WIN32
+
+    data = nullptr;
+    size = 0;
+}
+
+static void CL_CALLBACK drop_mapping(cl_mem mem, void* user)
+{
+    delete (std::shared_ptr<cl::mapped_file>*)user;
+}
+
+bool cl::adopt_mapping(buffer& buf, const std::shared_ptr<mapped_file>& file, int64_t offset, int64_t bytes)
+{
+    if(!buf.adopt_host_ptr((char*)file->data + offset, bytes))
+        return false;
+
+    std::shared_ptr<mapped_file>* keep = new std::shared_ptr<mapped_file>(file);
+
+    cl_int err = clSetMemObjectDestructorCallback(buf.cmem, drop_mapping, keep);
+
+    if(err != CL_SUCCESS)
+    {
+        lg::error("Could not set destructor callback, leaking a file mapping ", err);
+    }
+
+    return true;
+}
+
+int64_t cl::page_size()
+{
+    #ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return info.dwPageSize;
+    #else
+    return sysconf(_SC_PAGESIZE);
+    #endif // _WIN32
+}
+
+void* cl::alloc_pages(int64_t bytes)
+{
+    #ifdef _WIN32
+    return _aligned_malloc(bytes, page_size());
+    #else
+    void* ptr = nullptr;
+
+    if(posix_memalign(&ptr, page_size(), bytes) != 0)
+        return nullptr;
+
+    return ptr;
+    #endif // _WIN32
+}
+
+void cl::free_pages(void* ptr)
+{
+    #ifdef _WIN32
+    _aligned_free(ptr);
+    #else
+    free(ptr);
+    #endif // _WIN32
+}
+
+bool cl::write_file_direct(const std::string& fname, const void* data, int64_t bytes)
+{
+    ///big writes, but not so big that one call has to be split by the os anyway
+    const int64_t max_write = 64 * 1024 * 1024;
+
+    #ifdef _WIN32
+    HANDLE file = CreateFileA(fname.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, nullptr);
+
+    if(file == INVALID_HANDLE_VALUE)
+        file = CreateFileA(fname.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if(file == INVALID_HANDLE_VALUE)
+    {
+        lg::error("Could not open ", fname, " for writing");
+        return false;
+    }
+
+    int64_t done = 0;
+
+    while(done < bytes)
+    {
+        DWORD piece = std::min(bytes - done, max_write);
+        DWORD written = 0;
+
+        if(!WriteFile(file, (const char*)data + done, piece, &written, nullptr) || written == 0)
+        {
+            lg::error("Error writing ", fname);
+            CloseHandle(file);
+            return false;
+        }
+
+        done += written;
+    }
+
+    CloseHandle(file);
+    #else
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    #ifdef O_DIRECT
+    int fd = ::open(fname.c_str(), flags | O_DIRECT, 0644);
+
+    ///tmpfs and friends don't do direct io
+    if(fd < 0)
+        fd = ::open(fname.c_str(), flags, 0644);
+    #else
+    int fd = ::open(fname.c_str(), flags, 0644);
+    #endif // O_DIRECT
+
+    if(fd < 0)
+    {
+        lg::error("Could not open ", fname, " for writing");
+        return false;
+    }
+
+    int64_t done = 0;
+
+    while(done < bytes)
+    {
+        int64_t piece = std::min(bytes - done, max_write);
+
+        ssize_t written = ::write(fd, (const char*)data + done, piece);
+
+        if(written <= 0)
+        {
+            lg::error("Error writing ", fname);
+            ::close(fd);
+            return false;
+        }
+
+        done += written;
+    }
+
+    ::close(fd);
+    #endif // _WIN32
+
+    return true;
+}
+
+bool cl::buffer::alloc_from_file(command_queue& cqueue, const std::string& fname)
+{
+    std::shared_ptr<mapped_file> file = std::make_shared<mapped_file>();
+
+    if(!file->open(fname))
+        return false;
+
+    format = BUFFER;
+
+    ///the mapping is the buffer, it gets unmapped once the driver is done with the cl_mem
+    if(ctx.host_unified_memory && policy.place != mem_policy::DEVICE && policy.place != mem_policy::ALLOC_HOST_PTR)
+    {
+        if(adopt_mapping(*this, file, 0, file->size))
+            return true;
+
+        ///copied out of the mapping instead, which is still fine
+        return alloc_size > 0 && host_ptr == nullptr && cmem != nullptr;
+    }
+
+    ///page faults in the source overlap with the device copying the previous chunk
+    alloc_bytes(file->size);
+
+    cl_int err = transfer_write_with(transfer_method::STAGED, cqueue, *this, 0, file->size, file->data, true, 0, nullptr, nullptr);
+
+    if(err != CL_SUCCESS)
+    {
+        lg::error("Error uploading ", fname, " ", err);
+        return false;
+    }
+
+    return true;
+}
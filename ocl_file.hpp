@@ -0,0 +1,49 @@
+#ifndef OCL_FILE_HPP_INCLUDED
+#define OCL_FILE_HPP_INCLUDED
+
+#include <string>
+#include <memory>
+#include <stdint.h>
+
+namespace cl
+{
+    ///a whole file mapped into memory, copy on write so the mapping can be written to without touching the file
+    struct mapped_file
+    {
+        void* data = nullptr;
+        int64_t size = 0;
+
+        mapped_file() = default;
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        ~mapped_file();
+
+        bool open(const std::string& fname);
+        void close();
+
+    private:
+        #ifdef _WIN32
+        void* file_handle = nullptr;
+        void* map_handle = nullptr;
+        #else
+        int fd = -1;
+        #endif // _WIN32
+    };
+
+    struct buffer;
+
+    ///wraps [offset, offset + bytes) of the mapping with CL_MEM_USE_HOST_PTR, the mapping stays alive until the driver frees the cl_mem
+    ///returns false if it had to copy instead, see buffer::adopt_host_ptr
+    bool adopt_mapping(buffer& buf, const std::shared_ptr<mapped_file>& file, int64_t offset, int64_t bytes);
+
+    ///page aligned host memory, for direct io
+    void* alloc_pages(int64_t bytes);
+    void free_pages(void* ptr);
+    int64_t page_size();
+
+    ///bypasses the page cache where the filesystem allows it. data must be page aligned and bytes a multiple of page_size()
+    bool write_file_direct(const std::string& fname, const void* data, int64_t bytes);
+}
+
+#endif // OCL_FILE_HPP_INCLUDED
@@ -0,0 +1,307 @@
+#include "ocl_half.hpp"
+#include "ocl_reclaim.hpp"
+#include <cstring>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CL_HALF_F16C
+#include <immintrin.h>
+#endif
+
+uint16_t cl::float_to_half_bits(float val)
+{
+    uint32_t x = 0;
+    memcpy(&x, &val, sizeof(float));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mag = x & 0x7fffffff;
+
+    ///inf stays inf, nan stays a quiet nan
+    if(mag >= 0x7f800000)
+        return sign | 0x7c00 | (mag > 0x7f800000 ? 0x200 | ((mag >> 13) & 0x3ff) : 0);
+
+    ///65520 and up round past the largest half
+    if(mag >= 0x477ff000)
+        return sign | 0x7c00;
+
+    ///below the smallest normal half, 2^-14
+    if(mag < 0x38800000)
+    {
+        ///half of the smallest subnormal or less rounds to zero
+        if(mag <= 0x33000000)
+            return sign;
+
+        uint32_t exponent = mag >> 23;
+        uint32_t mantissa = (mag & 0x7fffff) | 0x800000;
+
+        ///in units of the smallest subnormal, 2^-24
+        int shift = 126 - exponent;
+
+        uint32_t h = mantissa >> shift;
+        uint32_t rem = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+
+        if(rem > halfway || (rem == halfway && (h & 1)))
+            h++;
+
+        return sign | h;
+    }
+
+    ///rebias the exponent from 127 to 15, a carry out of the mantissa correctly bumps the exponent
+    uint32_t h = (mag >> 13) - (112 << 10);
+    uint32_t rem = mag & 0x1fff;
+
+    if(rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++;
+
+    return sign | h;
+}
+
+float cl::half_bits_to_float(uint16_t bits)
+{
+    uint32_t sign = (uint32_t)(bits & 0x8000) << 16;
+    uint32_t exponent = (bits >> 10) & 0x1f;
+    uint32_t mantissa = bits & 0x3ff;
+
+    uint32_t out = 0;
+
+    if(exponent == 0)
+    {
+        if(mantissa == 0)
+        {
+            out = sign;
+        }
+        else
+        {
+            ///subnormal, renormalise
+            exponent = 127 - 15 + 1;
+
+            while((mantissa & 0x400) == 0)
+            {
+                mantissa <<= 1;
+                exponent--;
+            }
+
+            mantissa &= 0x3ff;
+
+            out = sign | (exponent << 23) | (mantissa << 13);
+        }
+    }
+    else if(exponent == 0x1f)
+    {
+        ///nans come out quiet, same as f16c
+        out = sign | 0x7f800000 | (mantissa << 13) | (mantissa != 0 ? 0x400000 : 0);
+    }
+    else
+    {
+        out = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float ret;
+    memcpy(&ret, &out, sizeof(float));
+
+    return ret;
+}
+
+bool cl::host_has_f16c()
+{
+    #ifdef CL_HALF_F16C
+    static bool has = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+
+    return has;
+    #else
+    return false;
+    #endif // CL_HALF_F16C
+}
+
+#ifdef CL_HALF_F16C
+__attribute__((target("avx,f16c")))
+static int64_t floats_to_halves_f16c(const float* in, cl_half* out, int64_t num)
+{
+    int64_t i = 0;
+
+    for(; i + 8 <= num; i += 8)
+    {
+        __m256 v = _mm256_loadu_ps(in + i);
+        __m128i h = _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+
+        _mm_storeu_si128((__m128i*)(out + i), h);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx,f16c")))
+static int64_t halves_to_floats_f16c(const cl_half* in, float* out, int64_t num)
+{
+    int64_t i = 0;
+
+    for(; i + 8 <= num; i += 8)
+    {
+        __m128i h = _mm_loadu_si128((const __m128i*)(in + i));
+        __m256 v = _mm256_cvtph_ps(h);
+
+        _mm256_storeu_ps(out + i, v);
+    }
+
+    return i;
+}
+#endif // CL_HALF_F16C
+
+void cl::floats_to_halves(const float* in, cl_half* out, int64_t num)
+{
+    int64_t done = 0;
+
+    #ifdef CL_HALF_F16C
+    if(host_has_f16c())
+        done = floats_to_halves_f16c(in, out, num);
+    #endif // CL_HALF_F16C
+
+    for(int64_t i=done; i < num; i++)
+        out[i] = float_to_half_bits(in[i]);
+}
+
+void cl::halves_to_floats(const cl_half* in, float* out, int64_t num)
+{
+    int64_t done = 0;
+
+    #ifdef CL_HALF_F16C
+    if(host_has_f16c())
+        done = halves_to_floats_f16c(in, out, num);
+    #endif // CL_HALF_F16C
+
+    for(int64_t i=done; i < num; i++)
+        out[i] = half_bits_to_float(in[i]);
+}
+
+bool cl::supports_fp16(context& ctx)
+{
+    for(cl_uint i=0; i < ctx.num_devices; i++)
+    {
+        if(!supports_extension(ctx.devices[i], "cl_khr_fp16"))
+            return false;
+    }
+
+    return true;
+}
+
+const std::string& cl::half_kernel_helpers()
+{
+    static const std::string helpers =
+        "#ifdef cl_khr_fp16\n"
+        "#define HALF_NATIVE 1\n"
+        "#endif\n"
+        "#define HALF_LOAD(p, i) vload_half((i), (p))\n"
+        "#define HALF_STORE(p, i, v) vstore_half_rte((v), (i), (p))\n"
+        "#define HALF_LOAD4(p, i) vload_half4((i), (p))\n"
+        "#define HALF_STORE4(p, i, v) vstore_half4_rte((v), (i), (p))\n"
+        ///keeps build log line numbers matching the caller's source
+        "#line 1\n";
+
+    return helpers;
+}
+
+void cl::half_buffer::alloc(command_queue& cqueue, const std::vector<float>& data)
+{
+    format = BUFFER;
+
+    count = data.size();
+
+    if(count == 0)
+        return;
+
+    alloc_bytes(count * sizeof(cl_half));
+    write(cqueue, data);
+}
+
+void cl::half_buffer::alloc_num(command_queue& cqueue, int64_t num)
+{
+    format = BUFFER;
+
+    count = num;
+
+    if(count == 0)
+        return;
+
+    alloc_bytes(count * sizeof(cl_half));
+    clear_to_zero(cqueue);
+}
+
+void cl::half_buffer::write(command_queue& cqueue, const std::vector<float>& data, int64_t first)
+{
+    if(data.size() == 0)
+        return;
+
+    write(cqueue, &data[0], data.size(), first);
+}
+
+void cl::half_buffer::write(command_queue& cqueue, const float* data, int64_t num, int64_t first)
+{
+    if(num <= 0)
+        return;
+
+    if(first < 0 || first + num > count)
+    {
+        lg::error("Half buffer write of ", num, " at ", first, " out of range of ", count);
+        return;
+    }
+
+    invalidate_reads();
+
+    std::vector<cl_half>* host = new std::vector<cl_half>(num);
+
+    floats_to_halves(data, host->data(), num);
+
+    cl_int err = dispatch_write(cqueue, *this, first * sizeof(cl_half), num * sizeof(cl_half), host->data(), false, 0, nullptr, nullptr);
+
+    get_reclaim(ctx).retire_host([host](){delete host;}, enqueue_fence(cqueue));
+
+    if(err != CL_SUCCESS)
+    {
+        static lg::rate_limiter limit;
+
+        lg::error_limited(limit, "Error in half buffer write ", err);
+    }
+}
+
+std::vector<float> cl::half_buffer::read(command_queue& cqueue)
+{
+    std::vector<float> ret;
+    ret.resize(count);
+
+    if(count == 0)
+        return ret;
+
+    if(!read_into(cqueue, &ret[0], count))
+        ret.clear();
+
+    return ret;
+}
+
+bool cl::half_buffer::read_into(command_queue& cqueue, float* out, int64_t num, int64_t first)
+{
+    if(num <= 0)
+        return true;
+
+    if(first < 0 || first + num > count)
+    {
+        lg::error("Half buffer read of ", num, " at ", first, " out of range of ", count);
+        return false;
+    }
+
+    std::vector<cl_half> host;
+    host.resize(num);
+
+    cl_int err = dispatch_read(cqueue, *this, first * sizeof(cl_half), num * sizeof(cl_half), host.data(), true, 0, nullptr, nullptr);
+
+    if(err != CL_SUCCESS)
+    {
+        static lg::rate_limiter limit;
+
+        lg::error_limited(limit, "Error in half buffer read ", err);
+        return false;
+    }
+
+    halves_to_floats(host.data(), out, num);
+
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef OCL_HALF_HPP_INCLUDED
+#define OCL_HALF_HPP_INCLUDED
+
+#include "ocl.hpp"
+
+///fp16 storage for float data that doesn't need the precision, half the device memory and half the transfer
+///conversion happens on the host, with f16c when the cpu has it and a scalar fallback otherwise, both round to nearest even
+///kernels read and write the storage with vload_half/vstore_half, which every device has, cl_khr_fp16 is only needed for half arithmetic
+///
+///every program is built with these prepended
+///    HALF_LOAD(p, i), HALF_STORE(p, i, v) for one float, HALF_LOAD4(p, i), HALF_STORE4(p, i, v) for a float4 at element 4 * i
+///    HALF_NATIVE, defined when the device has cl_khr_fp16. #pragma OPENCL EXTENSION cl_khr_fp16 : enable is still up to the kernel
+
+namespace cl
+{
+    uint16_t float_to_half_bits(float val);
+    float half_bits_to_float(uint16_t bits);
+
+    ///the cpu can do f16c, checked once
+    bool host_has_f16c();
+
+    void floats_to_halves(const float* in, cl_half* out, int64_t num);
+    void halves_to_floats(const cl_half* in, float* out, int64_t num);
+
+    ///every device in the context has cl_khr_fp16
+    bool supports_fp16(context& ctx);
+
+    ///the source that goes in front of every program, see above
+    const std::string& half_kernel_helpers();
+
+    struct half_buffer : buffer
+    {
+        int64_t count = 0;
+
+        half_buffer(context& ctx) : buffer(ctx) {}
+
+        void alloc(command_queue& cqueue, const std::vector<float>& data);
+        void alloc_num(command_queue& cqueue, int64_t num);
+
+        int64_t num() const
+        {
+            return count;
+        }
+
+        ///non blocking, data is converted into a copy that the context's reclaim frees after the upload finishes, see ocl_reclaim.hpp
+        void write(command_queue& cqueue, const std::vector<float>& data, int64_t first = 0);
+        void write(command_queue& cqueue, const float* data, int64_t num, int64_t first = 0);
+
+        ///blocking
+        std::vector<float> read(command_queue& cqueue);
+        bool read_into(command_queue& cqueue, float* out, int64_t num, int64_t first = 0);
+    };
+}
+
+#endif // OCL_HALF_HPP_INCLUDED
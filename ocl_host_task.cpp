@@ -0,0 +1,193 @@
+#include "ocl_host_task.hpp"
+#include <atomic>
+#include <exception>
+#include <new>
+
+cl::thread_pool::thread_pool(int threads)
+{
+    if(threads <= 0)
+        threads = std::max((int)std::thread::hardware_concurrency(), 1);
+
+    for(int i=0; i < threads; i++)
+    {
+        workers.emplace_back([this]()
+        {
+            while(1)
+            {
+                std::function<void()> next;
+
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+
+                    wake.wait(guard, [this]{return stopping || work.size() > 0;});
+
+                    if(work.size() == 0)
+                        return;
+
+                    next = std::move(work.front());
+                    work.pop_front();
+                }
+
+                next();
+            }
+        });
+    }
+}
+
+cl::thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    wake.notify_all();
+
+    ///anything already queued still runs
+    for(std::thread& t : workers)
+        t.join();
+}
+
+void cl::thread_pool::add(std::function<void()> func)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        work.push_back(std::move(func));
+    }
+
+    wake.notify_one();
+}
+
+cl::thread_pool& cl::default_pool()
+{
+    static thread_pool pool;
+
+    return pool;
+}
+
+namespace
+{
+    struct host_task_state
+    {
+        std::function<void()> func;
+        cl::thread_pool* pool = nullptr;
+        cl_event done = nullptr;
+
+        ///deps still to go, plus one held while the callbacks are being set up
+        std::atomic<int> remaining{1};
+        ///first failure from a dep, CL_COMPLETE if none
+        std::atomic<cl_int> status{CL_COMPLETE};
+    };
+
+    void finish(host_task_state* state)
+    {
+        cl_int status = state->status;
+
+        if(status != CL_COMPLETE)
+        {
+            clSetUserEventStatus(state->done, status);
+            clReleaseEvent(state->done);
+
+            delete state;
+            return;
+        }
+
+        state->pool->add([state]()
+        {
+            cl_int result = CL_COMPLETE;
+
+            ///an exception escaping a pool thread would terminate, and leave anything waiting on done hanging forever
+            try
+            {
+                state->func();
+            }
+            catch(const std::bad_alloc& e)
+            {
+                lg::error("Host task threw ", e.what());
+
+                result = CL_OUT_OF_HOST_MEMORY;
+            }
+            catch(const std::exception& e)
+            {
+                lg::error("Host task threw ", e.what());
+
+                result = CL_INVALID_OPERATION;
+            }
+            catch(...)
+            {
+                lg::error("Host task threw an unknown exception");
+
+                result = CL_INVALID_OPERATION;
+            }
+
+            clSetUserEventStatus(state->done, result);
+            clReleaseEvent(state->done);
+
+            delete state;
+        });
+    }
+
+    void CL_CALLBACK dep_done(cl_event evt, cl_int status, void* user)
+    {
+        host_task_state* state = (host_task_state*)user;
+
+        ///negative is an error
+        if(status < 0)
+        {
+            cl_int expected = CL_COMPLETE;
+            state->status.compare_exchange_strong(expected, status);
+        }
+
+        if(--state->remaining == 0)
+            finish(state);
+    }
+}
+
+cl::event cl::host_task(context& ctx, const std::vector<cl::event*>& deps, std::function<void()> func, thread_pool& pool)
+{
+    cl::event ret;
+
+    cl_int err = CL_SUCCESS;
+
+    cl_event done = clCreateUserEvent(ctx, &err);
+
+    if(err != CL_SUCCESS)
+    {
+        lg::error("Error creating user event for host task ", err);
+        return ret;
+    }
+
+    host_task_state* state = new host_task_state;
+    state->func = std::move(func);
+    state->pool = &pool;
+    state->done = done;
+
+    ///one reference for the caller, one released when the task finishes
+    clRetainEvent(done);
+
+    for(cl::event* e : deps)
+    {
+        if(e == nullptr || e->bad())
+            continue;
+
+        state->remaining++;
+
+        err = clSetEventCallback(e->cevent, CL_COMPLETE, dep_done, state);
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Error setting host task callback ", err);
+
+            state->status = err;
+            state->remaining--;
+        }
+    }
+
+    if(--state->remaining == 0)
+        finish(state);
+
+    ret.cevent = done;
+    ret.invalid = false;
+
+    return ret;
+}
@@ -0,0 +1,44 @@
+#ifndef OCL_HOST_TASK_HPP_INCLUDED
+#define OCL_HOST_TASK_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+
+///host work as a node in the event graph
+///host_task runs a callable on a thread pool once its input events complete, and hands back a user event
+///that device commands can wait on like any other. Nothing blocks the submitting thread
+
+namespace cl
+{
+    struct thread_pool
+    {
+        ///0 is one thread per hardware thread
+        thread_pool(int threads = 0);
+        ~thread_pool();
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        void add(std::function<void()> func);
+
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> work;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stopping = false;
+    };
+
+    ///shared by every host_task that doesn't ask for a particular pool
+    thread_pool& default_pool();
+
+    ///func runs once every event in deps has completed, then the returned event completes
+    ///if any dep fails func is skipped and the returned event fails with the same error
+    ///if func throws, the returned event fails with CL_OUT_OF_HOST_MEMORY for bad_alloc, otherwise CL_INVALID_OPERATION
+    cl::event host_task(context& ctx, const std::vector<cl::event*>& deps, std::function<void()> func, thread_pool& pool = default_pool());
+}
+
+#endif // OCL_HOST_TASK_HPP_INCLUDED
@@ -0,0 +1,321 @@
+#include "ocl_layout.hpp"
+#include "ocl_reclaim.hpp"
+#include <cstring>
+
+///soa pads the element count to this, so every field's array starts 64 byte aligned or better
+static constexpr int64_t soa_pad = 64;
+
+void cl::layout_desc::add_field(const std::string& name, const std::string& cl_type, int host_offset, int size)
+{
+    layout_field f;
+    f.name = name;
+    f.cl_type = cl_type;
+    f.host_offset = host_offset;
+    f.size = size;
+    f.prefix = row_bytes;
+
+    fields.push_back(f);
+
+    row_bytes += size;
+}
+
+int64_t cl::layout_desc::block_elements(int64_t count) const
+{
+    if(lanes > 0)
+        return lanes;
+
+    return std::max((count + soa_pad - 1) / soa_pad, (int64_t)1) * soa_pad;
+}
+
+int64_t cl::layout_desc::device_bytes(int64_t count) const
+{
+    int64_t block = block_elements(count);
+    int64_t blocks = (count + block - 1) / block;
+
+    return blocks * block * row_bytes;
+}
+
+std::vector<std::string> cl::split_layout_names(const std::string& names)
+{
+    std::vector<std::string> ret;
+
+    std::string current;
+
+    for(char c : names)
+    {
+        if(c == ',')
+        {
+            ret.push_back(current);
+            current.clear();
+        }
+        else if(c != ' ' && c != '\t' && c != '\n')
+        {
+            current += c;
+        }
+    }
+
+    if(current.size() > 0)
+        ret.push_back(current);
+
+    return ret;
+}
+
+std::string cl::layout_desc::accessors(const std::string& prefix) const
+{
+    std::string out;
+
+    if(lanes > 0)
+        out += "#define " + prefix + "_lanes " + std::to_string(lanes) + "\n";
+
+    for(const layout_field& f : fields)
+    {
+        std::string ptr = "(__global " + f.cl_type + "*)";
+
+        if(lanes > 0)
+        {
+            std::string block = std::to_string((int64_t)lanes * row_bytes);
+            std::string offset = std::to_string((int64_t)lanes * f.prefix);
+
+            out += "#define " + prefix + "_" + f.name + "(p, i) ((" + ptr + "((__global uchar*)(p) + ((i) / " + std::to_string(lanes) + ") * " + block + " + " + offset + "))[(i) % " + std::to_string(lanes) + "])\n";
+        }
+        else
+        {
+            out += "#define " + prefix + "_" + f.name + "(p, i) ((" + ptr + "((__global uchar*)(p) + (" + prefix + "_stride) * " + std::to_string(f.prefix) + "))[(i)])\n";
+        }
+    }
+
+    return out;
+}
+
+static std::string layout_kernel_body(const cl::layout_desc& desc)
+{
+    std::string body = "(__global uchar* aos, __global uchar* lay, long n, long lanes, int to_layout)\n{\n";
+
+    body += "    long i = get_global_id(0);\n\n";
+    body += "    if(i >= n)\n        return;\n\n";
+    body += "    __global uchar* a = aos + i * " + std::to_string(desc.host_stride) + ";\n";
+    body += "    __global uchar* l = lay + (i / lanes) * lanes * " + std::to_string(desc.row_bytes) + ";\n";
+    body += "    long lane = i % lanes;\n";
+
+    for(const cl::layout_field& f : desc.fields)
+    {
+        std::string ptr = "(__global " + f.cl_type + "*)";
+
+        body += "\n    {\n";
+        body += "        __global " + f.cl_type + "* af = " + ptr + "(a + " + std::to_string(f.host_offset) + ");\n";
+        body += "        __global " + f.cl_type + "* lf = " + ptr + "(l + lanes * " + std::to_string(f.prefix) + ") + lane;\n\n";
+        body += "        if(to_layout)\n            *lf = *af;\n        else\n            *af = *lf;\n";
+        body += "    }\n";
+    }
+
+    body += "}\n";
+
+    return body;
+}
+
+std::string cl::layout_desc::kernel_name() const
+{
+    char buf[64] = {0};
+
+    snprintf(buf, sizeof(buf), "cl_layout_%zx", std::hash<std::string>()(layout_kernel_body(*this)));
+
+    return buf;
+}
+
+std::string cl::layout_desc::kernel_source() const
+{
+    std::string body = layout_kernel_body(*this);
+
+    std::string src;
+
+    if(body.find("double") != std::string::npos)
+        src += "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n\n";
+
+    src += "__kernel\nvoid " + kernel_name() + body;
+
+    return src;
+}
+
+///one field at a time, so each inner loop is a fixed size copy the compiler can turn into plain loads and stores
+template<int size>
+static void transpose_field(const char* src, int64_t src_stride, char* dst, int64_t dst_stride, int64_t count)
+{
+    for(int64_t i=0; i < count; i++)
+        memcpy(dst + i * dst_stride, src + i * src_stride, size);
+}
+
+static void transpose_field_any(const char* src, int64_t src_stride, char* dst, int64_t dst_stride, int64_t count, int size)
+{
+    if(size == 1)
+        transpose_field<1>(src, src_stride, dst, dst_stride, count);
+    else if(size == 2)
+        transpose_field<2>(src, src_stride, dst, dst_stride, count);
+    else if(size == 4)
+        transpose_field<4>(src, src_stride, dst, dst_stride, count);
+    else if(size == 8)
+        transpose_field<8>(src, src_stride, dst, dst_stride, count);
+    else
+    {
+        for(int64_t i=0; i < count; i++)
+            memcpy(dst + i * dst_stride, src + i * src_stride, size);
+    }
+}
+
+void cl::layout_desc::transpose_to(const void* aos, void* out, int64_t count) const
+{
+    int64_t block = block_elements(count);
+
+    for(int64_t first=0; first < count; first += block)
+    {
+        int64_t num = std::min(block, count - first);
+
+        const char* src = (const char*)aos + first * host_stride;
+        char* dst = (char*)out + first * row_bytes;
+
+        for(const layout_field& f : fields)
+            transpose_field_any(src + f.host_offset, host_stride, dst + block * f.prefix, f.size, num, f.size);
+    }
+}
+
+void cl::layout_desc::transpose_from(const void* in, void* aos, int64_t count) const
+{
+    int64_t block = block_elements(count);
+
+    for(int64_t first=0; first < count; first += block)
+    {
+        int64_t num = std::min(block, count - first);
+
+        const char* src = (const char*)in + first * row_bytes;
+        char* dst = (char*)aos + first * host_stride;
+
+        for(const layout_field& f : fields)
+            transpose_field_any(src + block * f.prefix, f.size, dst + f.host_offset, host_stride, num, f.size);
+    }
+}
+
+static cl_int run_layout_kernel(cl::command_queue& cqueue, const cl::layout_desc& desc, cl::buffer& aos, cl::buffer& lay, int64_t count, bool to_layout)
+{
+    std::string kname = desc.kernel_name();
+
+    if(!cl::ensure_program(cqueue.ctx, kname, desc.kernel_source()))
+        return CL_INVALID_PROGRAM;
+
+    cl_long n = count;
+    cl_long lanes = desc.block_elements(count);
+    cl_int dir = to_layout;
+
+    cl::args pack;
+    pack.push_back(aos);
+    pack.push_back(lay);
+    pack.push_back(n);
+    pack.push_back(lanes);
+    pack.push_back(dir);
+
+    ///the kernel indexes with longs, so the dispatch has to be able to reach past 2^31 elements too
+    size_t global_ws[1] = {(size_t)count};
+    size_t local_ws[1] = {128};
+
+    cl::event done;
+
+    cqueue.exec(kname, pack, global_ws, local_ws, &done);
+
+    if(done.bad())
+        return CL_INVALID_KERNEL;
+
+    clReleaseEvent(done.cevent);
+
+    return CL_SUCCESS;
+}
+
+cl_int cl::layout_write(command_queue& cqueue, buffer& buf, const layout_desc& desc, const void* aos, int64_t count, bool on_device)
+{
+    if(count == 0)
+        return CL_SUCCESS;
+
+    context& ctx = cqueue.ctx;
+
+    int64_t aos_bytes = count * desc.host_stride;
+
+    if(!on_device)
+    {
+        ///padding is zeroed too, so nothing uninitialised goes to the device
+        std::vector<char>* host = new std::vector<char>(desc.device_bytes(count));
+
+        desc.transpose_to(aos, host->data(), count);
+
+        cl_int err = dispatch_write(cqueue, buf, 0, host->size(), host->data(), false, 0, nullptr, nullptr);
+
+        get_reclaim(ctx).retire_host([host](){delete host;}, enqueue_fence(cqueue));
+
+        if(err != CL_SUCCESS)
+            lg::error("Error writing layout buffer ", err);
+
+        return err;
+    }
+
+    buffer staging(ctx);
+    staging.tag = "layout";
+    staging.policy.device = mem_policy::READ_ONLY;
+    staging.policy.host = mem_policy::HOST_WRITE_ONLY;
+    staging.alloc_bytes(aos_bytes);
+
+    if(staging.cmem == nullptr)
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+
+    std::vector<char>* host = new std::vector<char>((const char*)aos, (const char*)aos + aos_bytes);
+
+    cl_int err = dispatch_write(cqueue, staging, 0, aos_bytes, host->data(), false, 0, nullptr, nullptr);
+
+    get_reclaim(ctx).retire_host([host](){delete host;}, enqueue_fence(cqueue));
+
+    if(err == CL_SUCCESS)
+        err = run_layout_kernel(cqueue, desc, staging, buf, count, true);
+
+    if(err != CL_SUCCESS)
+        lg::error("Error writing layout buffer ", err);
+
+    staging.retire(cqueue);
+
+    return err;
+}
+
+cl_int cl::layout_read(command_queue& cqueue, buffer& buf, const layout_desc& desc, void* aos, int64_t count, bool on_device)
+{
+    if(count == 0)
+        return CL_SUCCESS;
+
+    context& ctx = cqueue.ctx;
+
+    int64_t aos_bytes = count * desc.host_stride;
+
+    if(!on_device)
+    {
+        std::vector<char> host;
+        host.resize(desc.device_bytes(count));
+
+        cl_int err = dispatch_read(cqueue, buf, 0, host.size(), host.data(), true, 0, nullptr, nullptr);
+
+        if(err == CL_SUCCESS)
+            desc.transpose_from(host.data(), aos, count);
+
+        return err;
+    }
+
+    buffer staging(ctx);
+    staging.tag = "layout";
+    staging.policy.device = mem_policy::WRITE_ONLY;
+    staging.policy.host = mem_policy::HOST_READ_ONLY;
+    staging.alloc_bytes(aos_bytes);
+
+    if(staging.cmem == nullptr)
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+
+    cl_int err = run_layout_kernel(cqueue, desc, staging, buf, count, false);
+
+    if(err == CL_SUCCESS)
+        err = dispatch_read(cqueue, staging, 0, aos_bytes, aos, true, 0, nullptr, nullptr);
+
+    staging.retire(cqueue);
+
+    return err;
+}
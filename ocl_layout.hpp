@@ -0,0 +1,233 @@
+#ifndef OCL_LAYOUT_HPP_INCLUDED
+#define OCL_LAYOUT_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include "ocl_expr.hpp"
+#include <tuple>
+
+///arrays of structs on the host, struct of arrays (or arrays of structs of arrays) on the device
+///so a kernel reading one field of neighbouring elements gets coalesced loads rather than strided ones
+///the element type is described by CL_LAYOUT, or is a std::tuple, and every field has to be a scalar with a cl_type_name
+///uploads and readbacks transpose either with a kernel generated per element type, or on the host
+///
+///on the device element i of field f lives at
+///    (i / lanes) * lanes * row_bytes + lanes * (bytes of the fields before f) + (i % lanes) * sizeof(f)
+///where aosoa has a fixed lanes, and plain soa has one block of lanes = stride(), the padded element count
+
+namespace cl
+{
+    ///specialised by CL_LAYOUT, or for tuples below
+    ///tie returns a tuple of references to every field, names is the comma separated field names
+    template<typename T>
+    struct layout_traits;
+
+    template<typename... Ts>
+    struct layout_traits<std::tuple<Ts...>>
+    {
+        static auto tie(std::tuple<Ts...>& v)
+        {
+            return std::apply([](auto&... f){return std::tie(f...);}, v);
+        }
+
+        ///accessors are named f0, f1..
+        static const char* names() {return "";}
+    };
+
+    ///the host array is moved around as bytes, which std::tuple of scalars is fine with even though it isn't trivially copyable
+    template<typename T>
+    struct layout_copyable : std::is_trivially_copyable<T> {};
+
+    template<typename... Ts>
+    struct layout_copyable<std::tuple<Ts...>> : std::conjunction<std::is_trivially_copyable<Ts>...> {};
+
+    struct layout_field
+    {
+        std::string name;
+        std::string cl_type;
+        int host_offset = 0;
+        int size = 0;
+        ///bytes of the fields before this one
+        int prefix = 0;
+    };
+
+    struct layout_desc
+    {
+        std::vector<layout_field> fields;
+        int host_stride = 0;
+        int row_bytes = 0;
+        ///0 for soa
+        int lanes = 0;
+
+        void add_field(const std::string& name, const std::string& cl_type, int host_offset, int size);
+
+        ///elements per block, the padded count for soa
+        int64_t block_elements(int64_t count) const;
+        int64_t device_bytes(int64_t count) const;
+
+        ///defines a <prefix>_<field>(p, i) macro per field, p being the buffer as any __global pointer
+        ///soa accessors refer to <prefix>_stride, which wants to be a kernel arg (or a -D) holding stride()
+        std::string accessors(const std::string& prefix) const;
+
+        ///one kernel per layout, generated and built on first use
+        std::string kernel_name() const;
+        std::string kernel_source() const;
+
+        ///aos is count * host_stride bytes, out is device_bytes(count)
+        void transpose_to(const void* aos, void* out, int64_t count) const;
+        void transpose_from(const void* in, void* aos, int64_t count) const;
+    };
+
+    ///splits CL_LAYOUT's stringified field list
+    std::vector<std::string> split_layout_names(const std::string& names);
+
+    template<typename T>
+    layout_desc make_layout_desc(int lanes)
+    {
+        static_assert(layout_copyable<T>::value, "Layout element types have to be trivially copyable");
+
+        if(lanes < 0 || (lanes % 8) != 0)
+        {
+            lg::error("Layout lanes has to be a multiple of 8, got ", lanes);
+
+            lanes = ((std::max(lanes, 0) + 7) / 8) * 8;
+        }
+
+        layout_desc desc;
+        desc.host_stride = sizeof(T);
+        desc.lanes = lanes;
+
+        T dummy{};
+
+        std::vector<std::string> names = split_layout_names(layout_traits<T>::names());
+
+        std::apply([&](auto&... f)
+        {
+            int idx = 0;
+
+            auto add = [&](auto& field)
+            {
+                using field_t = std::decay_t<decltype(field)>;
+
+                std::string name = idx < (int)names.size() ? names[idx] : "f" + std::to_string(idx);
+
+                desc.add_field(name, cl_type_name<field_t>::value, (int)((char*)&field - (char*)&dummy), sizeof(field_t));
+
+                idx++;
+            };
+
+            (add(f), ...);
+        }, layout_traits<T>::tie(dummy));
+
+        return desc;
+    }
+
+    ///non blocking, aos is copied. on_device uploads aos as is and transposes with the layout kernel
+    cl_int layout_write(command_queue& cqueue, buffer& buf, const layout_desc& desc, const void* aos, int64_t count, bool on_device);
+    ///blocking
+    cl_int layout_read(command_queue& cqueue, buffer& buf, const layout_desc& desc, void* aos, int64_t count, bool on_device);
+
+    template<typename T>
+    struct layout_buffer : buffer
+    {
+        layout_desc desc;
+        int64_t count = 0;
+
+        ///transpose with the generated kernel, otherwise on the host before upload and after readback
+        ///the kernel costs a staging buffer the size of the host data, the host costs a host copy that size
+        bool transpose_on_device = true;
+
+        ///lanes 0 is struct of arrays, otherwise blocks of lanes elements. Has to be a multiple of 8 so every field stays aligned
+        layout_buffer(context& ctx, int lanes = 0) : buffer(ctx), desc(make_layout_desc<T>(lanes)) {}
+
+        void alloc(command_queue& cqueue, const std::vector<T>& data)
+        {
+            format = BUFFER;
+
+            count = data.size();
+
+            if(count == 0)
+                return;
+
+            alloc_bytes(desc.device_bytes(count));
+            write(cqueue, data);
+        }
+
+        void alloc_num(command_queue& cqueue, int64_t num)
+        {
+            format = BUFFER;
+
+            count = num;
+
+            if(count == 0)
+                return;
+
+            alloc_bytes(desc.device_bytes(count));
+            clear_to_zero(cqueue);
+        }
+
+        int64_t num() const
+        {
+            return count;
+        }
+
+        ///non blocking, data is copied
+        void write(command_queue& cqueue, const std::vector<T>& data)
+        {
+            if((int64_t)data.size() != count)
+            {
+                lg::error("Layout buffer write of ", data.size(), " elements into ", count);
+                return;
+            }
+
+            invalidate_reads();
+
+            layout_write(cqueue, *this, desc, data.data(), count, transpose_on_device);
+        }
+
+        std::vector<T> read(command_queue& cqueue)
+        {
+            std::vector<T> ret;
+            ret.resize(count);
+
+            if(count == 0)
+                return ret;
+
+            cl_int err = layout_read(cqueue, *this, desc, ret.data(), count, transpose_on_device);
+
+            if(err != CL_SUCCESS)
+                lg::error("Error reading layout buffer ", err);
+
+            return ret;
+        }
+
+        ///what soa accessors expect in <prefix>_stride
+        int64_t stride() const
+        {
+            return desc.block_elements(count);
+        }
+
+        std::string accessors(const std::string& prefix) const
+        {
+            return desc.accessors(prefix);
+        }
+    };
+}
+
+///after the struct, at global scope, naming every member in declaration order
+///    struct particle {float x, y, z; int id;};
+///    CL_LAYOUT(particle, x, y, z, id)
+///the names become structured bindings, so leaving one out or getting the count wrong doesn't compile
+#define CL_LAYOUT(type, ...) \
+    template<> \
+    struct cl::layout_traits<type> \
+    { \
+        static auto tie(type& v) \
+        { \
+            auto& [__VA_ARGS__] = v; \
+            return std::tie(__VA_ARGS__); \
+        } \
+ \
+        static const char* names() {return #__VA_ARGS__;} \
+    };
+
+#endif // OCL_LAYOUT_HPP_INCLUDED
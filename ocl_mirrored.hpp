@@ -0,0 +1,281 @@
+#ifndef OCL_MIRRORED_HPP_INCLUDED
+#define OCL_MIRRORED_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include <algorithm>
+
+namespace cl
+{
+    ///a buffer with a host copy that tracks what's been changed since the last sync
+    ///writes go through write()/write_range()/mark_dirty(), and sync() only uploads the dirty bytes
+    ///adjacent or nearly adjacent ranges get coalesced into one transfer
+    template<typename T>
+    struct mirrored_buffer : buffer
+    {
+        std::vector<T> host;
+
+        ///granularity for write() tracking
+        int64_t page_bytes = 4096;
+        ///dirty ranges closer than this get uploaded as one, a few wasted bytes beat another transfer
+        int64_t merge_gap_bytes = 256;
+
+        ///bumped on every host modification, sync is free while synced_version == host_version
+        uint64_t host_version = 0;
+        uint64_t synced_version = 0;
+
+        mirrored_buffer(context& ctx) : buffer(ctx) {}
+
+        ///copies share the device memory like any other buffer, each holds its own reference to the pending upload
+        mirrored_buffer(const mirrored_buffer& other) : buffer(other), host(other.host), page_bytes(other.page_bytes), merge_gap_bytes(other.merge_gap_bytes),
+                                                        host_version(other.host_version), synced_version(other.synced_version),
+                                                        dirty_pages(other.dirty_pages), has_dirty_pages(other.has_dirty_pages), ranges(other.ranges), pending_upload(other.pending_upload)
+        {
+            if(pending_upload)
+                clRetainEvent(pending_upload);
+        }
+
+        ///a non blocking upload may still be reading host, which is freed along with us
+        ~mirrored_buffer()
+        {
+            wait_upload();
+        }
+
+        void alloc(command_queue& cqueue, const std::vector<T>& data)
+        {
+            host = data;
+
+            format = BUFFER;
+
+            if(host.size() == 0)
+                return;
+
+            alloc_bytes(host.size() * sizeof(T));
+            write_all(cqueue, host);
+
+            reset_tracking();
+        }
+
+        void alloc_num(command_queue& cqueue, int64_t num)
+        {
+            alloc(cqueue, std::vector<T>(num));
+        }
+
+        int64_t num() const
+        {
+            return host.size();
+        }
+
+        const T& operator[](int64_t idx) const
+        {
+            return host[idx];
+        }
+
+        const T& read(int64_t idx) const
+        {
+            return host[idx];
+        }
+
+        ///marks the page containing idx
+        T& write(int64_t idx)
+        {
+            wait_upload();
+
+            int64_t page = (idx * (int64_t)sizeof(T)) / page_bytes;
+
+            if(!dirty_pages[page])
+            {
+                dirty_pages[page] = 1;
+                has_dirty_pages = true;
+            }
+
+            host_version++;
+
+            return host[idx];
+        }
+
+        ///marks [first, first + count) exactly, and hands back a pointer to write into
+        T* write_range(int64_t first, int64_t count)
+        {
+            wait_upload();
+
+            mark_dirty(first, count);
+
+            return &host[first];
+        }
+
+        ///for when the host copy was modified through some other pointer
+        ///by then it's too late to wait here, so call wait_upload() before touching host directly
+        void mark_dirty(int64_t first, int64_t count)
+        {
+            if(count <= 0)
+                return;
+
+            first = std::max(first, (int64_t)0);
+            count = std::min(count, (int64_t)host.size() - first);
+
+            ///entirely past the end
+            if(count <= 0)
+                return;
+
+            ranges.push_back({first * (int64_t)sizeof(T), (first + count) * (int64_t)sizeof(T)});
+
+            host_version++;
+        }
+
+        void mark_all_dirty()
+        {
+            mark_dirty(0, host.size());
+        }
+
+        ///uploads everything dirty since the last sync, non blocking
+        ///further writes to the host copy wait for this upload to finish
+        ///returns the number of bytes uploaded
+        int64_t sync(command_queue& cqueue, cl::event* evt = nullptr)
+        {
+            if(host_version == synced_version)
+                return 0;
+
+            std::vector<std::pair<int64_t, int64_t>> to_upload = coalesce();
+
+            int64_t uploaded = 0;
+
+            cl_event last = nullptr;
+
+            ///stay dirty, so the next sync tries them again
+            std::vector<std::pair<int64_t, int64_t>> failed;
+
+            for(auto& r : to_upload)
+            {
+                cl_event next = nullptr;
+
+                cl_int err = dispatch_write(cqueue, *this, r.first, r.second - r.first, (const char*)&host[0] + r.first, false, 0, nullptr, &next);
+
+                if(err != CL_SUCCESS)
+                {
+                    lg::error("Error in mirrored_buffer sync ", err);
+
+                    failed.push_back(r);
+                    continue;
+                }
+
+                if(last)
+                    clReleaseEvent(last);
+
+                last = next;
+                uploaded += r.second - r.first;
+            }
+
+            reset_tracking();
+
+            if(failed.size() > 0)
+                ranges = failed;
+            else
+                synced_version = host_version;
+
+            ///in order queue, so the last one finishing means they all have
+            if(last)
+            {
+                if(pending_upload)
+                    clReleaseEvent(pending_upload);
+
+                pending_upload = last;
+
+                if(evt)
+                {
+                    clRetainEvent(last);
+
+                    evt->cevent = last;
+                    evt->invalid = false;
+                }
+            }
+
+            return uploaded;
+        }
+
+        ///blocks until the last sync has been consumed by the device
+        void wait_upload()
+        {
+            if(pending_upload == nullptr)
+                return;
+
+            clWaitForEvents(1, &pending_upload);
+            clReleaseEvent(pending_upload);
+
+            pending_upload = nullptr;
+        }
+
+        ///resyncs the host copy from the device, eg after a kernel wrote to it
+        void pull(command_queue& cqueue)
+        {
+            wait_upload();
+
+            if(host.size() == 0)
+                return;
+
+            cl_int err = dispatch_read(cqueue, *this, 0, host.size() * sizeof(T), &host[0], true, 0, nullptr, nullptr);
+
+            if(err != CL_SUCCESS)
+                lg::error("Error in mirrored_buffer pull ", err);
+
+            reset_tracking();
+
+            synced_version = host_version;
+        }
+
+    private:
+        std::vector<uint8_t> dirty_pages;
+        bool has_dirty_pages = false;
+
+        ///[start, end) in bytes
+        std::vector<std::pair<int64_t, int64_t>> ranges;
+
+        cl_event pending_upload = nullptr;
+
+        void reset_tracking()
+        {
+            int64_t bytes = host.size() * sizeof(T);
+
+            dirty_pages.assign((bytes + page_bytes - 1) / page_bytes, 0);
+            has_dirty_pages = false;
+
+            ranges.clear();
+        }
+
+        std::vector<std::pair<int64_t, int64_t>> coalesce()
+        {
+            int64_t bytes = host.size() * sizeof(T);
+
+            std::vector<std::pair<int64_t, int64_t>> all = ranges;
+
+            if(has_dirty_pages)
+            {
+                for(int64_t i=0; i < (int64_t)dirty_pages.size(); i++)
+                {
+                    if(!dirty_pages[i])
+                        continue;
+
+                    all.push_back({i * page_bytes, std::min((i + 1) * page_bytes, bytes)});
+                }
+            }
+
+            std::sort(all.begin(), all.end());
+
+            std::vector<std::pair<int64_t, int64_t>> ret;
+
+            for(auto& r : all)
+            {
+                if(ret.size() > 0 && r.first <= ret.back().second + merge_gap_bytes)
+                {
+                    ret.back().second = std::max(ret.back().second, r.second);
+                    continue;
+                }
+
+                ret.push_back(r);
+            }
+
+            return ret;
+        }
+    };
+}
+
+#endif // OCL_MIRRORED_HPP_INCLUDED
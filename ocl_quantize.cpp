@@ -0,0 +1,499 @@
+#include "ocl_quantize.hpp"
+#include <cstring>
+#include <cmath>
+#include <climits>
+
+static const char* quantize_src = R"(
+__constant sampler_t quantize_sam = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+void quantize_store(__global uchar* out, long idx, float v, int is_half, float lo, float scale)
+{
+    if(is_half)
+        vstore_half_rte(v, idx, (__global half*)out);
+    else
+        out[idx] = convert_uchar_sat_rte((v - lo) * scale);
+}
+
+__kernel
+void cl_quantize_buffer(__global const float* in, long n, __global uchar* out, int is_half, float lo, float scale)
+{
+    long id = get_global_id(0);
+
+    if(id >= n)
+        return;
+
+    quantize_store(out, id, in[id], is_half, lo, scale);
+}
+
+__kernel
+void cl_quantize_image(__read_only image2d_t in, int width, int height, int channels, __global uchar* out, int is_half, float lo, float scale)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if(x >= width || y >= height)
+        return;
+
+    float4 v = read_imagef(in, quantize_sam, (int2)(x, y));
+
+    long base = ((long)y * width + x) * channels;
+
+    quantize_store(out, base, v.x, is_half, lo, scale);
+
+    if(channels > 1)
+        quantize_store(out, base + 1, v.y, is_half, lo, scale);
+
+    if(channels > 2)
+    {
+        quantize_store(out, base + 2, v.z, is_half, lo, scale);
+        quantize_store(out, base + 3, v.w, is_half, lo, scale);
+    }
+}
+
+uchar quantize_delta(__global const uchar* in, long i, long start, int stride)
+{
+    if(i - stride < start)
+        return in[i];
+
+    return in[i] - in[i - stride];
+}
+
+///packbits, a control byte < 128 is followed by control + 1 literal bytes, otherwise by one byte repeated control - 125 times
+///runs are only taken from 3 up, so packing never grows a block by more than a byte per 128
+uint quantize_packbits(__global const uchar* in, long start, long end, int stride, __global uchar* out, uint at, int write)
+{
+    uint len = 0;
+    long i = start;
+
+    while(i < end)
+    {
+        uchar val = quantize_delta(in, i, start, stride);
+
+        int run = 1;
+
+        while(i + run < end && run < 130 && quantize_delta(in, i + run, start, stride) == val)
+            run++;
+
+        if(run >= 3)
+        {
+            if(write)
+            {
+                out[at + len] = 125 + run;
+                out[at + len + 1] = val;
+            }
+
+            len += 2;
+            i += run;
+            continue;
+        }
+
+        int lit = 1;
+
+        while(i + lit < end && lit < 128)
+        {
+            long j = i + lit;
+
+            ///leave the start of a run for the next control byte
+            if(j + 2 < end)
+            {
+                uchar d = quantize_delta(in, j, start, stride);
+
+                if(d == quantize_delta(in, j + 1, start, stride) && d == quantize_delta(in, j + 2, start, stride))
+                    break;
+            }
+
+            lit++;
+        }
+
+        if(write)
+        {
+            out[at + len] = lit - 1;
+
+            for(int k=0; k < lit; k++)
+                out[at + len + 1 + k] = quantize_delta(in, i + k, start, stride);
+        }
+
+        len += 1 + lit;
+        i += lit;
+    }
+
+    return len;
+}
+
+///meta is [packed total, then offset, length for every block], total has to start at 0
+__kernel
+void cl_quantize_pack(__global const uchar* in, long bytes, int block_bytes, int stride, int num_blocks, __global uchar* out, volatile __global uint* meta)
+{
+    int id = get_global_id(0);
+
+    if(id >= num_blocks)
+        return;
+
+    long start = (long)id * block_bytes;
+    long end = min(start + block_bytes, bytes);
+
+    uint len = quantize_packbits(in, start, end, stride, out, 0, 0);
+    uint at = atomic_add(&meta[0], len);
+
+    meta[1 + id * 2] = at;
+    meta[2 + id * 2] = len;
+
+    quantize_packbits(in, start, end, stride, out, at, 1);
+}
+)";
+
+static int64_t packed_capacity(int64_t bytes, int block_bytes)
+{
+    int64_t num_blocks = (bytes + block_bytes - 1) / block_bytes;
+
+    return num_blocks * (block_bytes + block_bytes / 128 + 1);
+}
+
+static int element_bytes(const cl::quantize_options& opts)
+{
+    return opts.format == cl::quantize_format::HALF ? 2 : 1;
+}
+
+cl::quantized_read cl::read_quantized(command_queue& cqueue, buffer& buf, const quantize_options& opts, std::vector<cl::event*> dependents)
+{
+    quantized_read ret;
+    ret.options = opts;
+
+    context& ctx = cqueue.ctx;
+
+    if(buf.format == buffer::IMAGE)
+    {
+        if(buf.image_dimensionality != 2)
+        {
+            lg::error("Quantized reads only take 2d images");
+            return ret;
+        }
+
+        ret.channels = image_read_channels(buf.image_order);
+
+        if(ret.channels == 0)
+        {
+            lg::error("Quantized read of an image with unsupported channel order ", buf.image_order);
+            return ret;
+        }
+
+        ret.count = (int64_t)buf.image_dims[0] * buf.image_dims[1] * ret.channels;
+    }
+    else
+    {
+        ret.count = buf.alloc_size / sizeof(float);
+    }
+
+    if(ret.count == 0)
+        return ret;
+
+    if(opts.delta_rle && opts.rle_block_bytes <= 0)
+    {
+        lg::error("rle_block_bytes must be positive, got ", opts.rle_block_bytes);
+        return ret;
+    }
+
+    if(!ensure_program(ctx, "cl_quantize_buffer", quantize_src))
+        return ret;
+
+    int elem_bytes = element_bytes(opts);
+    int64_t quantized_bytes = ret.count * elem_bytes;
+
+    buffer quantized(ctx);
+    quantized.tag = "quantize";
+    quantized.policy.host = opts.delta_rle ? mem_policy::HOST_NO_ACCESS : mem_policy::HOST_READ_ONLY;
+    quantized.alloc_bytes(quantized_bytes);
+
+    if(quantized.cmem == nullptr)
+        return ret;
+
+    int is_half = opts.format == quantize_format::HALF;
+    float lo = opts.lo;
+    float scale = opts.hi != opts.lo ? 255.f / (opts.hi - opts.lo) : 0.f;
+
+    cl::event converted;
+
+    if(buf.format == buffer::IMAGE)
+    {
+        int width = buf.image_dims[0];
+        int height = buf.image_dims[1];
+        int channels = ret.channels;
+
+        args pack;
+        pack.push_back(buf);
+        pack.push_back(width);
+        pack.push_back(height);
+        pack.push_back(channels);
+        pack.push_back(quantized);
+        pack.push_back(is_half);
+        pack.push_back(lo);
+        pack.push_back(scale);
+
+        int global_ws[2] = {width, height};
+        int local_ws[2] = {16, 16};
+
+        cqueue.exec("cl_quantize_image", pack, global_ws, local_ws, &converted, dependents);
+    }
+    else
+    {
+        cl_long n = ret.count;
+
+        args pack;
+        pack.push_back(buf);
+        pack.push_back(n);
+        pack.push_back(quantized);
+        pack.push_back(is_half);
+        pack.push_back(lo);
+        pack.push_back(scale);
+
+        int64_t global_ws[1] = {n};
+        int64_t local_ws[1] = {128};
+
+        cqueue.exec("cl_quantize_buffer", pack, global_ws, local_ws, &converted, dependents);
+    }
+
+    if(converted.bad())
+    {
+        quantized.retire(cqueue);
+        return ret;
+    }
+
+    if(!opts.delta_rle)
+    {
+        ret.payload->resize(quantized_bytes);
+
+        cl_int err = dispatch_read(cqueue, quantized, 0, quantized_bytes, ret.payload->data(), false, 1, &converted.cevent, &ret.cevent);
+
+        ret.invalid = err != CL_SUCCESS;
+
+        if(err != CL_SUCCESS)
+            lg::error("Error reading quantized buffer ", err);
+
+        clReleaseEvent(converted.cevent);
+        quantized.retire(cqueue);
+
+        return ret;
+    }
+
+    int block_bytes = opts.rle_block_bytes;
+    int64_t num_blocks_64 = (quantized_bytes + block_bytes - 1) / block_bytes;
+    ///deltas are against the same byte of the previous element, or pixel for images
+    int stride = elem_bytes * ret.channels;
+
+    ///the pack kernel's offsets are uints and its block index an int
+    if(packed_capacity(quantized_bytes, block_bytes) > (int64_t)UINT32_MAX || num_blocks_64 > INT_MAX)
+    {
+        lg::error("Quantized read of ", quantized_bytes, " bytes in ", num_blocks_64, " blocks is too big to delta_rle, read it in pieces or without delta_rle");
+
+        clReleaseEvent(converted.cevent);
+        quantized.retire(cqueue);
+
+        return ret;
+    }
+
+    int num_blocks = num_blocks_64;
+
+    buffer packed(ctx);
+    packed.tag = "quantize";
+    packed.policy.host = mem_policy::HOST_READ_ONLY;
+    packed.alloc_bytes(packed_capacity(quantized_bytes, block_bytes));
+
+    buffer meta(ctx);
+    meta.tag = "quantize";
+    meta.policy.host = mem_policy::HOST_READ_ONLY;
+    meta.alloc_bytes(sizeof(cl_uint) * (1 + 2 * (int64_t)num_blocks));
+
+    if(packed.cmem == nullptr || meta.cmem == nullptr)
+    {
+        clReleaseEvent(converted.cevent);
+        quantized.retire(cqueue);
+
+        if(packed.cmem != nullptr)
+            packed.retire(cqueue);
+
+        if(meta.cmem != nullptr)
+            meta.retire(cqueue);
+
+        return ret;
+    }
+
+    meta.clear_to_zero(cqueue);
+
+    cl::event pack_done;
+
+    {
+        cl_long bytes = quantized_bytes;
+
+        args pack;
+        pack.push_back(quantized);
+        pack.push_back(bytes);
+        pack.push_back(block_bytes);
+        pack.push_back(stride);
+        pack.push_back(num_blocks);
+        pack.push_back(packed);
+        pack.push_back(meta);
+
+        int global_ws[1] = {num_blocks};
+        int local_ws[1] = {64};
+
+        cqueue.exec("cl_quantize_pack", pack, global_ws, local_ws, &pack_done, {&converted});
+    }
+
+    clReleaseEvent(converted.cevent);
+
+    std::vector<cl_uint> table;
+    table.resize(1 + 2 * (int64_t)num_blocks);
+
+    cl_int err = CL_SUCCESS;
+
+    if(pack_done.bad())
+        err = CL_INVALID_EVENT;
+    else
+        err = dispatch_read(cqueue, meta, 0, table.size() * sizeof(cl_uint), table.data(), true, 1, &pack_done.cevent, nullptr);
+
+    if(err == CL_SUCCESS)
+    {
+        ///checked before anything is sized from it
+        if(table[0] > packed.alloc_size)
+        {
+            lg::error("Packed quantized size ", table[0], " is bigger than its buffer ", packed.alloc_size);
+            err = CL_INVALID_BUFFER_SIZE;
+        }
+        else
+        {
+            ret.blocks.assign(table.begin() + 1, table.end());
+            ret.payload->resize(table[0]);
+
+            err = dispatch_read(cqueue, packed, 0, table[0], ret.payload->data(), false, 1, &pack_done.cevent, &ret.cevent);
+        }
+    }
+
+    if(err != CL_SUCCESS)
+        lg::error("Error reading packed quantized buffer ", err);
+
+    ret.invalid = err != CL_SUCCESS;
+
+    if(!pack_done.bad())
+        clReleaseEvent(pack_done.cevent);
+
+    quantized.retire(cqueue);
+    packed.retire(cqueue);
+    meta.retire(cqueue);
+
+    return ret;
+}
+
+std::vector<uint8_t> cl::quantized_read::decode_bytes() const
+{
+    int elem_bytes = element_bytes(options);
+    int64_t bytes = count * elem_bytes;
+
+    if(!options.delta_rle)
+    {
+        if((int64_t)payload->size() != bytes)
+            return std::vector<uint8_t>();
+
+        return *payload;
+    }
+
+    std::vector<uint8_t> ret;
+    ret.resize(bytes);
+
+    const std::vector<uint8_t>& in = *payload;
+
+    int64_t block_bytes = options.rle_block_bytes;
+    int64_t num_blocks = blocks.size() / 2;
+    int64_t stride = elem_bytes * channels;
+
+    for(int64_t b=0; b < num_blocks; b++)
+    {
+        int64_t start = b * block_bytes;
+        int64_t end = std::min(start + block_bytes, bytes);
+
+        int64_t at = blocks[b * 2];
+        int64_t len = blocks[b * 2 + 1];
+
+        if(at + len > (int64_t)in.size())
+        {
+            lg::error("Quantized block ", b, " runs off the end of the payload");
+            return std::vector<uint8_t>();
+        }
+
+        int64_t i = start;
+        int64_t src = at;
+
+        while(src < at + len && i < end)
+        {
+            int control = in[src++];
+
+            if(control < 128)
+            {
+                int64_t lit = std::min((int64_t)control + 1, end - i);
+
+                if(src + lit > at + len)
+                    break;
+
+                memcpy(&ret[i], &in[src], lit);
+
+                src += lit;
+                i += lit;
+            }
+            else
+            {
+                if(src >= at + len)
+                    break;
+
+                int64_t run = std::min((int64_t)control - 125, end - i);
+
+                memset(&ret[i], in[src++], run);
+
+                i += run;
+            }
+        }
+
+        if(i != end)
+        {
+            lg::error("Quantized block ", b, " unpacked to ", i - start, " bytes, expected ", end - start);
+            return std::vector<uint8_t>();
+        }
+
+        ///undo the deltas, in order so each byte sees its finished predecessor
+        for(int64_t j=start + stride; j < end; j++)
+            ret[j] += ret[j - stride];
+    }
+
+    return ret;
+}
+
+std::vector<float> cl::quantized_read::decode() const
+{
+    std::vector<uint8_t> bytes = decode_bytes();
+
+    std::vector<float> ret;
+
+    if(bytes.size() == 0)
+        return ret;
+
+    ret.resize(count);
+
+    if(options.format == quantize_format::HALF)
+    {
+        std::vector<cl_half> halves;
+        halves.resize(count);
+
+        memcpy(halves.data(), bytes.data(), count * sizeof(cl_half));
+
+        halves_to_floats(halves.data(), ret.data(), count);
+    }
+    else
+    {
+        float step = (options.hi - options.lo) / 255.f;
+
+        for(int64_t i=0; i < count; i++)
+        {
+            ret[i] = options.lo + bytes[i] * step;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,73 @@
+#ifndef OCL_QUANTIZE_HPP_INCLUDED
+#define OCL_QUANTIZE_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include "ocl_half.hpp"
+
+///readbacks that shrink float data on the device first, then only transfer the small version
+///a bundled kernel converts a float buffer, or any image read_imagef can read, into unorm8 or half in a staging buffer
+///optionally that's delta coded and run length packed as well, and the host undoes it all in decode
+///the conversion program is built the first time it's needed
+
+namespace cl
+{
+    enum class quantize_format
+    {
+        UNORM8, ///1 byte per element, lo..hi mapped onto 0..255
+        HALF,   ///2 bytes per element, vstore_half_rte, lo/hi are ignored
+    };
+
+    struct quantize_options
+    {
+        quantize_format format = quantize_format::UNORM8;
+
+        ///range that maps onto 0..255 for unorm8, anything outside is clamped
+        float lo = 0;
+        float hi = 1;
+
+        ///each byte is stored as the difference from the same byte of the previous element (or pixel), then packbits run length coded
+        ///costs an extra kernel and a small blocking read of the packed sizes, worth it for images with flat areas
+        ///the packed offsets are 32 bit, so this is limited to just under 4GB of quantized data
+        bool delta_rle = false;
+        ///bytes per independently packed block, the host gets a table with one entry per block
+        int rle_block_bytes = 1024;
+    };
+
+    ///doesn't own a copy of anything on the device, the staging buffers are retired once the readback is enqueued
+    struct quantized_read : event
+    {
+        quantize_options options;
+
+        ///floats in the source, for images width * height * channels
+        int64_t count = 0;
+        int channels = 1;
+
+        ///what came over from the device, quantized and maybe packed
+        std::shared_ptr<std::vector<uint8_t>> payload = std::make_shared<std::vector<uint8_t>>();
+        ///packed offset and length of each block, empty without delta_rle
+        std::vector<uint32_t> blocks;
+
+        ///count * sizeof(float), vs payload->size()
+        int64_t raw_bytes() const {return count * (int64_t)sizeof(float);}
+        int64_t transferred_bytes() const {return payload->size();}
+
+        ///unpacked, but still quantized. One byte per element for unorm8, two (the half's bits) for half
+        ///wait on the event before calling either of these
+        std::vector<uint8_t> decode_bytes() const;
+        std::vector<float> decode() const;
+
+        void del()
+        {
+            if(cevent)
+                clReleaseEvent(cevent);
+
+            cevent = nullptr;
+        }
+    };
+
+    ///whole buffer of floats, or a whole 2d image with 1, 2 or 4 channels. Images come back in rgba order whatever the channel order
+    ///without delta_rle this doesn't block. With it, it waits for the packed size before enqueueing the payload read
+    quantized_read read_quantized(command_queue& cqueue, buffer& buf, const quantize_options& opts = quantize_options(), std::vector<cl::event*> dependents = std::vector<cl::event*>());
+}
+
+#endif // OCL_QUANTIZE_HPP_INCLUDED
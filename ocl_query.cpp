@@ -0,0 +1,251 @@
+#include "ocl_query.hpp"
+#include "ocl_reclaim.hpp"
+
+static const char* query_src = R"(
+__constant sampler_t query_sam = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+__kernel
+void cl_query_gather(__global const uchar* in, __global const long* indices, int n, int elem_bytes, __global uchar* out)
+{
+    int id = get_global_id(0);
+
+    if(id >= n)
+        return;
+
+    long src = indices[id] * elem_bytes;
+    long dst = (long)id * elem_bytes;
+
+    ///both ends are 4 byte aligned when the element is
+    if((elem_bytes & 3) == 0)
+    {
+        __global const uint* s = (__global const uint*)(in + src);
+        __global uint* d = (__global uint*)(out + dst);
+
+        for(int i=0; i < elem_bytes / 4; i++)
+            d[i] = s[i];
+    }
+    else
+    {
+        for(int i=0; i < elem_bytes; i++)
+            out[dst + i] = in[src + i];
+    }
+}
+
+#define QUERY_PIXELS(name, type, read) \
+__kernel \
+void name(__read_only image2d_t in, __global const int2* coords, int n, int channels, __global type* out) \
+{ \
+    int id = get_global_id(0); \
+ \
+    if(id >= n) \
+        return; \
+ \
+    type##4 v = read(in, query_sam, coords[id]); \
+ \
+    int base = id * channels; \
+ \
+    out[base] = v.x; \
+ \
+    if(channels > 1) \
+        out[base + 1] = v.y; \
+ \
+    if(channels > 2) \
+    { \
+        out[base + 2] = v.z; \
+        out[base + 3] = v.w; \
+    } \
+}
+
+QUERY_PIXELS(cl_query_pixels_f, float, read_imagef)
+QUERY_PIXELS(cl_query_pixels_i, int, read_imagei)
+QUERY_PIXELS(cl_query_pixels_ui, uint, read_imageui)
+)";
+
+static std::string pixel_kernel(cl_channel_type type)
+{
+    if(type == CL_SIGNED_INT8 || type == CL_SIGNED_INT16 || type == CL_SIGNED_INT32)
+        return "cl_query_pixels_i";
+
+    if(type == CL_UNSIGNED_INT8 || type == CL_UNSIGNED_INT16 || type == CL_UNSIGNED_INT32)
+        return "cl_query_pixels_ui";
+
+    return "cl_query_pixels_f";
+}
+
+///both kernels take (in, points, n, extra, out). Runs one over points and reads its output into dst
+///points is moved to the heap, and it and both staging buffers are freed together once the readback has completed
+template<typename P>
+static cl_int gather(cl::command_queue& cqueue, const std::string& kname, cl::buffer& in, std::vector<P>&& points, int extra, int64_t out_bytes, void* dst, const std::vector<cl::event*>& dependents, cl_event* out)
+{
+    cl::context& ctx = cqueue.ctx;
+
+    int n = points.size();
+    int64_t point_bytes = points.size() * sizeof(P);
+
+    cl::buffer point_buf(ctx);
+    point_buf.tag = "query";
+    point_buf.policy.device = cl::mem_policy::READ_ONLY;
+    point_buf.policy.host = cl::mem_policy::HOST_WRITE_ONLY;
+    point_buf.alloc_bytes(point_bytes);
+
+    cl::buffer results(ctx);
+    results.tag = "query";
+    results.policy.device = cl::mem_policy::WRITE_ONLY;
+    results.policy.host = cl::mem_policy::HOST_READ_ONLY;
+    results.alloc_bytes(out_bytes);
+
+    if(point_buf.cmem == nullptr || results.cmem == nullptr)
+    {
+        if(point_buf.cmem != nullptr)
+            point_buf.retire(cqueue);
+
+        if(results.cmem != nullptr)
+            results.retire(cqueue);
+
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+
+    std::vector<P>* host = new std::vector<P>(std::move(points));
+
+    ///everything this batch used goes on one marker, once the last command using any of it is enqueued
+    auto retire_all = [&]()
+    {
+        cl_event fence = cl::enqueue_fence(cqueue);
+
+        cl::get_reclaim(ctx).retire_host([host](){delete host;}, cl::retain_fence(fence));
+        point_buf.retire(cl::retain_fence(fence));
+        results.retire(fence);
+    };
+
+    cl_int err = dispatch_write(cqueue, point_buf, 0, point_bytes, host->data(), false, 0, nullptr, nullptr);
+
+    if(err != CL_SUCCESS)
+    {
+        static lg::rate_limiter limit;
+
+        lg::error_limited(limit, "Error uploading query points ", err);
+
+        retire_all();
+
+        return err;
+    }
+
+    cl::args pack;
+    pack.push_back(in);
+    pack.push_back(point_buf);
+    pack.push_back(n);
+    pack.push_back(extra);
+    pack.push_back(results);
+
+    cl::event gathered;
+
+    int global_ws[1] = {n};
+    int local_ws[1] = {64};
+
+    cqueue.exec(kname, pack, global_ws, local_ws, &gathered, dependents);
+
+    if(gathered.bad())
+    {
+        retire_all();
+
+        return CL_INVALID_KERNEL;
+    }
+
+    err = dispatch_read(cqueue, results, 0, out_bytes, dst, false, 1, &gathered.cevent, out);
+
+    if(err != CL_SUCCESS)
+    {
+        static lg::rate_limiter limit;
+
+        lg::error_limited(limit, "Error reading query results ", err);
+    }
+
+    clReleaseEvent(gathered.cevent);
+
+    retire_all();
+
+    return err;
+}
+
+cl_int cl::enqueue_point_query(command_queue& cqueue, buffer& buf, const std::vector<int64_t>& indices, int elem_bytes, void* dst, const std::vector<cl::event*>& dependents, cl_event* out)
+{
+    if(buf.format == buffer::IMAGE)
+    {
+        lg::error("Point queries are for buffers, use query_pixels for images");
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    int64_t num_elements = buf.alloc_size / elem_bytes;
+
+    for(int64_t idx : indices)
+    {
+        if(idx < 0 || idx >= num_elements)
+        {
+            static lg::rate_limiter limit;
+
+            lg::error_limited(limit, "Point query index ", idx, " out of range of ", num_elements, " elements");
+            return CL_INVALID_VALUE;
+        }
+    }
+
+    if(!cl::ensure_program(cqueue.ctx, "cl_query_gather", query_src))
+        return CL_INVALID_PROGRAM;
+
+    std::vector<cl_long> points(indices.begin(), indices.end());
+
+    return gather(cqueue, "cl_query_gather", buf, std::move(points), elem_bytes, (int64_t)indices.size() * elem_bytes, dst, dependents, out);
+}
+
+cl_int cl::enqueue_pixel_query(command_queue& cqueue, buffer& img, const std::vector<vec2i>& coords, bool invert, int elem_bytes, void* dst, const std::vector<cl::event*>& dependents, cl_event* out)
+{
+    if(img.format != buffer::IMAGE || img.image_dimensionality != 2)
+    {
+        lg::error("Pixel queries are for 2d images, use query_points for buffers");
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    int channels = cl::image_read_channels(img.image_order);
+
+    if(channels == 0)
+    {
+        lg::error("Pixel query of an image with unsupported channel order ", img.image_order);
+        return CL_INVALID_IMAGE_FORMAT_DESCRIPTOR;
+    }
+
+    if(elem_bytes != channels * 4)
+    {
+        lg::error("Pixel query result type is ", elem_bytes, " bytes, pixels of this image are ", channels * 4);
+        return CL_INVALID_VALUE;
+    }
+
+    int width = img.image_dims[0];
+    int height = img.image_dims[1];
+
+    std::vector<cl_int2> points;
+    points.resize(coords.size());
+
+    for(int i=0; i < (int)coords.size(); i++)
+    {
+        int x = coords[i].x();
+        int y = coords[i].y();
+
+        if(x < 0 || x >= width || y < 0 || y >= height)
+        {
+            static lg::rate_limiter limit;
+
+            lg::error_limited(limit, "Pixel query ", x, ", ", y, " outside a ", width, "x", height, " image");
+            return CL_INVALID_VALUE;
+        }
+
+        if(invert)
+            y = height - 1 - y;
+
+        points[i].s[0] = x;
+        points[i].s[1] = y;
+    }
+
+    if(!cl::ensure_program(cqueue.ctx, "cl_query_gather", query_src))
+        return CL_INVALID_PROGRAM;
+
+    return gather(cqueue, pixel_kernel(img.image_type), img, std::move(points), channels, (int64_t)coords.size() * elem_bytes, dst, dependents, out);
+}
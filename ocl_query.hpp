@@ -0,0 +1,58 @@
+#ifndef OCL_QUERY_HPP_INCLUDED
+#define OCL_QUERY_HPP_INCLUDED
+
+#include "ocl.hpp"
+
+///batched point reads, for picking and probes that would otherwise be hundreds of one element async_reads a frame
+///the points go up in one write, one gather kernel copies them into a compact buffer, and that comes back in one read
+///the result is a read_event like async_read's, with one entry per point in the order they were asked for
+///the gather program is built the first time it's needed
+
+namespace cl
+{
+    ///dst has to hold indices.size() * elem_bytes, and stay valid until out completes
+    cl_int enqueue_point_query(command_queue& cqueue, buffer& buf, const std::vector<int64_t>& indices, int elem_bytes, void* dst, const std::vector<cl::event*>& dependents, cl_event* out);
+    cl_int enqueue_pixel_query(command_queue& cqueue, buffer& img, const std::vector<vec2i>& coords, bool invert, int elem_bytes, void* dst, const std::vector<cl::event*>& dependents, cl_event* out);
+
+    ///elements of a buffer (or svm) of T, by element index
+    ///the whole batch is rejected if any index is out of range
+    template<typename T>
+    read_event<T> query_points(command_queue& cqueue, buffer& buf, const std::vector<int64_t>& indices, std::vector<cl::event*> dependents = std::vector<cl::event*>())
+    {
+        read_event<T> data;
+
+        if(indices.size() == 0)
+            return data;
+
+        data.allocate_num(indices.size());
+
+        cl_int ret = enqueue_point_query(cqueue, buf, indices, sizeof(T), data.front_ptr(), dependents, &data.cevent);
+
+        data.invalid = ret != CL_SUCCESS;
+
+        return data;
+    }
+
+    ///pixels of a 2d image. Each comes back the way read_image returns it in a kernel, not the way the image stores it
+    ///so a pixel is a float, int or uint per channel (read_imagef/i/ui by the channel type), and T has to be that size
+    ///eg cl_float4 for CL_RGBA CL_UNORM_INT8, cl_uint for a CL_R CL_UNSIGNED_INT32 id buffer
+    ///invert counts y from the bottom of the image. The whole batch is rejected if any pixel is outside it
+    template<typename T>
+    read_event<T> query_pixels(command_queue& cqueue, buffer& img, const std::vector<vec2i>& coords, bool invert = false, std::vector<cl::event*> dependents = std::vector<cl::event*>())
+    {
+        read_event<T> data;
+
+        if(coords.size() == 0)
+            return data;
+
+        data.allocate_num(coords.size());
+
+        cl_int ret = enqueue_pixel_query(cqueue, img, coords, invert, sizeof(T), data.front_ptr(), dependents, &data.cevent);
+
+        data.invalid = ret != CL_SUCCESS;
+
+        return data;
+    }
+}
+
+#endif // OCL_QUERY_HPP_INCLUDED
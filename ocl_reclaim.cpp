@@ -0,0 +1,340 @@
+#include "ocl_reclaim.hpp"
+#include <algorithm>
+
+cl::reclaim_state::~reclaim_state()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    for(auto& res : retired)
+    {
+        if(res->reclaimed)
+            continue;
+
+        if(res->fence)
+            clWaitForEvents(1, &res->fence);
+
+        res->poolable = false;
+
+        reclaim(*res);
+    }
+
+    retired.clear();
+
+    evict_to(0);
+}
+
+static bool fence_done(cl_event fence)
+{
+    if(fence == nullptr)
+        return true;
+
+    cl_int status = CL_COMPLETE;
+
+    clGetEventInfo(fence, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, nullptr);
+
+    ///errors count as done too, nothing else is going to touch the memory
+    return status <= CL_COMPLETE;
+}
+
+static void CL_CALLBACK fence_signalled(cl_event evt, cl_int status, void* user)
+{
+    auto* keep = (std::pair<std::weak_ptr<cl::reclaim_state>, std::shared_ptr<cl::retired_resource>>*)user;
+
+    keep->second->signalled = true;
+
+    ///the context could have gone away already
+    std::shared_ptr<cl::reclaim_state> state = keep->first.lock();
+
+    if(state)
+    {
+        state->signalled_count++;
+
+        if(state->free_from_callback)
+            state->collect();
+    }
+
+    delete keep;
+}
+
+void cl::reclaim_state::add(const std::shared_ptr<retired_resource>& res)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        retired.push_back(res);
+    }
+
+    if(res->fence)
+    {
+        auto* keep = new std::pair<std::weak_ptr<reclaim_state>, std::shared_ptr<retired_resource>>(weak_from_this(), res);
+
+        if(clSetEventCallback(res->fence, CL_COMPLETE, fence_signalled, keep) != CL_SUCCESS)
+            delete keep;
+    }
+    else
+    {
+        ///nothing to wait for
+        signalled_count++;
+    }
+
+    ///frees earlier retires as we go, so nothing piles up in programs that never call collect themselves
+    collect_signalled();
+}
+
+void cl::reclaim_state::retire_mem(cl_mem mem, cl_event fence, int64_t bytes, cl_mem_flags flags, bool poolable)
+{
+    if(mem == nullptr)
+        return;
+
+    auto res = std::make_shared<retired_resource>();
+    res->fence = fence;
+    res->mem = mem;
+    res->bytes = bytes;
+    res->flags = flags;
+    ///caller memory can't be handed out to someone else
+    res->poolable = poolable && (flags & CL_MEM_USE_HOST_PTR) == 0;
+
+    add(res);
+}
+
+void cl::reclaim_state::retire_svm(void* ptr, cl_event fence)
+{
+    if(ptr == nullptr)
+        return;
+
+    auto res = std::make_shared<retired_resource>();
+    res->fence = fence;
+    res->svm = ptr;
+
+    add(res);
+}
+
+void cl::reclaim_state::retire_event(cl_event evt, cl_event fence)
+{
+    if(evt == nullptr)
+        return;
+
+    auto res = std::make_shared<retired_resource>();
+    res->fence = fence;
+    res->evt = evt;
+
+    add(res);
+}
+
+void cl::reclaim_state::retire_host(std::function<void()> free_func, cl_event fence)
+{
+    auto res = std::make_shared<retired_resource>();
+    res->fence = fence;
+    res->host_free = std::move(free_func);
+
+    add(res);
+}
+
+void cl::reclaim_state::reclaim(retired_resource& res)
+{
+    if(res.reclaimed)
+        return;
+
+    res.reclaimed = true;
+
+    if(res.mem)
+    {
+        if(res.poolable && res.bytes <= max_pool_bytes)
+        {
+            evict_to(max_pool_bytes - res.bytes);
+
+            pool.insert({{res.bytes, res.flags}, res.mem});
+            pool_order.push_back(res.mem);
+            pool_bytes += res.bytes;
+        }
+        else
+        {
+            clReleaseMemObject(res.mem);
+        }
+    }
+
+    #ifdef CL_VERSION_2_0
+    if(res.svm)
+        clSVMFree(ctx, res.svm);
+    #endif // CL_VERSION_2_0
+
+    if(res.evt)
+        clReleaseEvent(res.evt);
+
+    if(res.host_free)
+        res.host_free();
+
+    if(res.fence)
+        clReleaseEvent(res.fence);
+
+    res.mem = nullptr;
+    res.svm = nullptr;
+    res.evt = nullptr;
+    res.fence = nullptr;
+    res.host_free = nullptr;
+}
+
+int cl::reclaim_state::collect()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    ///anything signalled after this gets picked up now or by the next collect
+    signalled_count = 0;
+
+    int freed = 0;
+
+    for(auto& res : retired)
+    {
+        if(res->reclaimed)
+            continue;
+
+        if(!res->signalled && !fence_done(res->fence))
+            continue;
+
+        reclaim(*res);
+
+        freed++;
+    }
+
+    retired.erase(std::remove_if(retired.begin(), retired.end(), [](const std::shared_ptr<retired_resource>& res)
+    {
+        return res->reclaimed;
+    }), retired.end());
+
+    return freed;
+}
+
+int cl::reclaim_state::collect_signalled()
+{
+    if(signalled_count.load() == 0)
+        return 0;
+
+    return collect();
+}
+
+cl_mem cl::reclaim_state::acquire(int64_t bytes, cl_mem_flags flags)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto it = pool.find({bytes, flags});
+
+    if(it == pool.end())
+        return nullptr;
+
+    cl_mem mem = it->second;
+
+    pool.erase(it);
+    pool_order.erase(std::find(pool_order.begin(), pool_order.end(), mem));
+    pool_bytes -= bytes;
+
+    return mem;
+}
+
+void cl::reclaim_state::evict_to(int64_t bytes)
+{
+    while(pool_bytes > bytes && pool_order.size() > 0)
+    {
+        cl_mem oldest = pool_order.front();
+        pool_order.erase(pool_order.begin());
+
+        for(auto it = pool.begin(); it != pool.end(); it++)
+        {
+            if(it->second != oldest)
+                continue;
+
+            pool_bytes -= it->first.first;
+            pool.erase(it);
+            break;
+        }
+
+        clReleaseMemObject(oldest);
+    }
+}
+
+void cl::reclaim_state::trim()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    evict_to(0);
+}
+
+cl::reclaim_state& cl::get_reclaim(context& ctx)
+{
+    return *ctx.reclaim;
+}
+
+cl_event cl::enqueue_fence(command_queue& cqueue)
+{
+    cl_event fence = nullptr;
+
+    cl_int err = CL_SUCCESS;
+
+    #ifdef CL_VERSION_1_2
+    err = clEnqueueMarkerWithWaitList(cqueue, 0, nullptr, &fence);
+    #else
+    err = clEnqueueMarker(cqueue, &fence);
+    #endif // CL_VERSION_1_2
+
+    if(err != CL_SUCCESS)
+    {
+        lg::error("Error enqueueing fence ", err);
+
+        ///the retire falls back to the next collect, which is only safe once the queue has drained
+        clFinish(cqueue);
+
+        return nullptr;
+    }
+
+    return fence;
+}
+
+cl_event cl::retain_fence(cl_event fence)
+{
+    if(fence)
+        clRetainEvent(fence);
+
+    return fence;
+}
+
+void cl::buffer::retire_mem(command_queue& cqueue, cl_mem mem, int64_t bytes)
+{
+    retire_mem(enqueue_fence(cqueue), mem, bytes);
+}
+
+void cl::buffer::retire_mem(cl_event fence, cl_mem mem, int64_t bytes)
+{
+    cl_mem_flags flags = 0;
+
+    clGetMemObjectInfo(mem, CL_MEM_FLAGS, sizeof(flags), &flags, nullptr);
+
+    account_free(bytes);
+    capture_free(ctx, mem);
+
+    ///images would need their dims and format in the pool key too
+    get_reclaim(ctx).retire_mem(mem, fence, bytes, flags, format == BUFFER);
+}
+
+void cl::buffer::retire(command_queue& cqueue)
+{
+    retire(enqueue_fence(cqueue));
+}
+
+void cl::buffer::retire(cl_event fence)
+{
+    invalidate_reads();
+
+    if(format == SVM)
+    {
+        account_free(accounted_bytes);
+        capture_free(ctx, svm_ptr);
+
+        get_reclaim(ctx).retire_svm(svm_ptr, fence);
+
+        svm_ptr = nullptr;
+        return;
+    }
+
+    retire_mem(fence, cmem, alloc_size);
+
+    cmem = nullptr;
+}
@@ -0,0 +1,88 @@
+#ifndef OCL_RECLAIM_HPP_INCLUDED
+#define OCL_RECLAIM_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include <functional>
+
+///deferred deletion, so freeing things never has to wait on the queue
+///everything retired comes with a fence event, and is only freed once that fence has completed
+///collect() does the freeing. stats_end_frame calls it, and retiring or allocating anything calls it too once a fence has signalled
+///retired buffers go into a pool by size and flags, and buffer::alloc_bytes takes from it before allocating anything new
+
+namespace cl
+{
+    struct retired_resource
+    {
+        cl_event fence = nullptr;
+
+        cl_mem mem = nullptr;
+        int64_t bytes = 0;
+        cl_mem_flags flags = 0;
+        bool poolable = false;
+
+        void* svm = nullptr;
+        cl_event evt = nullptr;
+        std::function<void()> host_free;
+
+        std::atomic_bool signalled{false};
+        bool reclaimed = false;
+    };
+
+    struct reclaim_state : std::enable_shared_from_this<reclaim_state>
+    {
+        std::mutex lock;
+
+        std::vector<std::shared_ptr<retired_resource>> retired;
+
+        ///buffers waiting to be handed out again, keyed on size then flags
+        std::multimap<std::pair<int64_t, cl_mem_flags>, cl_mem> pool;
+        ///oldest first, for eviction
+        std::vector<cl_mem> pool_order;
+        int64_t pool_bytes = 0;
+        int64_t max_pool_bytes = 256 * 1024 * 1024;
+
+        ///free as soon as the fence completes rather than waiting for collect(). Happens on a driver thread
+        bool free_from_callback = false;
+
+        ///fences that have completed since the last collect()
+        std::atomic_int signalled_count{0};
+
+        cl_context ctx = nullptr;
+
+        ~reclaim_state();
+
+        ///these all take over the caller's reference to fence, a null fence means free on the next collect()
+        ///poolable buffers get recycled, anything else is released
+        void retire_mem(cl_mem mem, cl_event fence, int64_t bytes, cl_mem_flags flags, bool poolable = true);
+        void retire_svm(void* ptr, cl_event fence);
+        void retire_event(cl_event evt, cl_event fence);
+        ///eg staging copies of host data that a transfer is still reading from
+        void retire_host(std::function<void()> free_func, cl_event fence);
+
+        ///frees everything whose fence has completed, returns how many
+        int collect();
+        ///collect(), but only if a fence has signalled since the last one. Cheap enough for every retire and allocation
+        int collect_signalled();
+
+        ///a pooled buffer of exactly this size and flags, or nullptr
+        cl_mem acquire(int64_t bytes, cl_mem_flags flags);
+
+        ///releases everything in the pool
+        void trim();
+
+    private:
+        void add(const std::shared_ptr<retired_resource>& res);
+        ///needs lock held
+        void reclaim(retired_resource& res);
+        void evict_to(int64_t bytes);
+    };
+
+    reclaim_state& get_reclaim(context& ctx);
+
+    ///a marker on the queue, completes once everything enqueued before it has
+    cl_event enqueue_fence(command_queue& cqueue);
+    ///another reference to fence, for retiring more than one thing on the same marker. Null stays null
+    cl_event retain_fence(cl_event fence);
+}
+
+#endif // OCL_RECLAIM_HPP_INCLUDED
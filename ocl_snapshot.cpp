@@ -0,0 +1,309 @@
+#include "ocl_snapshot.hpp"
+#include "ocl_file.hpp"
+#include "ocl_transfer.hpp"
+#include <cstring>
+
+static int64_t round_up(int64_t val, int64_t to)
+{
+    return ((val + to - 1) / to) * to;
+}
+
+///restoring into a different shape replaces the allocation, the old one is freed once whatever was using it has finished
+static void retire_previous(cl::command_queue& cqueue, cl::buffer& buf)
+{
+    if(buf.cmem == nullptr && buf.svm_ptr == nullptr)
+        return;
+
+    buf.retire(cqueue);
+
+    buf.cmem = nullptr;
+    buf.svm_ptr = nullptr;
+}
+
+cl::snapshot::~snapshot()
+{
+    wait();
+
+    if(block)
+        free_pages(block);
+}
+
+void cl::snapshot::capture(command_queue& cqueue, const std::vector<buffer*>& bufs)
+{
+    wait();
+
+    if(block)
+        free_pages(block);
+
+    block = nullptr;
+    block_bytes = 0;
+    entries.clear();
+
+    int64_t page = page_size();
+
+    int64_t offset = round_up(sizeof(snapshot_header) + bufs.size() * sizeof(snapshot_entry), page);
+
+    for(buffer* buf : bufs)
+    {
+        snapshot_entry e;
+        e.format = buf->format;
+        e.svm_fine_grain = buf->svm_fine_grain;
+        e.image_dimensionality = buf->image_dimensionality;
+        e.byte_per_pixel = buf->byte_per_pixel;
+        e.image_order = buf->image_order;
+        e.image_type = buf->image_type;
+
+        for(int i=0; i < 3; i++)
+            e.image_dims[i] = buf->image_dims[i];
+
+        e.offset = offset;
+        e.bytes = buf->alloc_size;
+
+        offset += round_up(e.bytes, page);
+
+        entries.push_back(e);
+    }
+
+    block_bytes = offset;
+    block = (char*)alloc_pages(block_bytes);
+
+    if(block == nullptr)
+    {
+        lg::error("Could not allocate ", block_bytes, " bytes for snapshot");
+        block_bytes = 0;
+        entries.clear();
+        return;
+    }
+
+    memset(block, 0, entries.size() > 0 ? entries[0].offset : block_bytes);
+
+    snapshot_header header;
+    header.count = entries.size();
+    header.total_bytes = block_bytes;
+
+    memcpy(block, &header, sizeof(header));
+
+    if(entries.size() > 0)
+        memcpy(block + sizeof(header), &entries[0], entries.size() * sizeof(snapshot_entry));
+
+    for(int i=0; i < (int)bufs.size(); i++)
+    {
+        if(entries[i].bytes == 0)
+            continue;
+
+        cl_event evt = nullptr;
+
+        cl_int err = bufs[i]->read_whole(cqueue, block + entries[i].offset, false, &evt);
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Error reading buffer ", i, " for snapshot ", err);
+            continue;
+        }
+
+        pending.push_back(evt);
+    }
+
+    cqueue.flush();
+}
+
+void cl::snapshot::wait()
+{
+    if(pending.size() == 0)
+        return;
+
+    clWaitForEvents(pending.size(), &pending[0]);
+
+    for(cl_event evt : pending)
+        clReleaseEvent(evt);
+
+    pending.clear();
+}
+
+bool cl::snapshot::write(const std::string& fname)
+{
+    wait();
+
+    if(block == nullptr)
+        return false;
+
+    return write_file_direct(fname, block, block_bytes);
+}
+
+bool cl::snapshot::restore(command_queue& cqueue, const std::string& fname, const std::vector<buffer*>& bufs)
+{
+    std::shared_ptr<mapped_file> file = std::make_shared<mapped_file>();
+
+    if(!file->open(fname))
+        return false;
+
+    snapshot_header header;
+
+    if(file->size < (int64_t)sizeof(header))
+    {
+        lg::error("Snapshot ", fname, " is truncated");
+        return false;
+    }
+
+    memcpy(&header, file->data, sizeof(header));
+
+    if(memcmp(header.magic, snapshot_header().magic, sizeof(header.magic)) != 0 || header.version != 1)
+    {
+        lg::error(fname, " is not a snapshot");
+        return false;
+    }
+
+    if(header.count != bufs.size())
+    {
+        lg::error("Snapshot ", fname, " has ", header.count, " buffers, asked to restore ", bufs.size());
+        return false;
+    }
+
+    if((int64_t)(sizeof(header) + header.count * sizeof(snapshot_entry)) > file->size)
+    {
+        lg::error("Snapshot ", fname, " is truncated");
+        return false;
+    }
+
+    const char* base = (const char*)file->data;
+
+    std::vector<snapshot_entry> entries;
+    entries.resize(header.count);
+
+    if(header.count > 0)
+        memcpy(&entries[0], base + sizeof(header), header.count * sizeof(snapshot_entry));
+
+    bool ok = true;
+
+    for(int i=0; i < (int)entries.size(); i++)
+    {
+        const snapshot_entry& e = entries[i];
+        buffer& buf = *bufs[i];
+
+        if(e.offset < 0 || e.bytes < 0 || e.offset + e.bytes > file->size)
+        {
+            lg::error("Snapshot entry ", i, " is out of range");
+            ok = false;
+            continue;
+        }
+
+        if(e.bytes == 0)
+            continue;
+
+        const char* src = base + e.offset;
+
+        bool dims_match = true;
+
+        for(int d=0; d < 3; d++)
+            dims_match = dims_match && (int64_t)buf.image_dims[d] == e.image_dims[d];
+
+        bool in_place = buf.alloc_size == e.bytes && buf.format == e.format && (e.format != buffer::IMAGE || dims_match);
+
+        cl_int err = CL_SUCCESS;
+
+        if(e.format == buffer::BUFFER)
+        {
+            if(!in_place)
+            {
+                retire_previous(cqueue, buf);
+
+                buf.format = buffer::BUFFER;
+
+                if(cqueue.ctx.host_unified_memory && buf.policy.place != mem_policy::DEVICE && buf.policy.place != mem_policy::ALLOC_HOST_PTR)
+                {
+                    ///no allocation or copy at all
+                    if(adopt_mapping(buf, file, e.offset, e.bytes))
+                        continue;
+
+                    ///adopt_host_ptr copied it
+                    if(buf.alloc_size == e.bytes && buf.cmem != nullptr)
+                        continue;
+                }
+
+                buf.alloc_bytes(e.bytes);
+            }
+
+            buf.invalidate_reads();
+
+            err = transfer_write_with(transfer_method::STAGED, cqueue, buf, 0, e.bytes, src, false, 0, nullptr, nullptr);
+        }
+        else if(e.format == buffer::SVM)
+        {
+            if(!in_place)
+            {
+                retire_previous(cqueue, buf);
+
+                if(!buf.alloc_svm(e.bytes, e.svm_fine_grain))
+                {
+                    ok = false;
+                    continue;
+                }
+            }
+
+            buf.invalidate_reads();
+
+            err = buf.svm_memcpy(cqueue, false, buf.svm_ptr, src, e.bytes, 0, nullptr, nullptr);
+        }
+        else
+        {
+            if(!in_place)
+            {
+                if(e.image_dimensionality != 2)
+                {
+                    lg::error("Snapshot entry ", i, " is a ", e.image_dimensionality, "d image, only 2d can be restored");
+                    ok = false;
+                    continue;
+                }
+
+                retire_previous(cqueue, buf);
+
+                buf.format = buffer::IMAGE;
+                buf.image_dimensionality = e.image_dimensionality;
+                buf.byte_per_pixel = e.byte_per_pixel;
+                buf.image_order = e.image_order;
+                buf.image_type = e.image_type;
+                buf.alloc_size = e.bytes;
+
+                for(int d=0; d < 3; d++)
+                    buf.image_dims[d] = e.image_dims[d];
+
+                cl_image_format fmt;
+                fmt.image_channel_order = e.image_order;
+                fmt.image_channel_data_type = e.image_type;
+
+                buf.cmem = clCreateImage2D(cqueue.ctx, CL_MEM_READ_WRITE, &fmt, e.image_dims[0], e.image_dims[1], 0, nullptr, &err);
+
+                if(err != CL_SUCCESS)
+                {
+                    lg::error("Error creating image for snapshot entry ", i, " ", err);
+                    ok = false;
+                    continue;
+                }
+
+                buf.account_alloc(e.bytes);
+            }
+
+            buf.invalidate_reads();
+
+            size_t origin[3] = {0};
+
+            stats_transfer(buf.ctx, true, e.bytes);
+
+            err = clEnqueueWriteImage(cqueue, buf.cmem, CL_FALSE, origin, buf.image_dims, 0, 0, src, 0, nullptr, nullptr);
+
+            if(err == CL_SUCCESS)
+                capture_image(cqueue, buf, true, origin, buf.image_dims, 0, src, nullptr);
+        }
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Error restoring snapshot entry ", i, " ", err);
+            ok = false;
+        }
+    }
+
+    ///writes that went direct from the mapping need it alive until they're done
+    cqueue.block();
+
+    return ok;
+}
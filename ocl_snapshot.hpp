@@ -0,0 +1,63 @@
+#ifndef OCL_SNAPSHOT_HPP_INCLUDED
+#define OCL_SNAPSHOT_HPP_INCLUDED
+
+#include "ocl.hpp"
+
+///checkpoints a set of buffers and images into one file
+///layout is a header page(s) with an index, then every buffer's contents starting on its own page
+///capture only enqueues reads, so it overlaps with whatever the queue is doing, write waits for them
+
+namespace cl
+{
+    struct snapshot_header
+    {
+        char magic[8] = {'C', 'L', 'S', 'N', 'A', 'P', '0', '1'};
+        uint32_t version = 1;
+        uint32_t count = 0;
+        ///whole container including padding
+        int64_t total_bytes = 0;
+    };
+
+    struct snapshot_entry
+    {
+        int32_t format = 0;
+        int32_t svm_fine_grain = 0;
+        int32_t image_dimensionality = 1;
+        int32_t byte_per_pixel = 1;
+        uint32_t image_order = 0;
+        uint32_t image_type = 0;
+        int64_t image_dims[3] = {1, 1, 1};
+        ///from the start of the file, page aligned
+        int64_t offset = 0;
+        int64_t bytes = 0;
+    };
+
+    struct snapshot
+    {
+        std::vector<snapshot_entry> entries;
+
+        ///the whole container, header included, page aligned
+        char* block = nullptr;
+        int64_t block_bytes = 0;
+
+        snapshot() = default;
+        snapshot(const snapshot&) = delete;
+        snapshot& operator=(const snapshot&) = delete;
+        ~snapshot();
+
+        ///enqueues non blocking reads of every buffer. They mustn't be written to until the reads complete
+        void capture(command_queue& cqueue, const std::vector<buffer*>& bufs);
+        ///waits for the capture
+        void wait();
+        bool write(const std::string& fname);
+
+        ///buffers that are already allocated to the right size and format are written into in place, anything else gets allocated
+        ///the file is mapped, and uploaded through pinned staging or adopted outright on unified memory devices
+        static bool restore(command_queue& cqueue, const std::string& fname, const std::vector<buffer*>& bufs);
+
+    private:
+        std::vector<cl_event> pending;
+    };
+}
+
+#endif // OCL_SNAPSHOT_HPP_INCLUDED
@@ -0,0 +1,314 @@
+#include "ocl_split.hpp"
+#include <numeric>
+#include <algorithm>
+
+cl::split_executor::split_executor(context& in) : ctx(in)
+{
+    std::vector<double> prior;
+
+    for(cl_uint i=0; i < ctx.num_devices; i++)
+    {
+        cl_device_id dev = ctx.devices[i];
+
+        queues.emplace_back(ctx, dev, CL_QUEUE_PROFILING_ENABLE);
+
+        cl_uint align_bits = 1024;
+        clGetDeviceInfo(dev, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &align_bits, nullptr);
+
+        align_bytes = std::max(align_bytes, (int64_t)align_bits / 8);
+
+        ///starting guess until we've got real timings
+        cl_uint compute_units = 1;
+        cl_uint clock = 1;
+
+        clGetDeviceInfo(dev, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units, nullptr);
+        clGetDeviceInfo(dev, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &clock, nullptr);
+
+        prior.push_back(std::max((double)compute_units * clock, 1.));
+    }
+
+    double sum = std::accumulate(prior.begin(), prior.end(), 0.);
+
+    for(double p : prior)
+    {
+        weights.push_back(p / sum);
+    }
+}
+
+cl::split_executor::~split_executor()
+{
+    block();
+}
+
+void cl::split_executor::block()
+{
+    if(pending.size() == 0)
+        return;
+
+    std::vector<cl_event> evts;
+
+    for(in_flight& i : pending)
+        evts.push_back(i.evt);
+
+    clWaitForEvents(evts.size(), &evts[0]);
+
+    ///items per ns for every device that did some work
+    std::vector<double> throughput;
+    throughput.resize(weights.size());
+
+    bool measured = true;
+
+    for(in_flight& i : pending)
+    {
+        cl_ulong start = 0;
+        cl_ulong finish = 0;
+
+        cl_int e1 = clGetEventProfilingInfo(i.evt, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr);
+        cl_int e2 = clGetEventProfilingInfo(i.evt, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &finish, nullptr);
+
+        if(e1 != CL_SUCCESS || e2 != CL_SUCCESS || finish <= start)
+            measured = false;
+        else
+            throughput[i.device] = (double)i.items / (finish - start);
+
+        clReleaseEvent(i.evt);
+    }
+
+    for(cl_mem mem : pending_subs)
+    {
+        clReleaseMemObject(mem);
+    }
+
+    pending.clear();
+    pending_subs.clear();
+
+    if(!measured)
+        return;
+
+    ///devices that got no work this time keep their old share
+    double measured_weight = 0;
+    double measured_throughput = 0;
+
+    for(int i=0; i < (int)weights.size(); i++)
+    {
+        if(throughput[i] <= 0)
+            continue;
+
+        measured_weight += weights[i];
+        measured_throughput += throughput[i];
+    }
+
+    if(measured_throughput <= 0)
+        return;
+
+    for(int i=0; i < (int)weights.size(); i++)
+    {
+        if(throughput[i] <= 0)
+            continue;
+
+        double target = measured_weight * throughput[i] / measured_throughput;
+
+        weights[i] = weights[i] * (1 - adapt_rate) + target * adapt_rate;
+        weights[i] = std::max(weights[i], min_weight);
+    }
+
+    double sum = std::accumulate(weights.begin(), weights.end(), 0.);
+
+    for(double& w : weights)
+        w /= sum;
+}
+
+void cl::split_executor::exec_impl(kernel& kname, split_args& pack, int dim, const size_t* g_ws, const size_t* l_ws)
+{
+    block();
+
+    int split_dim = dim - 1;
+
+    int64_t total = g_ws[split_dim];
+
+    int64_t other_items = 1;
+
+    for(int i=0; i < split_dim; i++)
+        other_items *= g_ws[i];
+
+    bool has_local = false;
+
+    for(int i=0; i < dim; i++)
+        has_local = has_local || l_ws[i] != 0;
+
+    ///slice boundaries have to land on a local size multiple, and on a valid sub buffer origin for every sliced arg
+    int64_t granularity = std::max((int64_t)l_ws[split_dim], (int64_t)1);
+
+    for(split_arg& arg : pack.arg_list)
+    {
+        if(arg.type != split_arg::SLICED || arg.bytes_per_item <= 0)
+            continue;
+
+        int64_t items_per_align = align_bytes / std::gcd(align_bytes, arg.bytes_per_item);
+
+        granularity = std::lcm(granularity, items_per_align);
+    }
+
+    int num = queues.size();
+
+    std::vector<int64_t> counts;
+    counts.resize(num);
+
+    int64_t assigned = 0;
+
+    for(int i=0; i < num - 1; i++)
+    {
+        int64_t share = (int64_t)(total * weights[i]);
+
+        share = (share / granularity) * granularity;
+        share = std::min(share, total - assigned);
+
+        counts[i] = share;
+        assigned += share;
+    }
+
+    counts[num - 1] = total - assigned;
+
+    int64_t offset = 0;
+
+    for(int dev=0; dev < num; dev++)
+    {
+        int64_t count = counts[dev];
+
+        if(count <= 0)
+            continue;
+
+        int ioffset = offset;
+        int icount = count;
+
+        bool ok = true;
+
+        for(int i=0; i < (int)pack.arg_list.size(); i++)
+        {
+            split_arg& arg = pack.arg_list[i];
+
+            cl_int err = CL_SUCCESS;
+
+            if(arg.type == split_arg::VALUE)
+            {
+                err = clSetKernelArg(kname.ckernel, i, arg.info.size, arg.info.ptr);
+            }
+            else if(arg.type == split_arg::WHOLE)
+            {
+                #ifdef CL_VERSION_2_0
+                if(arg.buf->format == buffer::SVM)
+                    err = clSetKernelArgSVMPointer(kname.ckernel, i, arg.buf->svm_ptr);
+                else
+                #endif // CL_VERSION_2_0
+                    err = clSetKernelArg(kname.ckernel, i, sizeof(cl_mem), &arg.buf->get());
+            }
+            else if(arg.type == split_arg::OFFSET)
+            {
+                err = clSetKernelArg(kname.ckernel, i, sizeof(int), &ioffset);
+            }
+            else if(arg.type == split_arg::COUNT)
+            {
+                err = clSetKernelArg(kname.ckernel, i, sizeof(int), &icount);
+            }
+            else if(arg.type == split_arg::SLICED)
+            {
+                arg.buf->invalidate_reads();
+
+                cl_buffer_region region;
+                region.origin = offset * arg.bytes_per_item;
+                region.size = std::min(count * arg.bytes_per_item, arg.buf->alloc_size - (int64_t)region.origin);
+
+                if((int64_t)region.origin >= arg.buf->alloc_size)
+                {
+                    lg::error("Split slice past the end of buffer arg ", i);
+                    ok = false;
+                    break;
+                }
+
+                ///svm slices are just an offset pointer
+                #ifdef CL_VERSION_2_0
+                if(arg.buf->format == buffer::SVM)
+                {
+                    err = clSetKernelArgSVMPointer(kname.ckernel, i, (char*)arg.buf->svm_ptr + region.origin);
+
+                    if(err != CL_SUCCESS)
+                    {
+                        lg::error("Error setting split arg ", i, " for ", kname.name, " err ", err);
+                        ok = false;
+                        break;
+                    }
+
+                    continue;
+                }
+                #endif // CL_VERSION_2_0
+
+                ///0 inherits the parent's access and host flags, asking for read write on a read only parent is an error
+                cl_mem sub = clCreateSubBuffer(arg.buf->get(), 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+
+                if(err == CL_SUCCESS)
+                {
+                    pending_subs.push_back(sub);
+
+                    err = clSetKernelArg(kname.ckernel, i, sizeof(cl_mem), &sub);
+                }
+            }
+
+            if(err != CL_SUCCESS)
+            {
+                lg::error("Error setting split arg ", i, " for ", kname.name, " err ", err);
+                ok = false;
+                break;
+            }
+        }
+
+        if(!ok)
+        {
+            offset += count;
+            continue;
+        }
+
+        size_t dev_g_ws[3] = {0};
+        size_t dev_l_ws[3] = {0};
+
+        for(int i=0; i < dim; i++)
+        {
+            dev_g_ws[i] = g_ws[i];
+            dev_l_ws[i] = l_ws[i];
+        }
+
+        dev_g_ws[split_dim] = count;
+
+        for(int i=0; i < dim && has_local; i++)
+        {
+            if(dev_l_ws[i] == 0)
+                continue;
+
+            if((dev_g_ws[i] % dev_l_ws[i]) != 0)
+                dev_g_ws[i] += dev_l_ws[i] - (dev_g_ws[i] % dev_l_ws[i]);
+        }
+
+        in_flight flight;
+        flight.device = dev;
+        flight.items = count * other_items;
+
+        cl_int err = clEnqueueNDRangeKernel(queues[dev].cqueue, kname.ckernel, dim, nullptr, dev_g_ws, has_local ? dev_l_ws : nullptr, 0, nullptr, &flight.evt);
+
+        if(err != CL_SUCCESS)
+        {
+            static lg::keyed_rate_limiter limit;
+
+            lg::error_limited(limit.get(kname.name), "clEnqueueNDRangeKernel Error in split with ", kname.name, " on device ", dev, " err ", err);
+        }
+        else
+        {
+            pending.push_back(flight);
+        }
+
+        offset += count;
+    }
+
+    for(command_queue& cqueue : queues)
+    {
+        cqueue.flush();
+    }
+}
@@ -0,0 +1,150 @@
+#ifndef OCL_SPLIT_HPP_INCLUDED
+#define OCL_SPLIT_HPP_INCLUDED
+
+#include "ocl.hpp"
+
+///splits one kernel dispatch across every device in a multi device context
+///the last dimension of the global range is partitioned in proportion to each device's measured throughput,
+///which is re-measured from profiling every iteration
+
+namespace cl
+{
+    struct split_arg
+    {
+        enum kind
+        {
+            VALUE,  ///passed to every device unchanged
+            SLICED, ///each device gets a sub buffer of its own slice, so indices inside the kernel start at 0
+            WHOLE,  ///the whole buffer, read only
+            OFFSET, ///int, the index in the split dimension this device's slice starts at
+            COUNT,  ///int, the number of items this device owns. Global sizes get rounded up, so bounds check against this
+        };
+
+        kind type = VALUE;
+        arg_info info;
+        buffer* buf = nullptr;
+        int64_t bytes_per_item = 0;
+    };
+
+    struct split_args
+    {
+        std::vector<split_arg> arg_list;
+
+        template<typename T>
+        void push_back(T& val)
+        {
+            split_arg arg;
+            arg.info.ptr = &val;
+            arg.info.size = sizeof(T);
+
+            arg_list.push_back(arg);
+        }
+
+        ///bytes_per_item is the size of one step in the split dimension, eg sizeof(float) in 1d or a row in 2d
+        void push_sliced(buffer& buf, int64_t bytes_per_item)
+        {
+            split_arg arg;
+            arg.type = split_arg::SLICED;
+            arg.buf = &buf;
+            arg.bytes_per_item = bytes_per_item;
+
+            arg_list.push_back(arg);
+        }
+
+        void push_whole(buffer& buf)
+        {
+            split_arg arg;
+            arg.type = split_arg::WHOLE;
+            arg.buf = &buf;
+
+            arg_list.push_back(arg);
+        }
+
+        void push_offset()
+        {
+            split_arg arg;
+            arg.type = split_arg::OFFSET;
+
+            arg_list.push_back(arg);
+        }
+
+        void push_count()
+        {
+            split_arg arg;
+            arg.type = split_arg::COUNT;
+
+            arg_list.push_back(arg);
+        }
+    };
+
+    struct split_executor
+    {
+        context& ctx;
+
+        ///one profiling queue per device in the context
+        std::vector<command_queue> queues;
+        ///fraction of the work each device gets, sums to 1
+        std::vector<double> weights;
+
+        ///smallest share a device can drop to, so it keeps getting measured
+        double min_weight = 0.02;
+        ///how much of the new measurement goes into the weights each iteration
+        double adapt_rate = 0.5;
+
+        split_executor(context& ctx);
+        ~split_executor();
+
+        template<typename T, int dim>
+        void exec(kernel& kname, split_args& pack, const T(&global_ws)[dim], const T(&local_ws)[dim])
+        {
+            size_t g_ws[dim] = {0};
+            size_t l_ws[dim] = {0};
+
+            for(int i=0; i < dim; i++)
+            {
+                g_ws[i] = global_ws[i];
+                l_ws[i] = local_ws[i];
+            }
+
+            exec_impl(kname, pack, dim, g_ws, l_ws);
+        }
+
+        template<typename T, int dim>
+        void exec(const std::string& kname, split_args& pack, const T(&global_ws)[dim], const T(&local_ws)[dim])
+        {
+            auto it = ctx.kernels.find(kname);
+
+            if(it == ctx.kernels.end())
+            {
+                static lg::keyed_rate_limiter limit;
+
+                lg::error_limited(limit.get(kname), "Kernel with name ", kname, " not found");
+                return;
+            }
+
+            exec(it->second, pack, global_ws, local_ws);
+        }
+
+        ///waits for the last dispatch, updates the weights from its timings and frees its sub buffers
+        ///called automatically at the start of the next exec. Call it before reading sliced outputs on another queue
+        void block();
+
+    private:
+        struct in_flight
+        {
+            int device = 0;
+            int64_t items = 0;
+            cl_event evt = nullptr;
+        };
+
+        std::vector<in_flight> pending;
+        std::vector<cl_mem> pending_subs;
+
+        ///CL_DEVICE_MEM_BASE_ADDR_ALIGN across all devices, in bytes. Sub buffer origins must be a multiple of this
+        int64_t align_bytes = 128;
+
+        void exec_impl(kernel& kname, split_args& pack, int dim, const size_t* g_ws, const size_t* l_ws);
+    };
+}
+
+#endif // OCL_SPLIT_HPP_INCLUDED
@@ -0,0 +1,257 @@
+#include "ocl_stats.hpp"
+#include "ocl_reclaim.hpp"
+#include <sstream>
+
+///created by the context constructor
+static cl::context_stats& get_context_stats(cl::context& ctx)
+{
+    return *ctx.stats;
+}
+
+static void raise_peak(std::atomic<int64_t>& peak, int64_t val)
+{
+    int64_t current = peak.load(std::memory_order_relaxed);
+
+    while(val > current && !peak.compare_exchange_weak(current, val, std::memory_order_relaxed)){}
+}
+
+static const std::string& tag_or_default(const std::string& tag)
+{
+    static const std::string untagged = "untagged";
+
+    if(tag.size() == 0)
+        return untagged;
+
+    return tag;
+}
+
+void cl::stats_alloc(context& ctx, const std::string& tag, int64_t bytes)
+{
+    context_stats& stats = get_context_stats(ctx);
+
+    int64_t live = stats.live_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+    raise_peak(stats.peak_bytes, live);
+
+    stats.allocations.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(stats.lock);
+
+    tag_stats& ts = stats.tags[tag_or_default(tag)];
+
+    ts.live_bytes += bytes;
+    ts.peak_bytes = std::max(ts.peak_bytes, ts.live_bytes);
+    ts.allocations++;
+}
+
+void cl::stats_free(context& ctx, const std::string& tag, int64_t bytes)
+{
+    context_stats& stats = get_context_stats(ctx);
+
+    stats.live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    stats.releases.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(stats.lock);
+
+    tag_stats& ts = stats.tags[tag_or_default(tag)];
+
+    ts.live_bytes -= bytes;
+    ts.releases++;
+}
+
+void cl::stats_transfer(context& ctx, bool to_device, int64_t bytes)
+{
+    if(bytes <= 0)
+        return;
+
+    context_stats& stats = get_context_stats(ctx);
+
+    if(to_device)
+    {
+        stats.h2d_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        stats.h2d_transfers.fetch_add(1, std::memory_order_relaxed);
+        stats.frame_h2d_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    else
+    {
+        stats.d2h_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        stats.d2h_transfers.fetch_add(1, std::memory_order_relaxed);
+        stats.frame_d2h_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+void cl::stats_map(context& ctx, bool mapping)
+{
+    context_stats& stats = get_context_stats(ctx);
+
+    if(mapping)
+        stats.maps.fetch_add(1, std::memory_order_relaxed);
+    else
+        stats.unmaps.fetch_add(1, std::memory_order_relaxed);
+}
+
+void cl::buffer::account_alloc(int64_t bytes)
+{
+    accounted_bytes += bytes;
+
+    stats_alloc(ctx, tag, bytes);
+
+    ///every allocation comes through here once its handle is set
+    capture_alloc(*this);
+}
+
+void cl::buffer::account_free(int64_t bytes)
+{
+    bytes = std::min(bytes, accounted_bytes);
+
+    if(bytes <= 0)
+        return;
+
+    accounted_bytes -= bytes;
+
+    stats_free(ctx, tag, bytes);
+}
+
+cl::stats_snapshot cl::get_stats(context& ctx)
+{
+    context_stats& stats = get_context_stats(ctx);
+
+    stats_snapshot ret;
+
+    ret.live_bytes = stats.live_bytes.load(std::memory_order_relaxed);
+    ret.peak_bytes = stats.peak_bytes.load(std::memory_order_relaxed);
+    ret.allocations = stats.allocations.load(std::memory_order_relaxed);
+    ret.releases = stats.releases.load(std::memory_order_relaxed);
+
+    ret.h2d_bytes = stats.h2d_bytes.load(std::memory_order_relaxed);
+    ret.d2h_bytes = stats.d2h_bytes.load(std::memory_order_relaxed);
+    ret.h2d_transfers = stats.h2d_transfers.load(std::memory_order_relaxed);
+    ret.d2h_transfers = stats.d2h_transfers.load(std::memory_order_relaxed);
+
+    ret.frame_h2d_bytes = stats.frame_h2d_bytes.load(std::memory_order_relaxed);
+    ret.frame_d2h_bytes = stats.frame_d2h_bytes.load(std::memory_order_relaxed);
+    ret.last_frame_h2d_bytes = stats.last_frame_h2d_bytes.load(std::memory_order_relaxed);
+    ret.last_frame_d2h_bytes = stats.last_frame_d2h_bytes.load(std::memory_order_relaxed);
+    ret.frames = stats.frames.load(std::memory_order_relaxed);
+
+    ret.maps = stats.maps.load(std::memory_order_relaxed);
+    ret.unmaps = stats.unmaps.load(std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> guard(ctx.reclaim->lock);
+
+        ret.pooled_bytes = ctx.reclaim->pool_bytes;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(stats.lock);
+
+        ret.tags = stats.tags;
+    }
+
+    return ret;
+}
+
+void cl::stats_end_frame(context& ctx)
+{
+    context_stats& stats = get_context_stats(ctx);
+
+    stats.last_frame_h2d_bytes.store(stats.frame_h2d_bytes.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+    stats.last_frame_d2h_bytes.store(stats.frame_d2h_bytes.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+    stats.frames.fetch_add(1, std::memory_order_relaxed);
+
+    ///catches anything the opportunistic collects missed, eg fences whose callback couldn't be registered
+    ctx.reclaim->collect();
+}
+
+static std::string escape_label(const std::string& in)
+{
+    std::string ret;
+
+    for(char c : in)
+    {
+        if(c == '\\')
+            ret += "\\\\";
+        else if(c == '"')
+            ret += "\\\"";
+        else if(c == '\n')
+            ret += "\\n";
+        else
+            ret += c;
+    }
+
+    return ret;
+}
+
+namespace
+{
+    struct prom_writer
+    {
+        std::stringstream out;
+        std::string prefix;
+        std::string device;
+
+        void header(const std::string& name, const std::string& type, const std::string& help)
+        {
+            out << "# HELP " << prefix << "_" << name << " " << help << "\n";
+            out << "# TYPE " << prefix << "_" << name << " " << type << "\n";
+        }
+
+        void value(const std::string& name, int64_t val, const std::string& extra_labels = "")
+        {
+            out << prefix << "_" << name << "{device=\"" << device << "\"" << extra_labels << "} " << val << "\n";
+        }
+
+        void single(const std::string& name, const std::string& type, const std::string& help, int64_t val)
+        {
+            header(name, type, help);
+            value(name, val);
+        }
+    };
+}
+
+std::string cl::stats_prometheus(context& ctx, const std::string& prefix)
+{
+    stats_snapshot snap = get_stats(ctx);
+
+    prom_writer w;
+    w.prefix = prefix;
+    w.device = escape_label(ctx.device_name);
+
+    w.single("live_bytes", "gauge", "Device memory currently allocated", snap.live_bytes);
+    w.single("peak_bytes", "gauge", "Most device memory allocated at once", snap.peak_bytes);
+    w.single("pooled_bytes", "gauge", "Released memory held in the reuse pool", snap.pooled_bytes);
+    w.single("allocations_total", "counter", "Allocations made", snap.allocations);
+    w.single("releases_total", "counter", "Allocations released", snap.releases);
+
+    w.single("h2d_bytes_total", "counter", "Bytes transferred host to device", snap.h2d_bytes);
+    w.single("d2h_bytes_total", "counter", "Bytes transferred device to host", snap.d2h_bytes);
+    w.single("h2d_transfers_total", "counter", "Host to device transfers", snap.h2d_transfers);
+    w.single("d2h_transfers_total", "counter", "Device to host transfers", snap.d2h_transfers);
+    w.single("last_frame_h2d_bytes", "gauge", "Bytes transferred host to device over the last frame", snap.last_frame_h2d_bytes);
+    w.single("last_frame_d2h_bytes", "gauge", "Bytes transferred device to host over the last frame", snap.last_frame_d2h_bytes);
+    w.single("frames_total", "counter", "Frames ended", snap.frames);
+
+    w.single("maps_total", "counter", "Buffers mapped", snap.maps);
+    w.single("unmaps_total", "counter", "Buffers unmapped", snap.unmaps);
+
+    if(snap.tags.size() > 0)
+    {
+        w.header("tag_live_bytes", "gauge", "Device memory currently allocated, by tag");
+
+        for(auto& [name, ts] : snap.tags)
+            w.value("tag_live_bytes", ts.live_bytes, ",tag=\"" + escape_label(name) + "\"");
+
+        w.header("tag_peak_bytes", "gauge", "Most device memory allocated at once, by tag");
+
+        for(auto& [name, ts] : snap.tags)
+            w.value("tag_peak_bytes", ts.peak_bytes, ",tag=\"" + escape_label(name) + "\"");
+
+        w.header("tag_allocations_total", "counter", "Allocations made, by tag");
+
+        for(auto& [name, ts] : snap.tags)
+            w.value("tag_allocations_total", ts.allocations, ",tag=\"" + escape_label(name) + "\"");
+    }
+
+    return w.out.str();
+}
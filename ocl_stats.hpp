@@ -0,0 +1,81 @@
+#ifndef OCL_STATS_HPP_INCLUDED
+#define OCL_STATS_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include <atomic>
+
+///device memory and transfer accounting, per context and per buffer::tag
+///everything is relaxed atomics so it's cheap enough to leave on. Tags take a lock, but only on allocation and release
+///call stats_end_frame once a frame to roll the per frame transfer counters over, it also frees anything retired whose fence has completed
+///transfers are counted when they're issued, whether or not they go on to succeed
+
+namespace cl
+{
+    struct tag_stats
+    {
+        int64_t live_bytes = 0;
+        int64_t peak_bytes = 0;
+        int64_t allocations = 0;
+        int64_t releases = 0;
+    };
+
+    struct stats_snapshot
+    {
+        int64_t live_bytes = 0;
+        int64_t peak_bytes = 0;
+        int64_t allocations = 0;
+        int64_t releases = 0;
+        ///released buffers sitting in the reclaim pool, still device memory but not counted in live_bytes
+        int64_t pooled_bytes = 0;
+
+        int64_t h2d_bytes = 0;
+        int64_t d2h_bytes = 0;
+        int64_t h2d_transfers = 0;
+        int64_t d2h_transfers = 0;
+
+        ///so far this frame, and over the whole of the last one
+        int64_t frame_h2d_bytes = 0;
+        int64_t frame_d2h_bytes = 0;
+        int64_t last_frame_h2d_bytes = 0;
+        int64_t last_frame_d2h_bytes = 0;
+        int64_t frames = 0;
+
+        int64_t maps = 0;
+        int64_t unmaps = 0;
+
+        std::map<std::string, tag_stats> tags;
+    };
+
+    struct context_stats
+    {
+        std::atomic<int64_t> live_bytes{0};
+        std::atomic<int64_t> peak_bytes{0};
+        std::atomic<int64_t> allocations{0};
+        std::atomic<int64_t> releases{0};
+
+        std::atomic<int64_t> h2d_bytes{0};
+        std::atomic<int64_t> d2h_bytes{0};
+        std::atomic<int64_t> h2d_transfers{0};
+        std::atomic<int64_t> d2h_transfers{0};
+
+        std::atomic<int64_t> frame_h2d_bytes{0};
+        std::atomic<int64_t> frame_d2h_bytes{0};
+        std::atomic<int64_t> last_frame_h2d_bytes{0};
+        std::atomic<int64_t> last_frame_d2h_bytes{0};
+        std::atomic<int64_t> frames{0};
+
+        std::atomic<int64_t> maps{0};
+        std::atomic<int64_t> unmaps{0};
+
+        std::mutex lock;
+        std::map<std::string, tag_stats> tags;
+    };
+
+    stats_snapshot get_stats(context& ctx);
+    void stats_end_frame(context& ctx);
+
+    ///prometheus text exposition format, every metric is labelled with the context's device
+    std::string stats_prometheus(context& ctx, const std::string& prefix = "clwrap");
+}
+
+#endif // OCL_STATS_HPP_INCLUDED
@@ -0,0 +1,304 @@
+#include "ocl_stream.hpp"
+#include <fstream>
+#include <algorithm>
+
+cl::stream_source cl::stream_source::from_host(const void* ptr, int64_t bytes)
+{
+    stream_source ret;
+    ret.host = ptr;
+    ret.bytes = bytes;
+
+    return ret;
+}
+
+cl::stream_source cl::stream_source::from_file(const std::string& fname)
+{
+    stream_source ret;
+    ret.fname = fname;
+
+    std::ifstream file(fname, std::ios::binary | std::ios::ate);
+
+    if(!file.good())
+    {
+        lg::error("Could not open stream source ", fname);
+        return ret;
+    }
+
+    ret.bytes = (int64_t)file.tellg();
+
+    return ret;
+}
+
+cl::stream_executor::stream_executor(context& in, int slots) : ctx(in)
+{
+    for(int i=0; i < std::max(slots, 1); i++)
+    {
+        queues.emplace_back(ctx, ctx.selected_device, 0);
+    }
+}
+
+int64_t cl::stream_executor::chunk_items(int64_t item_bytes, int64_t halo_items, int64_t out_bytes_per_item, int64_t fixed_out_bytes)
+{
+    cl_ulong global_mem = 0;
+    cl_ulong max_alloc = 0;
+
+    clGetDeviceInfo(ctx.selected_device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &global_mem, nullptr);
+    clGetDeviceInfo(ctx.selected_device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, nullptr);
+
+    int64_t budget = device_budget;
+
+    if(budget <= 0)
+        budget = global_mem / 4;
+
+    int64_t slot_budget = budget / (int64_t)queues.size();
+
+    int64_t fixed = 2 * halo_items * item_bytes + fixed_out_bytes;
+
+    int64_t items = (slot_budget - fixed) / (item_bytes + out_bytes_per_item);
+
+    ///each buffer also has to be a legal allocation on its own
+    if(max_alloc > 0)
+    {
+        items = std::min(items, ((int64_t)max_alloc - 2 * halo_items * item_bytes) / item_bytes);
+
+        if(out_bytes_per_item > 0)
+            items = std::min(items, (int64_t)max_alloc / out_bytes_per_item);
+    }
+
+    if(local_size > 0 && items >= local_size)
+        items = (items / local_size) * local_size;
+
+    return items;
+}
+
+bool cl::stream_executor::concat(kernel& kern, args& extra, const stream_source& src, int64_t item_bytes, int64_t halo_items, void* dst, int64_t out_bytes_per_item)
+{
+    if(out_bytes_per_item <= 0)
+    {
+        lg::error("Stream concat needs some output per item");
+        return false;
+    }
+
+    return run(kern, extra, src, item_bytes, halo_items, dst, out_bytes_per_item, 0, nullptr);
+}
+
+bool cl::stream_executor::reduce(kernel& kern, args& extra, const stream_source& src, int64_t item_bytes, int64_t halo_items, int64_t partial_bytes,
+                                 const std::function<void(int64_t first, int64_t count, const void* partial)>& combine)
+{
+    if(partial_bytes <= 0)
+    {
+        lg::error("Stream reduce needs a partial result size");
+        return false;
+    }
+
+    return run(kern, extra, src, item_bytes, halo_items, nullptr, 0, partial_bytes, &combine);
+}
+
+namespace
+{
+    struct stream_slot
+    {
+        cl::buffer in;
+        cl::buffer out;
+        bool allocated = false;
+
+        ///file chunks land here before upload
+        std::vector<char> host_in;
+        ///reduce partials get read back here
+        std::vector<char> host_out;
+
+        cl_event done = nullptr;
+        int64_t first = 0;
+        int64_t count = 0;
+
+        stream_slot(cl::context& ctx) : in(ctx), out(ctx) {}
+    };
+}
+
+bool cl::stream_executor::run(kernel& kern, args& extra, const stream_source& src, int64_t item_bytes, int64_t halo_items,
+                              void* dst, int64_t out_bytes_per_item, int64_t partial_bytes,
+                              const std::function<void(int64_t first, int64_t count, const void* partial)>* combine)
+{
+    if(item_bytes <= 0)
+        return false;
+
+    int64_t total = src.bytes / item_bytes;
+
+    if(total == 0)
+        return true;
+
+    halo_items = std::max(halo_items, (int64_t)0);
+
+    int64_t chunk = chunk_items(item_bytes, halo_items, out_bytes_per_item, partial_bytes);
+
+    if(chunk <= 0)
+    {
+        lg::error("Stream device budget too small for a single item");
+        return false;
+    }
+
+    chunk = std::min(chunk, total);
+
+    std::ifstream file;
+
+    if(src.is_file())
+    {
+        file.open(src.fname, std::ios::binary);
+
+        if(!file.good())
+        {
+            lg::error("Could not open stream source ", src.fname);
+            return false;
+        }
+    }
+
+    int num_slots = queues.size();
+
+    std::vector<stream_slot> slots;
+    slots.reserve(num_slots);
+
+    for(int i=0; i < num_slots; i++)
+        slots.emplace_back(ctx);
+
+    int64_t num_chunks = (total + chunk - 1) / chunk;
+
+    LG_DEBUG("Streaming ", total, " items in ", num_chunks, " chunks of ", chunk);
+
+    ///chunks finish in the order they were issued, so this also keeps combine in chunk order
+    auto retire = [&](stream_slot& s)
+    {
+        if(s.done == nullptr)
+            return;
+
+        clWaitForEvents(1, &s.done);
+        clReleaseEvent(s.done);
+
+        s.done = nullptr;
+
+        if(combine)
+            (*combine)(s.first, s.count, &s.host_out[0]);
+    };
+
+    bool ok = true;
+
+    for(int64_t k=0; k < num_chunks && ok; k++)
+    {
+        stream_slot& s = slots[k % num_slots];
+        command_queue& cqueue = queues[k % num_slots];
+
+        retire(s);
+
+        if(!s.allocated)
+        {
+            s.in.alloc_bytes((chunk + 2 * halo_items) * item_bytes);
+            s.out.alloc_bytes(combine ? partial_bytes : chunk * out_bytes_per_item);
+            s.allocated = true;
+        }
+
+        s.first = k * chunk;
+        s.count = std::min(chunk, total - s.first);
+
+        int64_t load_first = std::max(s.first - halo_items, (int64_t)0);
+        int64_t load_end = std::min(s.first + s.count + halo_items, total);
+        int64_t load_bytes = (load_end - load_first) * item_bytes;
+
+        const void* upload_from = nullptr;
+
+        if(src.is_file())
+        {
+            ///the last write out of host_in finished with the previous chunk in this slot
+            s.host_in.resize(load_bytes);
+
+            file.seekg(load_first * item_bytes);
+            file.read(&s.host_in[0], load_bytes);
+
+            if(file.gcount() != load_bytes)
+            {
+                lg::error("Short read from stream source ", src.fname);
+                ok = false;
+                break;
+            }
+
+            upload_from = &s.host_in[0];
+        }
+        else
+        {
+            upload_from = (const char*)src.host + load_first * item_bytes;
+        }
+
+        cl_int err = dispatch_write(cqueue, s.in, 0, load_bytes, upload_from, false, 0, nullptr, nullptr);
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Error uploading stream chunk ", k, " err ", err);
+            ok = false;
+            break;
+        }
+
+        ///inputs past 2^31 items are the whole point, so these are longs in the kernel too
+        cl_long first = s.first;
+        cl_long count = s.count;
+        cl_long halo_before = s.first - load_first;
+
+        args pack = extra;
+        pack.push_back(s.in);
+        pack.push_back(s.out);
+        pack.push_back(first);
+        pack.push_back(count);
+        pack.push_back(halo_before);
+
+        int64_t g_ws[1] = {s.count};
+        int64_t l_ws[1] = {local_size};
+
+        cqueue.exec(kern, pack, g_ws, l_ws);
+
+        if(combine)
+        {
+            s.host_out.resize(partial_bytes);
+
+            err = dispatch_read(cqueue, s.out, 0, partial_bytes, &s.host_out[0], false, 0, nullptr, &s.done);
+        }
+        else
+        {
+            err = dispatch_read(cqueue, s.out, 0, s.count * out_bytes_per_item, (char*)dst + s.first * out_bytes_per_item, false, 0, nullptr, &s.done);
+        }
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Error reading back stream chunk ", k, " err ", err);
+            s.done = nullptr;
+            ok = false;
+            break;
+        }
+
+        cqueue.flush();
+    }
+
+    for(int64_t k=0; k < num_slots; k++)
+    {
+        ///oldest first
+        stream_slot& s = slots[(num_chunks + k) % num_slots];
+
+        if(ok)
+            retire(s);
+        else if(s.done)
+        {
+            clWaitForEvents(1, &s.done);
+            clReleaseEvent(s.done);
+            s.done = nullptr;
+        }
+    }
+
+    for(int i=0; i < num_slots; i++)
+    {
+        queues[i].block();
+
+        if(slots[i].allocated)
+        {
+            slots[i].in.release();
+            slots[i].out.release();
+        }
+    }
+
+    return ok;
+}
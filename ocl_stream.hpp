@@ -0,0 +1,66 @@
+#ifndef OCL_STREAM_HPP_INCLUDED
+#define OCL_STREAM_HPP_INCLUDED
+
+#include "ocl.hpp"
+#include <functional>
+
+///streams inputs that don't fit on the device through a kernel a chunk at a time
+///each pipeline slot has its own queue and buffers, so one chunk uploads while another runs and another reads back
+///device memory use is bounded by device_budget however big the input is
+
+///the kernel gets the caller's args first, then
+///    __global in_type* in, __global out_type* out, long first, long count, long halo_before
+///in[halo_before + i] is owned item i of this chunk, which is item first + i of the whole input
+///up to halo_items either side of the owned range are valid too, except at the ends of the input
+///the global size is count rounded up to local_size, so bounds check against count
+
+namespace cl
+{
+    struct stream_source
+    {
+        const void* host = nullptr;
+        std::string fname;
+        int64_t bytes = 0;
+
+        ///memory has to stay valid until the executor returns
+        static stream_source from_host(const void* ptr, int64_t bytes);
+        static stream_source from_file(const std::string& fname);
+
+        bool is_file() const
+        {
+            return host == nullptr;
+        }
+    };
+
+    struct stream_executor
+    {
+        context& ctx;
+
+        ///one in order queue per pipeline slot
+        std::vector<command_queue> queues;
+
+        ///total device memory across every slot's buffers, 0 picks a quarter of global memory
+        int64_t device_budget = 0;
+        int64_t local_size = 128;
+
+        ///3 slots lets upload, compute, and readback all overlap
+        stream_executor(context& ctx, int slots = 3);
+
+        ///every chunk writes out_bytes_per_item per owned item, in order into dst
+        bool concat(kernel& kern, args& extra, const stream_source& src, int64_t item_bytes, int64_t halo_items, void* dst, int64_t out_bytes_per_item);
+
+        ///every chunk writes partial_bytes, combine gets them in chunk order
+        bool reduce(kernel& kern, args& extra, const stream_source& src, int64_t item_bytes, int64_t halo_items, int64_t partial_bytes,
+                    const std::function<void(int64_t first, int64_t count, const void* partial)>& combine);
+
+        ///owned items per chunk for these sizes, after the budget is split across the slots
+        int64_t chunk_items(int64_t item_bytes, int64_t halo_items, int64_t out_bytes_per_chunk_item, int64_t fixed_out_bytes);
+
+    private:
+        bool run(kernel& kern, args& extra, const stream_source& src, int64_t item_bytes, int64_t halo_items,
+                 void* dst, int64_t out_bytes_per_item, int64_t partial_bytes,
+                 const std::function<void(int64_t first, int64_t count, const void* partial)>* combine);
+    };
+}
+
+#endif // OCL_STREAM_HPP_INCLUDED
@@ -0,0 +1,290 @@
+#include "ocl_tiled.hpp"
+#include <algorithm>
+
+cl::tiled_executor::tiled_executor(context& in, int num_queues) : ctx(in)
+{
+    for(int i=0; i < std::max(num_queues, 1); i++)
+    {
+        queues.emplace_back(ctx, ctx.selected_device, 0);
+    }
+}
+
+vec2i cl::tiled_executor::tile_size(vec2i dims, const tile_format& in_format, const tile_format& out_format)
+{
+    size_t max_w = 0;
+    size_t max_h = 0;
+
+    clGetDeviceInfo(ctx.selected_device, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(size_t), &max_w, nullptr);
+    clGetDeviceInfo(ctx.selected_device, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(size_t), &max_h, nullptr);
+
+    ///8192 is the minimum the spec allows
+    if(max_w == 0)
+        max_w = 8192;
+
+    if(max_h == 0)
+        max_h = 8192;
+
+    int64_t tw = std::min((int64_t)dims.x(), (int64_t)max_w - 2 * halo);
+    int64_t th = std::min((int64_t)dims.y(), (int64_t)max_h - 2 * halo);
+
+    int64_t pixel_bytes = in_format.pixel_bytes + out_format.pixel_bytes;
+    int64_t slots = queues.size();
+
+    auto tile_bytes = [&]()
+    {
+        return (tw + 2 * halo) * (th + 2 * halo) * pixel_bytes * slots;
+    };
+
+    while(tile_bytes() > tile_budget && (tw > 1 || th > 1))
+    {
+        if(tw >= th)
+            tw = std::max(tw / 2, (int64_t)1);
+        else
+            th = std::max(th / 2, (int64_t)1);
+    }
+
+    ///whole workgroups per tile, apart from the ones at the edge of the image
+    if(tw > local_size[0] && tw < dims.x())
+        tw = (tw / local_size[0]) * local_size[0];
+
+    if(th > local_size[1] && th < dims.y())
+        th = (th / local_size[1]) * local_size[1];
+
+    return {(int)tw, (int)th};
+}
+
+namespace
+{
+    struct tile_slot
+    {
+        cl::buffer in;
+        cl::buffer out;
+        bool allocated = false;
+        cl_event done = nullptr;
+
+        tile_slot(cl::context& ctx) : in(ctx), out(ctx) {}
+    };
+
+    bool create_tile_image(cl::context& ctx, cl::buffer& buf, int w, int h, const cl::tile_format& fmt)
+    {
+        cl_image_format format;
+        format.image_channel_order = fmt.order;
+        format.image_channel_data_type = fmt.type;
+
+        cl_int err = CL_SUCCESS;
+
+        buf.cmem = clCreateImage2D(ctx, CL_MEM_READ_WRITE, &format, w, h, 0, nullptr, &err);
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Error creating ", w, "x", h, " tile image ", err);
+            return false;
+        }
+
+        buf.format = cl::buffer::IMAGE;
+        buf.image_dimensionality = 2;
+        buf.image_dims[0] = w;
+        buf.image_dims[1] = h;
+        buf.byte_per_pixel = fmt.pixel_bytes;
+        buf.image_order = fmt.order;
+        buf.image_type = fmt.type;
+        buf.alloc_size = (int64_t)w * h * fmt.pixel_bytes;
+
+        buf.account_alloc(buf.alloc_size);
+
+        return true;
+    }
+}
+
+bool cl::tiled_executor::run(kernel& kern, args& extra, vec2i dims, const void* in, const tile_format& in_format, void* out, const tile_format& out_format)
+{
+    if(dims.x() <= 0 || dims.y() <= 0)
+        return true;
+
+    vec2i tile = tile_size(dims, in_format, out_format);
+
+    if(tile.x() <= 0 || tile.y() <= 0)
+    {
+        lg::error("Halo of ", halo, " doesn't fit in a device image");
+        return false;
+    }
+
+    int tiles_x = (dims.x() + tile.x() - 1) / tile.x();
+    int tiles_y = (dims.y() + tile.y() - 1) / tile.y();
+
+    LG_DEBUG("Tiling ", dims.x(), "x", dims.y(), " into ", tiles_x * tiles_y, " tiles of ", tile.x(), "x", tile.y());
+
+    int num_slots = queues.size();
+
+    std::vector<tile_slot> slots;
+    slots.reserve(num_slots);
+
+    for(int i=0; i < num_slots; i++)
+        slots.emplace_back(ctx);
+
+    size_t in_pitch = (size_t)dims.x() * in_format.pixel_bytes;
+    size_t out_pitch = (size_t)dims.x() * out_format.pixel_bytes;
+
+    int width = dims.x();
+    int height = dims.y();
+
+    bool ok = true;
+
+    int num_tiles = tiles_x * tiles_y;
+
+    for(int k=0; k < num_tiles && ok; k++)
+    {
+        tile_slot& s = slots[k % num_slots];
+        command_queue& cqueue = queues[k % num_slots];
+
+        ///the readback was the last thing this slot did, so everything else it did is done too
+        if(s.done)
+        {
+            clWaitForEvents(1, &s.done);
+            clReleaseEvent(s.done);
+            s.done = nullptr;
+        }
+
+        if(!s.allocated)
+        {
+            if(!create_tile_image(ctx, s.in, tile.x() + 2 * halo, tile.y() + 2 * halo, in_format))
+            {
+                ok = false;
+                break;
+            }
+
+            if(!create_tile_image(ctx, s.out, tile.x(), tile.y(), out_format))
+            {
+                s.in.release();
+
+                ok = false;
+                break;
+            }
+
+            s.allocated = true;
+        }
+
+        int out_x = (k % tiles_x) * tile.x();
+        int out_y = (k / tiles_x) * tile.y();
+
+        int own_w = std::min(tile.x(), width - out_x);
+        int own_h = std::min(tile.y(), height - out_y);
+
+        int in_x = std::max(out_x - halo, 0);
+        int in_y = std::max(out_y - halo, 0);
+
+        int in_w = std::min(out_x + own_w + halo, width) - in_x;
+        int in_h = std::min(out_y + own_h + halo, height) - in_y;
+
+        size_t origin[3] = {0, 0, 0};
+        size_t in_region[3] = {(size_t)in_w, (size_t)in_h, 1};
+
+        ///straight out of the big host image, the row pitch skips the rest of each row
+        const char* in_ptr = (const char*)in + in_y * in_pitch + (size_t)in_x * in_format.pixel_bytes;
+
+        s.in.invalidate_reads();
+
+        stats_transfer(ctx, true, (int64_t)in_w * in_h * in_format.pixel_bytes);
+
+        cl_int err = clEnqueueWriteImage(cqueue, s.in.cmem, CL_FALSE, origin, in_region, in_pitch, 0, in_ptr, 0, nullptr, nullptr);
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Error uploading tile ", k, " err ", err);
+            ok = false;
+            break;
+        }
+
+        capture_image(cqueue, s.in, true, origin, in_region, in_pitch, in_ptr, nullptr);
+
+        args pack = extra;
+        pack.push_back(s.in);
+        pack.push_back(s.out);
+        pack.push_back(in_x);
+        pack.push_back(in_y);
+        pack.push_back(out_x);
+        pack.push_back(out_y);
+        pack.push_back(width);
+        pack.push_back(height);
+
+        for(int i=0; i < (int)pack.arg_list.size() && ok; i++)
+        {
+            #ifdef CL_VERSION_2_0
+            if(pack.arg_list[i].svm)
+                err = clSetKernelArgSVMPointer(kern.ckernel, i, pack.arg_list[i].ptr);
+            else
+            #endif // CL_VERSION_2_0
+                err = clSetKernelArg(kern.ckernel, i, pack.arg_list[i].size, pack.arg_list[i].ptr);
+
+            if(err != CL_SUCCESS)
+            {
+                lg::error("Error setting tile arg ", i, " for ", kern.name, " err ", err);
+                ok = false;
+            }
+        }
+
+        if(!ok)
+            break;
+
+        size_t g_off[2] = {(size_t)out_x, (size_t)out_y};
+        size_t l_ws[2] = {(size_t)local_size[0], (size_t)local_size[1]};
+        size_t g_ws[2] = {(size_t)own_w, (size_t)own_h};
+
+        for(int i=0; i < 2; i++)
+        {
+            if((g_ws[i] % l_ws[i]) != 0)
+                g_ws[i] += l_ws[i] - (g_ws[i] % l_ws[i]);
+        }
+
+        err = clEnqueueNDRangeKernel(cqueue, kern.ckernel, 2, g_off, g_ws, l_ws, 0, nullptr, nullptr);
+
+        if(err != CL_SUCCESS)
+        {
+            static lg::rate_limiter limit;
+
+            lg::error_limited(limit, "clEnqueueNDRangeKernel Error in tile ", k, " with ", kern.name, " err ", err);
+            ok = false;
+            break;
+        }
+
+        pack.mark_written();
+
+        capture_exec(cqueue, kern, pack, 2, g_off, g_ws, l_ws, 0, nullptr, nullptr);
+
+        size_t out_region[3] = {(size_t)own_w, (size_t)own_h, 1};
+
+        char* out_ptr = (char*)out + out_y * out_pitch + (size_t)out_x * out_format.pixel_bytes;
+
+        stats_transfer(ctx, false, (int64_t)own_w * own_h * out_format.pixel_bytes);
+
+        err = clEnqueueReadImage(cqueue, s.out.cmem, CL_FALSE, origin, out_region, out_pitch, 0, out_ptr, 0, nullptr, &s.done);
+
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Error reading back tile ", k, " err ", err);
+            s.done = nullptr;
+            ok = false;
+            break;
+        }
+
+        capture_image(cqueue, s.out, false, origin, out_region, out_pitch, nullptr, &s.done);
+
+        cqueue.flush();
+    }
+
+    for(int i=0; i < num_slots; i++)
+    {
+        queues[i].block();
+
+        if(slots[i].done)
+            clReleaseEvent(slots[i].done);
+
+        if(slots[i].allocated)
+        {
+            slots[i].in.release();
+            slots[i].out.release();
+        }
+    }
+
+    return ok;
+}
@@ -0,0 +1,47 @@
+#ifndef OCL_TILED_HPP_INCLUDED
+#define OCL_TILED_HPP_INCLUDED
+
+#include "ocl.hpp"
+
+///runs an image kernel over a host image bigger than CL_DEVICE_IMAGE2D_MAX_WIDTH/HEIGHT, a tile at a time
+///tiles are spread round robin over several queues, each with its own pair of tile images, so device memory
+///is bounded by tile_budget rather than by the image
+
+///the kernel gets the caller's args first, then
+///    __read_only image2d_t in, __write_only image2d_t out, int in_x, int in_y, int out_x, int out_y, int width, int height
+///get_global_id is in whole image coordinates. in holds the image from (in_x, in_y), which includes up to halo pixels
+///either side of the tile, out is the tile itself from (out_x, out_y). width/height are the whole image's
+///clamp neighbour reads against width/height before subtracting in_x/in_y, and bounds check writes against get_image_width/height(out)
+
+namespace cl
+{
+    struct tile_format
+    {
+        cl_channel_order order = CL_RGBA;
+        cl_channel_type type = CL_FLOAT;
+        int pixel_bytes = 16;
+    };
+
+    struct tiled_executor
+    {
+        context& ctx;
+
+        std::vector<command_queue> queues;
+
+        ///device memory for all the tile images together
+        int64_t tile_budget = 256 * 1024 * 1024;
+        ///pixels of neighbourhood either side of each tile
+        int halo = 0;
+        int local_size[2] = {16, 16};
+
+        tiled_executor(context& ctx, int num_queues = 2);
+
+        ///the owned size of a tile, not including the halo
+        vec2i tile_size(vec2i dims, const tile_format& in_format, const tile_format& out_format);
+
+        ///in and out are tightly packed dims.x() * dims.y() host images, and have to stay valid until this returns
+        bool run(kernel& kern, args& extra, vec2i dims, const void* in, const tile_format& in_format, void* out, const tile_format& out_format);
+    };
+}
+
+#endif // OCL_TILED_HPP_INCLUDED
@@ -0,0 +1,617 @@
+#include "ocl_transfer.hpp"
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+
+std::string cl::transfer_method_name(transfer_method method)
+{
+    if(method == transfer_method::MAP)
+        return "MAP";
+
+    if(method == transfer_method::STAGED)
+        return "STAGED";
+
+    return "DIRECT";
+}
+
+static cl::transfer_method method_from_name(const std::string& name)
+{
+    if(name == "MAP")
+        return cl::transfer_method::MAP;
+
+    if(name == "STAGED")
+        return cl::transfer_method::STAGED;
+
+    return cl::transfer_method::DIRECT;
+}
+
+cl::transfer_method cl::transfer_table::pick(bool is_write, int64_t bytes) const
+{
+    const std::vector<transfer_method>& methods = is_write ? write : read;
+
+    if(methods.size() == 0)
+        return transfer_method::DIRECT;
+
+    int found = 0;
+
+    for(int i=0; i < (int)sizes.size(); i++)
+    {
+        if(sizes[i] <= bytes)
+            found = i;
+    }
+
+    return methods[found];
+}
+
+cl::transfer_state::~transfer_state()
+{
+    for(staging_chunk& chunk : staging)
+    {
+        if(chunk.busy)
+        {
+            clWaitForEvents(1, &chunk.busy);
+            clReleaseEvent(chunk.busy);
+        }
+
+        ///releasing a mapped buffer is fine, the runtime frees it once its unmapped implicitly
+        clReleaseMemObject(chunk.mem);
+    }
+}
+
+bool cl::transfer_state::has_table(cl_device_id device)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    return tables.find(device) != tables.end();
+}
+
+static bool event_done(cl_event evt)
+{
+    cl_int status = CL_COMPLETE;
+
+    clGetEventInfo(evt, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, nullptr);
+
+    return status == CL_COMPLETE || status < 0;
+}
+
+///caller holds the lock
+cl::staging_chunk* cl::transfer_state::acquire_staging(command_queue& cqueue, int64_t bytes)
+{
+    for(staging_chunk& chunk : staging)
+    {
+        if(chunk.size < bytes)
+            continue;
+
+        if(chunk.busy && !event_done(chunk.busy))
+            continue;
+
+        if(chunk.busy)
+        {
+            clReleaseEvent(chunk.busy);
+            chunk.busy = nullptr;
+        }
+
+        return &chunk;
+    }
+
+    if((int)staging.size() < max_chunks)
+    {
+        int64_t size = 1024 * 1024;
+
+        while(size < bytes)
+            size *= 2;
+
+        size = std::min(size, std::max(max_chunk_size, bytes));
+
+        staging_chunk chunk;
+        chunk.size = size;
+
+        cl_int err = CL_SUCCESS;
+
+        chunk.mem = clCreateBuffer(cqueue.ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, nullptr, &err);
+
+        if(err == CL_SUCCESS)
+            chunk.host = clEnqueueMapBuffer(cqueue, chunk.mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, nullptr, nullptr, &err);
+
+        if(err == CL_SUCCESS && chunk.host != nullptr)
+        {
+            staging.push_back(chunk);
+
+            return &staging.back();
+        }
+
+        lg::error("Could not create staging memory ", err);
+
+        if(chunk.mem)
+            clReleaseMemObject(chunk.mem);
+    }
+
+    if(staging.size() == 0)
+        return nullptr;
+
+    ///everything is busy or too small, wait for the biggest one that fits, or replace the smallest
+    staging_chunk* best = nullptr;
+
+    for(staging_chunk& chunk : staging)
+    {
+        if(chunk.size >= bytes && (best == nullptr || chunk.size > best->size))
+            best = &chunk;
+    }
+
+    if(best == nullptr)
+    {
+        best = &staging[0];
+
+        for(staging_chunk& chunk : staging)
+        {
+            if(chunk.size < best->size)
+                best = &chunk;
+        }
+
+        if(best->busy)
+            clWaitForEvents(1, &best->busy);
+
+        clEnqueueUnmapMemObject(cqueue, best->mem, best->host, 0, nullptr, nullptr);
+        clReleaseMemObject(best->mem);
+
+        if(best->busy)
+            clReleaseEvent(best->busy);
+
+        *best = staging_chunk();
+
+        cl_int err = CL_SUCCESS;
+
+        best->size = bytes;
+        best->mem = clCreateBuffer(cqueue.ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes, nullptr, &err);
+
+        if(err == CL_SUCCESS)
+            best->host = clEnqueueMapBuffer(cqueue, best->mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, bytes, 0, nullptr, nullptr, &err);
+
+        if(err == CL_SUCCESS && best->host != nullptr)
+            return best;
+
+        lg::error("Could not replace staging memory ", err);
+
+        if(best->mem)
+            clReleaseMemObject(best->mem);
+
+        ///the old chunk is already gone, so the slot goes with it
+        staging.erase(staging.begin() + (best - &staging[0]));
+
+        return nullptr;
+    }
+
+    if(best->busy)
+    {
+        clWaitForEvents(1, &best->busy);
+        clReleaseEvent(best->busy);
+        best->busy = nullptr;
+    }
+
+    return best;
+}
+
+cl::transfer_state& cl::get_transfers(context& ctx)
+{
+    return *ctx.transfers;
+}
+
+static cl_int enqueue_write_with(cl::transfer_method method, cl::command_queue& cqueue, cl::buffer& buf, int64_t offset, int64_t bytes, const void* src, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out)
+{
+    if(method == cl::transfer_method::DIRECT)
+    {
+        return clEnqueueWriteBuffer(cqueue, buf.cmem, blocking ? CL_TRUE : CL_FALSE, offset, bytes, src, num_events, events, out);
+    }
+
+    if(method == cl::transfer_method::MAP)
+    {
+        cl_map_flags flags = CL_MAP_WRITE;
+
+        #ifdef CL_VERSION_1_2
+        flags = CL_MAP_WRITE_INVALIDATE_REGION;
+        #endif // CL_VERSION_1_2
+
+        cl_int err = CL_SUCCESS;
+
+        void* mapped = clEnqueueMapBuffer(cqueue, buf.cmem, CL_TRUE, flags, offset, bytes, num_events, events, nullptr, &err);
+
+        if(err != CL_SUCCESS || mapped == nullptr)
+            return err;
+
+        if(mapped != src)
+            memcpy(mapped, src, bytes);
+
+        return clEnqueueUnmapMemObject(cqueue, buf.cmem, mapped, 0, nullptr, out);
+    }
+
+    cl::transfer_state& state = cl::get_transfers(cqueue.ctx);
+
+    std::lock_guard<std::mutex> guard(state.lock);
+
+    cl_event last = nullptr;
+    int64_t done = 0;
+
+    ///pipelined, the memcpy into one chunk overlaps the dma out of the last
+    while(done < bytes)
+    {
+        int64_t piece = std::min(bytes - done, state.max_chunk_size);
+
+        cl::staging_chunk* chunk = state.acquire_staging(cqueue, piece);
+
+        cl_event evt = nullptr;
+
+        ///out of pinned memory, the rest goes straight from the caller's memory
+        ///blocking, as staged callers are free to reuse src as soon as this returns
+        if(chunk == nullptr)
+        {
+            cl_int err = clEnqueueWriteBuffer(cqueue, buf.cmem, CL_TRUE, offset + done, bytes - done, (const char*)src + done, done == 0 ? num_events : 0, done == 0 ? events : nullptr, &evt);
+
+            if(last)
+                clReleaseEvent(last);
+
+            if(err != CL_SUCCESS)
+                return err;
+
+            last = evt;
+            break;
+        }
+
+        memcpy(chunk->host, (const char*)src + done, piece);
+
+        cl_int err = clEnqueueWriteBuffer(cqueue, buf.cmem, CL_FALSE, offset + done, piece, chunk->host, done == 0 ? num_events : 0, done == 0 ? events : nullptr, &evt);
+
+        if(err != CL_SUCCESS)
+        {
+            if(last)
+                clReleaseEvent(last);
+
+            return err;
+        }
+
+        clRetainEvent(evt);
+        chunk->busy = evt;
+
+        if(last)
+            clReleaseEvent(last);
+
+        last = evt;
+        done += piece;
+    }
+
+    if(last == nullptr)
+        return CL_SUCCESS;
+
+    if(blocking)
+        clWaitForEvents(1, &last);
+
+    if(out)
+        *out = last;
+    else
+        clReleaseEvent(last);
+
+    return CL_SUCCESS;
+}
+
+static cl_int enqueue_read_with(cl::transfer_method method, cl::command_queue& cqueue, cl::buffer& buf, int64_t offset, int64_t bytes, void* dst, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out)
+{
+    ///reading through staging memory needs a host memcpy after the transfer, so it only works blocking
+    if(method == cl::transfer_method::DIRECT || (method == cl::transfer_method::STAGED && !blocking))
+    {
+        return clEnqueueReadBuffer(cqueue, buf.cmem, blocking ? CL_TRUE : CL_FALSE, offset, bytes, dst, num_events, events, out);
+    }
+
+    if(method == cl::transfer_method::MAP)
+    {
+        cl_int err = CL_SUCCESS;
+
+        void* mapped = clEnqueueMapBuffer(cqueue, buf.cmem, CL_TRUE, CL_MAP_READ, offset, bytes, num_events, events, nullptr, &err);
+
+        if(err != CL_SUCCESS || mapped == nullptr)
+            return err;
+
+        if(mapped != dst)
+            memcpy(dst, mapped, bytes);
+
+        return clEnqueueUnmapMemObject(cqueue, buf.cmem, mapped, 0, nullptr, out);
+    }
+
+    cl::transfer_state& state = cl::get_transfers(cqueue.ctx);
+
+    std::lock_guard<std::mutex> guard(state.lock);
+
+    int64_t done = 0;
+
+    while(done < bytes)
+    {
+        int64_t piece = std::min(bytes - done, state.max_chunk_size);
+
+        cl::staging_chunk* chunk = state.acquire_staging(cqueue, piece);
+
+        ///out of pinned memory, the rest goes straight into the caller's memory
+        if(chunk == nullptr)
+        {
+            cl_int err = clEnqueueReadBuffer(cqueue, buf.cmem, CL_TRUE, offset + done, bytes - done, (char*)dst + done, done == 0 ? num_events : 0, done == 0 ? events : nullptr, nullptr);
+
+            if(err != CL_SUCCESS)
+                return err;
+
+            break;
+        }
+
+        cl_int err = clEnqueueReadBuffer(cqueue, buf.cmem, CL_TRUE, offset + done, piece, chunk->host, done == 0 ? num_events : 0, done == 0 ? events : nullptr, nullptr);
+
+        if(err != CL_SUCCESS)
+            return err;
+
+        memcpy((char*)dst + done, chunk->host, piece);
+
+        done += piece;
+    }
+
+    ///everything's already finished, but callers may still want an event
+    if(out)
+        return clEnqueueMarkerWithWaitList(cqueue, 0, nullptr, out);
+
+    return CL_SUCCESS;
+}
+
+cl_int cl::transfer_write_with(transfer_method method, command_queue& cqueue, buffer& buf, int64_t offset, int64_t bytes, const void* src, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out)
+{
+    stats_transfer(buf.ctx, true, bytes);
+
+    cl_int err = enqueue_write_with(method, cqueue, buf, offset, bytes, src, blocking, num_events, events, out);
+
+    if(err == CL_SUCCESS)
+        capture_transfer(cqueue, buf, true, offset, bytes, src, num_events, events, out);
+
+    return err;
+}
+
+cl_int cl::transfer_read_with(transfer_method method, command_queue& cqueue, buffer& buf, int64_t offset, int64_t bytes, void* dst, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out)
+{
+    stats_transfer(buf.ctx, false, bytes);
+
+    cl_int err = enqueue_read_with(method, cqueue, buf, offset, bytes, dst, blocking, num_events, events, out);
+
+    if(err == CL_SUCCESS)
+        capture_transfer(cqueue, buf, false, offset, bytes, dst, num_events, events, out);
+
+    return err;
+}
+
+cl_int cl::dispatch_write(command_queue& cqueue, buffer& buf, int64_t offset, int64_t bytes, const void* src, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out)
+{
+    transfer_method method = transfer_method::DIRECT;
+
+    buf.invalidate_reads();
+
+    if(buf.zero_copy)
+    {
+        method = transfer_method::MAP;
+    }
+    else
+    {
+        transfer_state& state = get_transfers(cqueue.ctx);
+
+        std::lock_guard<std::mutex> guard(state.lock);
+
+        auto it = state.tables.find(cqueue.device);
+
+        if(it != state.tables.end())
+            method = it->second.pick(true, bytes);
+    }
+
+    ///mapping stalls the host until the device gets round to it, which is exactly what async callers don't want
+    ///that holds for zero copy buffers too, a direct transfer is still a plain memcpy for them
+    if(!blocking && method == transfer_method::MAP)
+        method = transfer_method::DIRECT;
+
+    return transfer_write_with(method, cqueue, buf, offset, bytes, src, blocking, num_events, events, out);
+}
+
+cl_int cl::dispatch_read(command_queue& cqueue, buffer& buf, int64_t offset, int64_t bytes, void* dst, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out)
+{
+    transfer_method method = transfer_method::DIRECT;
+
+    if(buf.zero_copy)
+    {
+        method = transfer_method::MAP;
+    }
+    else
+    {
+        transfer_state& state = get_transfers(cqueue.ctx);
+
+        std::lock_guard<std::mutex> guard(state.lock);
+
+        auto it = state.tables.find(cqueue.device);
+
+        if(it != state.tables.end())
+            method = it->second.pick(false, bytes);
+    }
+
+    if(!blocking && method == transfer_method::MAP)
+        method = transfer_method::DIRECT;
+
+    return transfer_read_with(method, cqueue, buf, offset, bytes, dst, blocking, num_events, events, out);
+}
+
+static std::string device_key(cl_device_id device)
+{
+    char name[1000] = {0};
+    char driver[1000] = {0};
+
+    clGetDeviceInfo(device, CL_DEVICE_NAME, 999, &name[0], nullptr);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, 999, &driver[0], nullptr);
+
+    std::string key = std::string(name) + "/" + driver;
+
+    ///the cache is whitespace separated
+    for(char& c : key)
+    {
+        if(c == ' ' || c == '\t' || c == '\n')
+            c = '_';
+    }
+
+    return key;
+}
+
+static bool load_calibration(const std::string& file, const std::string& key, cl::transfer_table& table)
+{
+    std::ifstream in(file);
+
+    if(!in.good())
+        return false;
+
+    std::string line;
+
+    while(std::getline(in, line))
+    {
+        std::stringstream str(line);
+
+        std::string dev, write_method, read_method;
+        int64_t size = 0;
+
+        str >> dev >> size >> write_method >> read_method;
+
+        if(dev != key || str.fail())
+            continue;
+
+        table.sizes.push_back(size);
+        table.write.push_back(method_from_name(write_method));
+        table.read.push_back(method_from_name(read_method));
+    }
+
+    return table.sizes.size() > 0;
+}
+
+static void save_calibration(const std::string& file, const std::string& key, const cl::transfer_table& table)
+{
+    std::vector<std::string> kept;
+
+    ///keep other devices' entries
+    {
+        std::ifstream in(file);
+        std::string line;
+
+        while(std::getline(in, line))
+        {
+            if(line.compare(0, key.size() + 1, key + " ") != 0)
+                kept.push_back(line);
+        }
+    }
+
+    std::ofstream out(file, std::ios::trunc);
+
+    for(const std::string& line : kept)
+        out << line << "\n";
+
+    for(int i=0; i < (int)table.sizes.size(); i++)
+    {
+        out << key << " " << table.sizes[i] << " " << cl::transfer_method_name(table.write[i]) << " " << cl::transfer_method_name(table.read[i]) << "\n";
+    }
+}
+
+void cl::calibrate_transfers(command_queue& cqueue, const std::string& cache_file, bool force)
+{
+    transfer_state& state = get_transfers(cqueue.ctx);
+
+    std::string key = device_key(cqueue.device);
+
+    transfer_table table;
+
+    if(!force && load_calibration(cache_file, key, table))
+    {
+        std::lock_guard<std::mutex> guard(state.lock);
+
+        state.tables[cqueue.device] = table;
+
+        lg::info("Loaded transfer calibration for ", key);
+        return;
+    }
+
+    lg::info("Calibrating transfers for ", key);
+
+    const transfer_method methods[3] = {transfer_method::DIRECT, transfer_method::MAP, transfer_method::STAGED};
+
+    const int64_t max_size = 64 * 1024 * 1024;
+
+    std::vector<char> host;
+    host.resize(max_size);
+
+    buffer buf(cqueue.ctx);
+    buf.policy.place = mem_policy::DEVICE;
+    buf.format = buffer::BUFFER;
+    buf.alloc_bytes(max_size);
+
+    auto now_ns = []()
+    {
+        return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+
+    for(int64_t size = 4 * 1024; size <= max_size; size *= 4)
+    {
+        int reps = std::max((int)((32 * 1024 * 1024) / size), 3);
+        reps = std::min(reps, 64);
+
+        double best_write = 0;
+        double best_read = 0;
+        transfer_method write_method = transfer_method::DIRECT;
+        transfer_method read_method = transfer_method::DIRECT;
+
+        for(transfer_method method : methods)
+        {
+            ///warm up, also allocates any staging memory outside the timing
+            transfer_write_with(method, cqueue, buf, 0, size, &host[0], true, 0, nullptr, nullptr);
+            transfer_read_with(method, cqueue, buf, 0, size, &host[0], true, 0, nullptr, nullptr);
+            cqueue.block();
+
+            double start = now_ns();
+
+            for(int i=0; i < reps; i++)
+                transfer_write_with(method, cqueue, buf, 0, size, &host[0], true, 0, nullptr, nullptr);
+
+            cqueue.block();
+
+            double write_time = (now_ns() - start) / reps;
+
+            start = now_ns();
+
+            for(int i=0; i < reps; i++)
+                transfer_read_with(method, cqueue, buf, 0, size, &host[0], true, 0, nullptr, nullptr);
+
+            cqueue.block();
+
+            double read_time = (now_ns() - start) / reps;
+
+            if(best_write == 0 || write_time < best_write)
+            {
+                best_write = write_time;
+                write_method = method;
+            }
+
+            if(best_read == 0 || read_time < best_read)
+            {
+                best_read = read_time;
+                read_method = method;
+            }
+        }
+
+        LG_DEBUG("Transfer ", size, " write ", transfer_method_name(write_method), " read ", transfer_method_name(read_method));
+
+        table.sizes.push_back(size);
+        table.write.push_back(write_method);
+        table.read.push_back(read_method);
+    }
+
+    buf.release();
+
+    {
+        std::lock_guard<std::mutex> guard(state.lock);
+
+        state.tables[cqueue.device] = table;
+    }
+
+    save_calibration(cache_file, key, table);
+}
@@ -0,0 +1,70 @@
+#ifndef OCL_TRANSFER_HPP_INCLUDED
+#define OCL_TRANSFER_HPP_INCLUDED
+
+#include "ocl.hpp"
+
+///picks how host <-> buffer transfers happen, per device and per size
+///calibrate_transfers measures each method once per device and caches the crossover points to disk
+///until a device is calibrated everything goes through clEnqueueWrite/ReadBuffer, same as before
+
+namespace cl
+{
+    enum class transfer_method
+    {
+        DIRECT, ///clEnqueueWriteBuffer/clEnqueueReadBuffer straight from the caller's memory
+        MAP,    ///map, memcpy, unmap
+        STAGED, ///memcpy through pinned (CL_MEM_ALLOC_HOST_PTR) memory, then a direct transfer from that
+    };
+
+    std::string transfer_method_name(transfer_method method);
+
+    ///the fastest method for each size, a size uses the entry with the largest size <= it
+    struct transfer_table
+    {
+        std::vector<int64_t> sizes;
+        std::vector<transfer_method> write;
+        std::vector<transfer_method> read;
+
+        transfer_method pick(bool is_write, int64_t bytes) const;
+    };
+
+    ///pinned host memory, persistently mapped
+    struct staging_chunk
+    {
+        cl_mem mem = nullptr;
+        void* host = nullptr;
+        int64_t size = 0;
+        ///last transfer out of this chunk, it can't be reused until this completes
+        cl_event busy = nullptr;
+    };
+
+    struct transfer_state
+    {
+        std::mutex lock;
+
+        std::map<cl_device_id, transfer_table> tables;
+
+        std::vector<staging_chunk> staging;
+
+        ///transfers bigger than this are pipelined through several chunks
+        int64_t max_chunk_size = 16 * 1024 * 1024;
+        int max_chunks = 4;
+
+        ~transfer_state();
+
+        bool has_table(cl_device_id device);
+
+        ///nullptr if no pinned memory could be had, callers fall back to a direct transfer
+        staging_chunk* acquire_staging(command_queue& cqueue, int64_t bytes);
+    };
+
+    transfer_state& get_transfers(context& ctx);
+
+    ///loads the cached table for the queue's device if there is one, otherwise measures it and saves it
+    void calibrate_transfers(command_queue& cqueue, const std::string& cache_file = "./cl_transfer_calibration.txt", bool force = false);
+
+    cl_int transfer_write_with(transfer_method method, command_queue& cqueue, buffer& buf, int64_t offset, int64_t bytes, const void* src, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out);
+    cl_int transfer_read_with(transfer_method method, command_queue& cqueue, buffer& buf, int64_t offset, int64_t bytes, void* dst, bool blocking, cl_uint num_events, const cl_event* events, cl_event* out);
+}
+
+#endif // OCL_TRANSFER_HPP_INCLUDED
@@ -0,0 +1,261 @@
+#include "ocl_transient.hpp"
+#include <algorithm>
+
+static bool lifetimes_overlap(int first_a, int last_a, int first_b, int last_b)
+{
+    return !(last_a < first_b || last_b < first_a);
+}
+
+cl::transient_planner::transient_planner(context& in) : ctx(in)
+{
+
+}
+
+cl::transient_planner::~transient_planner()
+{
+    reset();
+}
+
+int cl::transient_planner::declare(const std::string& name, int64_t bytes, int first_use, int last_use)
+{
+    transient t;
+    t.name = name;
+    t.bytes = std::max(bytes, (int64_t)1);
+    t.first_use = std::min(first_use, last_use);
+    t.last_use = std::max(first_use, last_use);
+
+    transients.push_back(t);
+
+    planned = false;
+
+    return transients.size() - 1;
+}
+
+void cl::transient_planner::release_pool()
+{
+    for(transient& t : transients)
+    {
+        if(t.buf)
+        {
+            t.buf->release();
+            delete t.buf;
+        }
+
+        t.buf = nullptr;
+        t.offset = -1;
+        t.aliases.clear();
+    }
+
+    if(pool)
+    {
+        pool->release();
+        delete pool;
+    }
+
+    pool = nullptr;
+    planned = false;
+}
+
+void cl::transient_planner::reset()
+{
+    release_pool();
+
+    for(transient& t : transients)
+    {
+        if(t.last_event.cevent)
+            clReleaseEvent(t.last_event.cevent);
+    }
+
+    transients.clear();
+}
+
+cl::transient_report cl::transient_planner::plan()
+{
+    release_pool();
+
+    transient_report report;
+
+    if(transients.size() == 0)
+    {
+        planned = true;
+        return report;
+    }
+
+    ///sub buffer origins have to be aligned to this
+    int64_t align = std::max(ctx.mem_base_align, (int64_t)1);
+
+    auto align_up = [&](int64_t val)
+    {
+        return ((val + align - 1) / align) * align;
+    };
+
+    int min_stage = transients[0].first_use;
+    int max_stage = transients[0].last_use;
+
+    for(transient& t : transients)
+    {
+        report.unaliased_bytes += t.bytes;
+
+        min_stage = std::min(min_stage, t.first_use);
+        max_stage = std::max(max_stage, t.last_use);
+    }
+
+    for(int stage = min_stage; stage <= max_stage; stage++)
+    {
+        int64_t live = 0;
+
+        for(transient& t : transients)
+        {
+            if(t.first_use <= stage && stage <= t.last_use)
+                live += t.bytes;
+        }
+
+        report.live_peak_bytes = std::max(report.live_peak_bytes, live);
+    }
+
+    ///biggest first, then first fit into the gaps left by everything alive at the same time
+    std::vector<int> order;
+
+    for(int i=0; i < (int)transients.size(); i++)
+        order.push_back(i);
+
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+    {
+        return transients[a].bytes > transients[b].bytes;
+    });
+
+    std::vector<int> placed;
+
+    int64_t pool_bytes = 0;
+
+    for(int idx : order)
+    {
+        transient& t = transients[idx];
+
+        std::vector<std::pair<int64_t, int64_t>> taken;
+
+        for(int other : placed)
+        {
+            transient& o = transients[other];
+
+            if(lifetimes_overlap(t.first_use, t.last_use, o.first_use, o.last_use))
+                taken.push_back({o.offset, o.offset + o.bytes});
+        }
+
+        std::sort(taken.begin(), taken.end());
+
+        int64_t candidate = 0;
+
+        for(auto& range : taken)
+        {
+            if(candidate + t.bytes <= range.first)
+                break;
+
+            candidate = std::max(candidate, align_up(range.second));
+        }
+
+        t.offset = candidate;
+        pool_bytes = std::max(pool_bytes, t.offset + t.bytes);
+
+        placed.push_back(idx);
+    }
+
+    ///anything that shares memory with an earlier transient has to wait for it to be finished with
+    for(transient& t : transients)
+    {
+        for(int other=0; other < (int)transients.size(); other++)
+        {
+            transient& o = transients[other];
+
+            if(&o == &t || o.last_use >= t.first_use)
+                continue;
+
+            bool memory_overlaps = t.offset < o.offset + o.bytes && o.offset < t.offset + t.bytes;
+
+            if(memory_overlaps)
+                t.aliases.push_back(other);
+        }
+    }
+
+    report.pool_bytes = pool_bytes;
+
+    pool = new buffer(ctx);
+    pool->alloc_bytes(pool_bytes);
+
+    for(transient& t : transients)
+    {
+        cl_buffer_region region;
+        region.origin = t.offset;
+        region.size = t.bytes;
+
+        cl_int err = CL_INVALID_MEM_OBJECT;
+        cl_mem sub = nullptr;
+
+        if(pool->cmem != nullptr)
+            sub = clCreateSubBuffer(pool->get(), CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+
+        t.buf = new buffer(ctx);
+
+        ///its own memory then, which still works, it just doesn't save anything
+        if(err != CL_SUCCESS)
+        {
+            lg::error("Error creating sub buffer for transient ", t.name, " err ", err, ", allocating it separately");
+
+            t.buf->alloc_bytes(t.bytes);
+
+            report.pool_bytes += t.bytes;
+            continue;
+        }
+
+        t.buf->format = buffer::BUFFER;
+        t.buf->cmem = sub;
+        t.buf->alloc_size = t.bytes;
+    }
+
+    planned = true;
+
+    lg::info("Transient pool ", report.pool_bytes, " bytes, unaliased ", report.unaliased_bytes, " live peak ", report.live_peak_bytes);
+
+    return report;
+}
+
+cl::buffer& cl::transient_planner::get(int handle)
+{
+    if(!planned)
+    {
+        lg::warn("Transient ", transients[handle].name, " fetched before plan(), planning now");
+
+        plan();
+    }
+
+    return *transients[handle].buf;
+}
+
+void cl::transient_planner::record_last_use(int handle, const cl::event& evt)
+{
+    cl::event& last = transients[handle].last_event;
+
+    ///our own reference, so the caller releasing theirs doesn't pull it out from under dependencies()
+    if(evt.cevent)
+        clRetainEvent(evt.cevent);
+
+    if(last.cevent)
+        clReleaseEvent(last.cevent);
+
+    last = evt;
+}
+
+std::vector<cl::event*> cl::transient_planner::dependencies(int handle)
+{
+    std::vector<cl::event*> ret;
+
+    for(int other : transients[handle].aliases)
+    {
+        cl::event& evt = transients[other].last_event;
+
+        if(!evt.bad())
+            ret.push_back(&evt);
+    }
+
+    return ret;
+}
@@ -0,0 +1,73 @@
+#ifndef OCL_TRANSIENT_HPP_INCLUDED
+#define OCL_TRANSIENT_HPP_INCLUDED
+
+#include "ocl.hpp"
+
+///per frame scratch buffers that share one pool
+///stages declare each transient with its size and the first and last stage that touch it,
+///plan() packs transients whose lifetimes don't overlap into the same memory and hands out sub buffers of the pool
+
+namespace cl
+{
+    struct transient_report
+    {
+        ///every transient with its own allocation
+        int64_t unaliased_bytes = 0;
+        ///most bytes live during any one stage, nothing can do better than this
+        int64_t live_peak_bytes = 0;
+        ///what the pool actually takes
+        int64_t pool_bytes = 0;
+    };
+
+    struct transient_planner
+    {
+        context& ctx;
+
+        transient_planner(context& ctx);
+        ~transient_planner();
+
+        ///stages are whatever order the caller runs things in, first_use and last_use are inclusive
+        ///returns a handle for get()
+        int declare(const std::string& name, int64_t bytes, int first_use, int last_use);
+
+        ///assigns offsets and allocates the pool. Declaring anything after this needs another plan()
+        ///a transient whose sub buffer can't be created gets an allocation of its own instead
+        transient_report plan();
+
+        buffer& get(int handle);
+
+        ///the event of the last command that uses this transient, later transients sharing its memory wait on it
+        ///the planner keeps its own reference until reset
+        void record_last_use(int handle, const cl::event& evt);
+        ///everything the first command using this transient has to wait for before it can overwrite the memory
+        std::vector<cl::event*> dependencies(int handle);
+
+        ///frees the pool and forgets every declaration
+        void reset();
+
+    private:
+        struct transient
+        {
+            std::string name;
+            int64_t bytes = 0;
+            int first_use = 0;
+            int last_use = 0;
+
+            int64_t offset = -1;
+            buffer* buf = nullptr;
+
+            ///earlier transients this one reuses memory from
+            std::vector<int> aliases;
+            cl::event last_event;
+        };
+
+        std::vector<transient> transients;
+
+        buffer* pool = nullptr;
+        bool planned = false;
+
+        void release_pool();
+    };
+}
+
+#endif // OCL_TRANSIENT_HPP_INCLUDED
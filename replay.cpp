@@ -0,0 +1,113 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <cl/cl.h>
+#include "ocl.hpp"
+#include "ocl_capture.hpp"
+#include "logging.hpp"
+
+///re-runs a trace from cl::start_capture on whatever device this machine has, pocl included
+///usage: replay trace.bin [--cpu|--gpu|--all] [--overlap] [--csv ops.csv]
+///prints a per kernel/op summary, --csv dumps every op's timing
+///--overlap lets ops run concurrently like they did when captured, so only the total is meaningful
+
+struct op_summary
+{
+    int count = 0;
+    int64_t bytes = 0;
+    double host_ms = 0;
+    double device_ms = 0;
+};
+
+int main(int argc, char* argv[])
+{
+    cl_device_type type = CL_DEVICE_TYPE_ALL;
+    std::string trace_file;
+    std::string csv_file;
+    bool serialise = true;
+
+    for(int i=1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if(arg == "--cpu")
+            type = CL_DEVICE_TYPE_CPU;
+        else if(arg == "--gpu")
+            type = CL_DEVICE_TYPE_GPU;
+        else if(arg == "--all")
+            type = CL_DEVICE_TYPE_ALL;
+        else if(arg == "--overlap")
+            serialise = false;
+        else if(arg == "--csv" && i + 1 < argc)
+            csv_file = argv[++i];
+        else if(trace_file.size() == 0 && arg.size() > 0 && arg[0] != '-')
+            trace_file = arg;
+        else
+        {
+            std::cerr << "Unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if(trace_file.size() == 0)
+    {
+        std::cerr << "usage: replay trace.bin [--cpu|--gpu|--all] [--overlap] [--csv ops.csv]" << std::endl;
+        return 1;
+    }
+
+    lg::set_logfile("./replay_log.txt");
+
+    cl::context ctx(type, false);
+
+    cl::replayer replay(ctx);
+    replay.serialise = serialise;
+
+    bool ok = replay.run(trace_file);
+
+    if(csv_file.size() > 0)
+    {
+        std::ofstream csv(csv_file);
+
+        csv << "index,op,name,bytes,host_ms,device_ms\n";
+
+        for(int i=0; i < (int)replay.timings.size(); i++)
+        {
+            const cl::replay_timing& t = replay.timings[i];
+
+            csv << i << "," << cl::trace_op_name(t.op) << "," << t.name << "," << t.bytes << "," << t.host_ms << "," << t.device_ms << "\n";
+        }
+    }
+
+    std::map<std::string, op_summary> summary;
+
+    for(const cl::replay_timing& t : replay.timings)
+    {
+        std::string key = cl::trace_op_name(t.op);
+
+        if(t.name.size() > 0)
+            key += " " + t.name;
+
+        op_summary& s = summary[key];
+        s.count++;
+        s.bytes += t.bytes;
+        s.host_ms += t.host_ms;
+        s.device_ms += t.device_ms;
+    }
+
+    std::vector<std::pair<std::string, op_summary>> sorted(summary.begin(), summary.end());
+
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b)
+    {
+        return a.second.host_ms > b.second.host_ms;
+    });
+
+    std::cout << "replayed " << replay.timings.size() << " ops on " << ctx.device_name << " in " << replay.total_ms << "ms" << std::endl;
+
+    for(auto& [name, s] : sorted)
+    {
+        std::cout << name << " count " << s.count << " bytes " << s.bytes << " host_ms " << s.host_ms << " device_ms " << s.device_ms << std::endl;
+    }
+
+    return ok ? 0 : 2;
+}